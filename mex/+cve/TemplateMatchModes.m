@@ -6,5 +6,6 @@ classdef TemplateMatchModes
     TM_CCORR_NORMED = 3
     TM_CCOEFF = 4
     TM_CCOEFF_NORMED = 5
+    TM_PHASE_CORR = 6     % not an OpenCV mode; phase correlation in cv.motionCorrect
   end
 end
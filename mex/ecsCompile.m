@@ -152,18 +152,16 @@ function ecsCompile(varargin)
   ecsOpts       = varargin;
 
   %% ----------  Additional OpenCV code compilation options
-  tiffOpts      = ecsOpts;
   if isempty(LIBTIFF)
-    tiffOpts    = [ tiffOpts, { '-ltiff' , '-L/usr/local/opt/libtiff/lib', '-I/usr/local/opt/libtiff/include'} ];
+    tiffLibOpts = { '-ltiff' , '-L/usr/local/opt/libtiff/lib', '-I/usr/local/opt/libtiff/include'};
   else
-    tiffOpts    = [ tiffOpts                                                                          ...
-                  , { '-ltiff'                                                                        ...
-                    , sprintf('-L"%s"', fullfile(LIBTIFF, 'project', 'libtiff', 'Release'))           ...
-                    , sprintf('-I"%s"', fullfile(LIBTIFF, 'project', 'libtiff'))                      ...
-                    , sprintf('-I"%s"', fullfile(LIBTIFF, 'libtiff'))                                 ...
-                    }                                                                                 ...
-                  ];
+    tiffLibOpts = { '-ltiff'                                                                          ...
+                  , sprintf('-L"%s"', fullfile(LIBTIFF, 'project', 'libtiff', 'Release'))             ...
+                  , sprintf('-I"%s"', fullfile(LIBTIFF, 'project', 'libtiff'))                        ...
+                  , sprintf('-I"%s"', fullfile(LIBTIFF, 'libtiff'))                                   ...
+                  };
   end
+  tiffOpts      = [ ecsOpts, tiffLibOpts ];
 
   %% ----------  Additional OpenCV code compilation options
   if debug
@@ -207,7 +205,7 @@ function ecsCompile(varargin)
   
 
   %% Get separate lists of OpenCV dependent and non-dependent code files
-  [cvSrc, tiffSrc, ecsSrc]  = getMEXCode(ECS_LIB, '*.cpp');
+  [cvSrc, tiffSrc, ecsSrc, cvTiffSrc] = getMEXCode(ECS_LIB, '*.cpp');
 
   %% Compile common object files
   ecsObjs       = doCompile(ecsSrc, ECS_LIB, ECS_LIB, objectExt, [{'-c'} ecsOpts], false, lazy);
@@ -217,23 +215,27 @@ function ecsCompile(varargin)
 
   %% Compile OpenCV specific object files
   cvObjs        = doCompile(cvSrc, ECS_LIB, ECS_LIB, objectExt, [{'-c'} cvOpts], false, lazy);
+  cvObjs        = [ cvObjs, doCompile(cvTiffSrc, ECS_LIB, ECS_LIB, objectExt, [{'-c'} cvOpts tiffLibOpts], false, lazy) ];
   cvOpts        = [cvOpts, cvObjs];
 
   %% Compile libtiff specific object files
   tiffObjs      = doCompile(tiffSrc, ECS_LIB, ECS_LIB, objectExt, [{'-c'} tiffOpts], false, lazy);
   tiffOpts      = [tiffOpts, tiffObjs];
+  cvTiffOpts    = [cvOpts, tiffLibOpts];
 
   %% Compile separately OpenCV dependent and non-dependent MEX programs
-  [cvSrc, tiffSrc, ecsSrc]  = getMEXCode(ECS_SRC, '*.cpp');
-  doCompile(ecsSrc , ECS_SRC, MEX_ECS, mexext, ecsOpts , true, lazy);
-  doCompile(tiffSrc, ECS_SRC, MEX_ECS, mexext, tiffOpts, true, lazy);
-  doCompile(cvSrc  , ECS_SRC, MEX_CV , mexext, cvOpts  , true, lazy);
+  [cvSrc, tiffSrc, ecsSrc, cvTiffSrc] = getMEXCode(ECS_SRC, '*.cpp');
+  doCompile(ecsSrc   , ECS_SRC, MEX_ECS, mexext, ecsOpts   , true, lazy);
+  doCompile(tiffSrc  , ECS_SRC, MEX_ECS, mexext, tiffOpts  , true, lazy);
+  doCompile(cvSrc    , ECS_SRC, MEX_CV , mexext, cvOpts    , true, lazy);
+  doCompile(cvTiffSrc, ECS_SRC, MEX_CV , mexext, cvTiffOpts, true, lazy);
 
   %% Compile separately private MEX programs
-  [cvSrc, tiffSrc, ecsSrc]  = getMEXCode(ECS_PRIVATE, '*.cpp');
-  doCompile(ecsSrc , ECS_PRIVATE, PRIVATE_ECS, mexext, ecsOpts , true, lazy);
-  doCompile(tiffSrc, ECS_PRIVATE, PRIVATE_ECS, mexext, tiffOpts, true, lazy);
-  doCompile(cvSrc  , ECS_PRIVATE, PRIVATE_CV , mexext, cvOpts  , true, lazy);
+  [cvSrc, tiffSrc, ecsSrc, cvTiffSrc] = getMEXCode(ECS_PRIVATE, '*.cpp');
+  doCompile(ecsSrc   , ECS_PRIVATE, PRIVATE_ECS, mexext, ecsOpts   , true, lazy);
+  doCompile(tiffSrc  , ECS_PRIVATE, PRIVATE_ECS, mexext, tiffOpts  , true, lazy);
+  doCompile(cvSrc    , ECS_PRIVATE, PRIVATE_CV , mexext, cvOpts    , true, lazy);
+  doCompile(cvTiffSrc, ECS_PRIVATE, PRIVATE_CV , mexext, cvTiffOpts, true, lazy);
 
   %% Generate enumeration types
   if genEnums
@@ -246,12 +248,13 @@ function ecsCompile(varargin)
 end
 
 %---------------------------------------------------------------------------------------------------
-function [cvMex, tiffMex, otherMex] = getMEXCode(srcDir, srcMask)
+function [cvMex, tiffMex, otherMex, cvTiffMex] = getMEXCode(srcDir, srcMask)
 
   if ~exist(srcDir, 'dir')
     cvMex             = {};
     tiffMex           = {};
     otherMex          = {};
+    cvTiffMex         = {};
     return;
   end
 
@@ -260,6 +263,7 @@ function [cvMex, tiffMex, otherMex] = getMEXCode(srcDir, srcMask)
   cvMex               = srcFile;
   tiffMex             = srcFile;
   otherMex            = srcFile;
+  cvTiffMex           = srcFile;
   
   for iFile = numel(srcFile):-1:1
     source            = fileread(srcFile(iFile).name);
@@ -268,18 +272,25 @@ function [cvMex, tiffMex, otherMex] = getMEXCode(srcDir, srcMask)
                               , 'lineanchors', 'dotexceptnewline', 'once'                     ...
                               );
     tiffMatch         = regexp( source                                                        ...
-                              , '^\s*#\s*include\s+.*(tiff)|\<TIFF[A-Z_]'                     ...
+                              , '^\s*#\s*include\s+.*([tT]iff)|\<TIFF[A-Z_]'                  ...
                               , 'lineanchors', 'dotexceptnewline', 'once'                     ...
                               );
-    if ~isempty(cvMatch)
+    if ~isempty(cvMatch) && ~isempty(tiffMatch)
+      cvMex(iFile)    = [];
+      tiffMex(iFile)  = [];
+      otherMex(iFile) = [];
+    elseif ~isempty(cvMatch)
       tiffMex(iFile)  = [];
       otherMex(iFile) = [];
+      cvTiffMex(iFile)= [];
     elseif ~isempty(tiffMatch)
       cvMex(iFile)    = [];
       otherMex(iFile) = [];
+      cvTiffMex(iFile)= [];
     else
       cvMex(iFile)    = [];
       tiffMex(iFile)  = [];
+      cvTiffMex(iFile)= [];
     end
   end
 
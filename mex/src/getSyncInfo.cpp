@@ -2,219 +2,335 @@
   Parses the TIFF file header to extract ScanImage specific synchronization information.
 
   Usage syntax:
-      [acquisition, epoch, frameTime, dataTime, data] = getSyncInfo(inputFile, dataType, frameSkip = [0 0])
+      [acquisition, epoch, frameTime, dataTime, data, fileFrames] = getSyncInfo(inputFile, dataType, frameSkip = [0 0], numThreads = number of cores)
+
+  inputFile can be a single file name or a cell array of file names, in which case the
+  frameTime, dataTime and data outputs are concatenated across files (in the given order),
+  with fileFrames specifying the number of frames read from each file. frameSkip is applied
+  separately to each file. acquisition has one entry per file, and epoch one row per file.
+
+  The frames of interest are split into contiguous ranges that are parsed concurrently by
+  up to numThreads threads, each with its own file handle. This requires the locations of
+  all pages to be known in advance (see TiffIndex), otherwise parsing is sequential.
 
   Author:   Sue Ann Koay (koay@princeton.edu)
 */
 
 
+#include <string>
 #include <vector>
+#include <atomic>
+#include <algorithm>
 #include <cstring>
 #include <cstdlib>
 #include <cstdint>
 #include <mex.h>
 #include <tiffio.h>
+#include "lib/tiffIndex.h"
+#include "lib/readAhead.h"
+#include "lib/scanImageSync.h"
+#include "lib/workerThreads.h"
+
+
+static const size_t     MIN_SHARD_FRAMES  = 256;      // minimum number of frames worth opening a separate file handle for
 
 
-static const char       ACQ_NAME[]    = "acquisitionNumbers";
-static const char       TIME_NAME[]   = "frameTimestamps_sec";
-static const char       EPOCH_NAME[]  = "epoch";
-static const char       DATA_NAME[]   = "I2CData";
-static const size_t     N_ACQNAME     = std::strlen(ACQ_NAME);
-static const size_t     N_TIMENAME    = std::strlen(TIME_NAME);
-static const size_t     N_EPOCHNAME   = std::strlen(EPOCH_NAME);
-static const size_t     N_DATANAME    = std::strlen(DATA_NAME);
-static const int        N_TIMESTAMP   = 6;
-static const double     INVALID       = mxGetNaN();
 
+//=============================================================================
+/// Outcome of parsing a range of frames, which is reported by the calling thread since workers cannot call into Matlab.
+enum ParseStatus
+{ PARSE_OK
+, PARSE_OPEN
+, PARSE_SEEK
+, PARSE_DESCRIPTION
+, PARSE_FIELD
+, PARSE_ENTRY
+, PARSE_EPOCH
+, PARSE_INCONSISTENT
+};
 
 
-template<typename Number>
-bool readScalarField(char*& desc, const char* fieldName, const size_t nameLength, std::vector<Number>& data)
+/**
+  Parses the headers of a contiguous range [beginFrame, endFrame) of the frames of interest
+  using its own libtiff handle, so that ranges can be processed concurrently. Per-frame
+  information is written directly into the provided (preallocated) output arrays, whereas
+  I2C data packets are accumulated locally since their size is not known in advance.
+*/
+template<typename Number, int NumBytes>
+struct SyncShard
 {
-  for (; *desc; ++desc) {
-    // Locate field name
-    if (std::strncmp(desc, fieldName, nameLength)) {
-      while (*desc && *desc != '\n')  ++desc;      // skip until end of line
-    }
-    else {            // match
-      for (desc += nameLength; *desc != '='; ++desc)
-        if (!*desc || *desc == '\n')
-          return false;
-
-      // Parse results as double precision
-      ++desc;
-      data.push_back(std::strtod(desc, &desc));
-      while (*desc && *desc != '\n')  ++desc;      // skip until end of line
-      return true;
+  size_t                iFile;
+  size_t                beginFrame;
+  size_t                endFrame;
+  std::vector<Number>   data;
+  int                   nData;
+  size_t                firstDataFrame;   ///< frame at which nData was determined
+
+  ParseStatus           status;
+  size_t                errorFrame;
+  const char*           errorField;
+  int                   errorValue;       ///< entry index, or number of elements, depending on status
+
+  SyncShard()
+    : iFile(0), beginFrame(0), endFrame(0), nData(0), firstDataFrame(0)
+    , status(PARSE_OK), errorFrame(0), errorField(0), errorValue(0)
+  { }
+
+  /**
+    Frame iFrame is located at page firstFrame + iFrame * stride of the file. If index is
+    null, pages are located by reading through the chain of directories. Outputs are
+    indexed by frame, except that acquisition and epoch are only set by the shard that
+    contains the first frame.
+  */
+  bool parse(const char* inputFile, const TiffIndex* index, const size_t firstFrame, const size_t stride, double& acquisition, double* epoch, double* frameTime, double* dataTime)
+  {
+    TIFF*               img           = TIFFOpen(inputFile, "r");
+    if (img == NULL)    return fail(PARSE_OPEN, beginFrame);
+
+    // Only the headers are needed, which are prefetched well ahead of parsing
+    TiffReadAhead       readAhead(64, false);
+    if (index)          readAhead.open(inputFile, *index);
+
+    FrameSyncParser     parser;
+    size_t              currentPage   = 0;
+    bool                isOK          = true;
+    for (size_t iFrame = beginFrame; isOK && iFrame < endFrame; ++iFrame) {
+      const size_t      iPage         = firstFrame + iFrame * stride;
+      readAhead.advance(iPage, stride);
+
+      if (index)
+        isOK            = index->seek(img, iPage);
+      else {
+        while (currentPage < iPage && TIFFReadDirectory(img))
+          ++currentPage;
+        isOK            = ( currentPage == iPage );
+      }
+
+      if (!isOK)        fail(PARSE_SEEK, iFrame);
+      else              isOK          = parseFrame(img, iFrame, parser, acquisition, epoch, frameTime[iFrame], dataTime[iFrame]);
     }
+
+    TIFFClose(img);
+    return isOK;
   }
-  return false;
-}
 
-template<typename Number>
-bool readVectorField(char*& desc, const char* fieldName, const size_t nameLength, std::vector<Number>& data)
-{
-  for (; *desc; ++desc) {
-    // Locate field name
-    if (std::strncmp(desc, fieldName, nameLength)) {
-      while (*desc && *desc != '\n')  ++desc;      // skip until end of line
+protected:
+  bool parseFrame(TIFF* img, const size_t iFrame, FrameSyncParser& parser, double& acquisition, double* epoch, double& frameTime, double& dataTime)
+  {
+    // Read image description tag and parse all fields of interest in one pass
+    char*               desc          = NULL;
+    if (!TIFFGetField(img, TIFFTAG_IMAGEDESCRIPTION, &desc))
+      return fail(PARSE_DESCRIPTION, iFrame);
+
+    // The acqusition number is assumed to be meaningfully recorded only for the first frame
+    switch (parser.parse(desc, std::strlen(desc), iFrame < 1)) {
+    case SYNC_OK:       break;
+    case SYNC_FIELD:    return fail(PARSE_FIELD, iFrame, parser.errorField);
+    case SYNC_ENTRY:    return fail(PARSE_ENTRY, iFrame, parser.errorField, parser.errorValue / NumBytes);
+    case SYNC_EPOCH:    return fail(PARSE_EPOCH, iFrame, parser.errorField, parser.errorValue);
     }
-    else {            // match
-      for (desc += nameLength; *desc != '['; ++desc)
-        if (!*desc || *desc == '\n')
-          return false;
-
-      // Parse results as double precision
-      for (++desc; *desc != ']';)
-        data.push_back(std::strtod(desc, &desc));
 
-      while (*desc && *desc != '\n')  ++desc;      // skip until end of line
+    frameTime           = parser.frameTime;
+    dataTime            = parser.dataTime;
+    if (iFrame < 1) {
+      acquisition       = parser.acquisition;
+      std::copy(parser.epoch, parser.epoch + N_TIMESTAMP, epoch);
+    }
+    if (mxIsNaN(dataTime))
       return true;
+
+    // Convert each group of NumBytes bytes to one item of data
+    const int           count         = static_cast<int>(parser.data.size() / NumBytes);
+    if (static_cast<size_t>(count) * NumBytes != parser.data.size())
+      return fail(PARSE_ENTRY, iFrame, DATA_NAME, count);
+    for (int iData = 0; iData < count; ++iData) {
+      Number            value;
+      std::memcpy(&value, parser.data.data() + iData * NumBytes, NumBytes);
+      data.push_back(value);
+    }
+
+    if (nData < 1) {
+      nData             = count;
+      firstDataFrame    = iFrame;
     }
+    else if (nData != count)
+      return fail(PARSE_INCONSISTENT, iFrame, DATA_NAME, count);
+    return true;
   }
-  return false;
-}
+
+  bool fail(const ParseStatus what, const size_t iFrame, const char* field = 0, const int value = 0)
+  {
+    status              = what;
+    errorFrame          = iFrame;
+    errorField          = field;
+    errorValue          = value;
+    return false;
+  }
+};
 
 
 //=============================================================================
-template<typename Number, int NumBytes>
-void parseInfo(const char* inputFile, mxArray*& matAcquisition, mxArray*& matEpoch, mxArray*& matFrameTime, mxArray*& matDataTime, mxArray*& matData, const mxClassID dataClass, const int firstFrame, const int skipFrames)
+/// Frames of interest in one of the input files, and where they are located in the concatenated output.
+struct SyncFile
 {
-  //----- Preallocate scratch space
-  std::vector<double>   acquisition, epoch;
-  std::vector<double>   frameTime, dataTime;
-  std::vector<Number>   data;
-  unsigned char         temp[NumBytes];
+  const char*           path;
+  TiffIndex             index;
+  bool                  hasIndex;
+  bool                  isOpen;
+  size_t                numPages;
+  size_t                nFrames;
+  size_t                frameOffset;
+  double                acquisition;
+  double                epoch[N_TIMESTAMP];
+
+  SyncFile()
+    : path(0), hasIndex(false), isOpen(false), numPages(0), nFrames(0), frameOffset(0), acquisition(0)
+  {
+    std::fill(epoch, epoch + N_TIMESTAMP, 0.);
+  }
+};
 
 
-  //----- Loop through directory headers
-  TIFF*                 img           = TIFFOpen(inputFile, "r");
-  if (img == NULL)      mexErrMsgIdAndTxt("getSyncInfo:input", "Failed to load input file '%s'.", inputFile);
-  for (int iSkip = 0; iSkip < firstFrame; ++iSkip)
-    TIFFReadDirectory(img);
+//=============================================================================
+template<typename Number, int NumBytes>
+void parseInfo(const std::vector<char*>& inputPath, const int nlhs, mxArray* plhs[], const mxClassID dataClass, const int firstFrame, const int skipFrames, const int numThreads)
+{
+  //----- Locate all directory headers, concurrently across files
+  std::vector<SyncFile> files(inputPath.size());
+  for (size_t iFile = 0; iFile < files.size(); ++iFile)
+    files[iFile].path   = inputPath[iFile];
+
+  std::string           error;
+  std::atomic<size_t>   nextFile(0);
+  if (!runThreads(static_cast<int>(std::min<size_t>(std::max(numThreads, 1), files.size())), [&](int) {
+        for (size_t iFile; (iFile = nextFile++) < files.size(); ) {
+          SyncFile&     file          = files[iFile];
+          TIFF*         img           = TIFFOpen(file.path, "r");
+          if (img == NULL)            continue;
+
+          // Use the page index, if available, to seek directly to frames of interest
+          file.hasIndex = file.index.build(file.path, img);
+          file.numPages = ( file.hasIndex ? file.index.numPages() : TIFFNumberOfDirectories(img) );
+          file.isOpen   = true;
+          TIFFClose(img);
+        }
+      }, &error))
+    mexErrMsgIdAndTxt("getSyncInfo:threads", "Failed to index input files: %s", error.c_str());
 
 
+  //----- Assign frames to contiguous ranges of the output, in order of files
+  const size_t          stride        = 1 + skipFrames;
   size_t                nFrames       = 0;
-  size_t                nData         = 0;
-  do {
-    // Read image description tag
-    char*               desc          = NULL;
-    if (!TIFFGetField(img, TIFFTAG_IMAGEDESCRIPTION, &desc))
-      mexErrMsgIdAndTxt("getSyncInfo:header", "Failed to read image description tag for frame %d of '%s'.", nFrames+1, inputFile);
-
-
-    // Locate acqusition number assuming that it is meaningfully recorded only for the first frame
-    if (nFrames < 1 && !readScalarField(desc, ACQ_NAME, N_ACQNAME, acquisition))
-      mexErrMsgIdAndTxt("getSyncInfo:header", "Failed to parse %s for frame %d of '%s'.", ACQ_NAME, nFrames+1, inputFile);
-
-    // Locate frame timestamp
-    if (!readScalarField(desc, TIME_NAME, N_TIMENAME, frameTime))
-      mexErrMsgIdAndTxt("getSyncInfo:header", "Failed to parse %s for frame %d of '%s'.", TIME_NAME, nFrames+1, inputFile);
-
-    // Locate wall clock time
-    if (!readVectorField(desc, EPOCH_NAME, N_EPOCHNAME, epoch))
-      mexErrMsgIdAndTxt("getSyncInfo:header", "Failed to parse %s for frame %d of '%s'.", EPOCH_NAME, nFrames+1, inputFile);
+  for (size_t iFile = 0; iFile < files.size(); ++iFile) {
+    SyncFile&           file          = files[iFile];
+    if (!file.isOpen)
+      mexErrMsgIdAndTxt("getSyncInfo:input", "Failed to load input file '%s'.", file.path);
+    if (static_cast<size_t>(firstFrame) >= file.numPages)
+      mexErrMsgIdAndTxt("getSyncInfo:input", "Frame offset %d exceeds the number of frames (%d) in '%s'.", firstFrame, static_cast<int>(file.numPages), file.path);
+
+    file.nFrames        = (file.numPages - firstFrame + stride - 1) / stride;
+    file.frameOffset    = nFrames;
+    nFrames            += file.nFrames;
+  }
 
+  // Preallocate output for per-frame information
+  plhs[2]               = mxCreateDoubleMatrix(1, nFrames, mxREAL);
+  plhs[3]               = mxCreateDoubleMatrix(1, nFrames, mxREAL);
+  double*               outFrameTime  = mxGetPr(plhs[2]);
+  double*               outDataTime   = mxGetPr(plhs[3]);
+
+  // Split frames of each file into ranges that are parsed in parallel, unless pages can only be located sequentially
+  std::vector<SyncShard<Number,NumBytes> >  shards;
+  for (size_t iFile = 0; iFile < files.size(); ++iFile) {
+    const SyncFile&     file          = files[iFile];
+    const size_t        maxShards     = ( file.hasIndex ? (file.nFrames + MIN_SHARD_FRAMES - 1) / MIN_SHARD_FRAMES : 1 );
+    const size_t        numShards     = std::min<size_t>(std::max(numThreads, 1), maxShards);
+    for (size_t iShard = 0; iShard < numShards; ++iShard) {
+      shards.push_back(SyncShard<Number,NumBytes>());
+      shards.back().iFile       = iFile;
+      shards.back().beginFrame  = file.nFrames *  iShard      / numShards;
+      shards.back().endFrame    = file.nFrames * (iShard + 1) / numShards;
+    }
+  }
 
-    // Locate I2C field entry
-    for (++desc; *desc; ++desc) {
-      if (std::strncmp(desc, DATA_NAME, N_DATANAME)) {
-        while (*desc && *desc != '\n')  ++desc;      // skip until end of line
-      }
-      else {            // match
-        desc           += N_DATANAME;
-        for (; *desc != '{'; ++desc)
-          if (!*desc || *desc == '\n')
-            mexErrMsgIdAndTxt("getSyncInfo:header", "Failed to parse %s for frame %d of '%s'.", DATA_NAME, nFrames+1, inputFile);
-
-        // Retain first entry
-        bool            noData        = false;
-        for (++desc; *desc != '{'; ++desc)
-          if (!*desc || *desc == '\n') {
-            noData      = true;
-            break;
-          }
-        if (noData) {
-          dataTime.push_back(INVALID);
-          break;
+  std::atomic<size_t>   nextShard(0);
+  if (!runThreads(static_cast<int>(std::min<size_t>(std::max(numThreads, 1), shards.size())), [&](int) {
+        for (size_t iShard; (iShard = nextShard++) < shards.size(); ) {
+          SyncFile&     file          = files[shards[iShard].iFile];
+          shards[iShard].parse( file.path, file.hasIndex ? &file.index : 0, firstFrame, stride, file.acquisition, file.epoch
+                              , outFrameTime + file.frameOffset, outDataTime + file.frameOffset
+                              );
         }
+      }, &error))
+    mexErrMsgIdAndTxt("getSyncInfo:threads", "Failed to parse input files: %s", error.c_str());
+
+
+  //----- Report the first failure, if any, in order of files and frames
+  int                   nData         = 0;
+  for (size_t iShard = 0; iShard < shards.size(); ++iShard) {
+    const SyncShard<Number,NumBytes>& shard = shards[iShard];
+    const char*         inputFile     = files[shard.iFile].path;
+    const int           iFrame        = static_cast<int>(shard.errorFrame) + 1;
+    switch (shard.status) {
+    case PARSE_OK:
+      break;
+    case PARSE_OPEN:
+      mexErrMsgIdAndTxt("getSyncInfo:input", "Failed to load input file '%s'.", inputFile);
+    case PARSE_SEEK:
+      mexErrMsgIdAndTxt("getSyncInfo:input", "Failed to locate directory for frame %d of '%s'.", iFrame, inputFile);
+    case PARSE_DESCRIPTION:
+      mexErrMsgIdAndTxt("getSyncInfo:header", "Failed to read image description tag for frame %d of '%s'.", iFrame, inputFile);
+    case PARSE_FIELD:
+      mexErrMsgIdAndTxt("getSyncInfo:header", "Failed to parse %s for frame %d of '%s'.", shard.errorField, iFrame, inputFile);
+    case PARSE_ENTRY:
+      mexErrMsgIdAndTxt("getSyncInfo:header", "Failed to parse %s entry %d for frame %d of '%s'.", shard.errorField, shard.errorValue, iFrame, inputFile);
+    case PARSE_EPOCH:
+      mexErrMsgIdAndTxt("getSyncInfo:header", "Incorrect number of elements %d (expected %d) per %s vector for frame %d of '%s'.", shard.errorValue, N_TIMESTAMP, EPOCH_NAME, iFrame, inputFile);
+    case PARSE_INCONSISTENT:
+      mexErrMsgIdAndTxt("getSyncInfo:header", "Inconsistent number of %s entries %d (expected %d) read for frame %d of '%s'.", DATA_NAME, shard.errorValue, shard.nData, iFrame, inputFile);
+    }
 
-        // Parse time stamp as double precision
-        ++desc;
-        dataTime.push_back(std::strtod(desc, &desc));
+    // The size of data packets must also agree across ranges and files
+    if (nData < 1)      nData         = shard.nData;
+    else if (shard.nData > 0 && shard.nData != nData)
+      mexErrMsgIdAndTxt("getSyncInfo:header", "Inconsistent number of %s entries %d (expected %d) read for frame %d of '%s'.", DATA_NAME, shard.nData, nData, shard.firstDataFrame + 1, inputFile);
+  }
 
-        // Parse data packet of the format: {timestamp, [x1 x2 ... xN]} --OR-- {timestamp, [x1,x2,...,xN]}
-        for (; *desc != '['; ++desc) {
-          if (!*desc || *desc == '\n')
-            mexErrMsgIdAndTxt("getSyncInfo:header", "Failed to parse %s for frame %d of '%s'.", DATA_NAME, nFrames+1, inputFile);
-        }
 
-        int             count         = 0;
-        for (++desc; *desc != ']'; ++count) {
-          if (!*desc || *desc == '\n')
-            mexErrMsgIdAndTxt("getSyncInfo:header", "Failed to parse %s for frame %d of '%s'.", DATA_NAME, nFrames+1, inputFile);
-
-          // Read in the number of bytes for the specified data size of the packet, and convert this to one item of data
-          for (int iByte = 0; iByte < NumBytes; ++iByte) {
-            const char* current       = desc;
-            temp[iByte] = static_cast<unsigned char>(std::strtoul(current, &desc, 10));
-            if (desc == current) {
-              if (iByte < 1)  break;
-              mexErrMsgIdAndTxt("getSyncInfo:header", "Failed to parse %s entry %d for frame %d of '%s'.", DATA_NAME, count, nFrames+1, inputFile);
-            }
-
-            // The delimiter depends on version of ScanImage, if this changes, should be added here
-            while (*desc == ' ' || *desc == ',')
-              ++desc;
-          }
-          data.push_back(*reinterpret_cast<Number*>(temp));
-        }
+  //----- Copy per-file information and data packets to Matlab, zero-filling frames without data
+  plhs[0]               = mxCreateDoubleMatrix (1           , files.size(), mxREAL);
+  plhs[1]               = mxCreateDoubleMatrix (files.size(), N_TIMESTAMP , mxREAL);
+  plhs[4]               = mxCreateNumericMatrix(nData       , nFrames     , dataClass, mxREAL);
+  double*               outAcquisition= mxGetPr(plhs[0]);
+  double*               outEpoch      = mxGetPr(plhs[1]);
+  Number*               outData       = (Number*) mxGetData(plhs[4]);
 
-        if (nData < 1)  nData         = count;
-        else if (nData != count)
-          mexErrMsgIdAndTxt("getSyncInfo:header", "Inconsistent number of %s entries %d (expected %d) read for frame %d of '%s'.", DATA_NAME, count, nData, nFrames+1, inputFile);
+  for (size_t iFile = 0; iFile < files.size(); ++iFile) {
+    outAcquisition[iFile]             = files[iFile].acquisition;
+    for (int iTime = 0; iTime < N_TIMESTAMP; ++iTime)
+      outEpoch[iFile + iTime * files.size()]  = files[iFile].epoch[iTime];
+  }
 
-        break;
+  for (size_t iShard = 0; iShard < shards.size(); ++iShard) {
+    const SyncShard<Number,NumBytes>& shard = shards[iShard];
+    const double*       dataTime      = outDataTime + files[shard.iFile].frameOffset;
+    for (size_t iFrame = shard.beginFrame, iSource = 0; iFrame < shard.endFrame; ++iFrame) {
+      if (mxIsNaN(dataTime[iFrame])) {
+        for (int iData = 0; iData < nData; ++iData, ++outData)
+          *outData      = 0;
+      } else {
+        for (int iData = 0; iData < nData; ++iData, ++iSource, ++outData)
+          *outData      = shard.data[iSource];
       }
     }
-    
-    ++nFrames;
-    for (int iSkip = 0; iSkip < skipFrames; ++iSkip)
-      TIFFReadDirectory(img);
-  } while (TIFFReadDirectory(img));
-
-
-
-  //----- Copy output to Matlab
-  matAcquisition        = mxCreateDoubleScalar(acquisition.size() ? acquisition[0] : 0.);
-  matEpoch              = mxCreateDoubleMatrix (1    , N_TIMESTAMP, mxREAL);
-  matFrameTime          = mxCreateDoubleMatrix (1    , nFrames    , mxREAL);
-  matDataTime           = mxCreateDoubleMatrix (1    , nFrames    , mxREAL);
-  matData               = mxCreateNumericMatrix(nData, nFrames    , dataClass, mxREAL);
-
-  double*               outEpoch      = mxGetPr(matEpoch);
-  double*               outFrameTime  = mxGetPr(matFrameTime);
-  double*               outDataTime   = mxGetPr(matDataTime );
-  Number*               outData       = (Number*) mxGetData(matData);
-
-  for (int iFrame = 0, iSource = 0; iFrame < nFrames; ++iFrame, ++outFrameTime, ++outDataTime) {
-    *outFrameTime       = frameTime[iFrame];
-    *outDataTime        = dataTime [iFrame];
-    if (mxIsNaN(*outDataTime)) {
-      for (int iData = 0; iData < nData; ++iData, ++outData)
-        *outData        = 0;
-    } else {
-      for (int iData = 0; iData < nData; ++iData, ++iSource, ++outData)
-        *outData        = data[iSource];
-    }
   }
 
-
-  if (epoch.size() != N_TIMESTAMP * nFrames)
-    mexErrMsgIdAndTxt("getSyncInfo:header", "Incorrect number of elements %d (expected %d) per %s vector in '%s'.", epoch.size()/nFrames, N_TIMESTAMP, EPOCH_NAME, inputFile);
-  for (size_t iData = 0; iData < N_TIMESTAMP; ++iData, ++outEpoch)
-    *outEpoch           = epoch[iData];
+  if (nlhs > 5) {
+    plhs[5]             = mxCreateDoubleMatrix(1, files.size(), mxREAL);
+    double*             outFileFrames = mxGetPr(plhs[5]);
+    for (size_t iFile = 0; iFile < files.size(); ++iFile)
+      outFileFrames[iFile]            = static_cast<double>(files[iFile].nFrames);
+  }
 }
 
 
@@ -223,23 +339,33 @@ void parseInfo(const char* inputFile, mxArray*& matAcquisition, mxArray*& matEpo
 void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
 {
   //----- Parse arguments
-  if (nlhs != 5 || nrhs < 2 || nrhs > 3) {
+  if (nlhs < 5 || nlhs > 6 || nrhs < 2 || nrhs > 4) {
     mexEvalString("help cv.getSyncInfo");
     mexErrMsgIdAndTxt ( "getSyncInfo:usage", "Incorrect number of inputs/outputs provided." );
   }
 
+  // Handle single vs. multiple input files
   const mxArray*        matInput      = prhs[0];
   const mxArray*        matType       = prhs[1];
   const mxArray*        frameSkip     = ( nrhs > 2 && !mxIsEmpty(prhs[2]) ? prhs[2] : 0 );
-  if (!mxIsChar(matInput))
-    mexErrMsgIdAndTxt("getSyncInfo:arguments", "inputFile must be a character array.");
+  std::vector<char*>    inputPath;
+  if (mxIsCell(matInput)) {
+    inputPath.resize(mxGetNumberOfElements(matInput));
+    for (size_t iIn = 0; iIn < inputPath.size(); ++iIn) {
+      inputPath[iIn]    = mxArrayToString(mxGetCell(matInput, iIn));
+      if (!inputPath[iIn])  mexErrMsgIdAndTxt("getSyncInfo:arguments", "Non-string item encountered in inputFile array.");
+    }
+  }
+  else if (!mxIsChar(matInput))
+    mexErrMsgIdAndTxt("getSyncInfo:arguments", "inputFile must be a character array or cell array of strings.");
+  else
+    inputPath.push_back( mxArrayToString(matInput) );
+
+  if (inputPath.empty())
+    mexErrMsgIdAndTxt("getSyncInfo:arguments", "At least one inputFile must be provided.");
   if (!mxIsChar(matType))
     mexErrMsgIdAndTxt("getSyncInfo:arguments", "dataType must be a character array.");
 
-
-  std::vector<char>     inputFile(mxGetNumberOfElements(matInput) + 1);
-  mxGetString(matInput, inputFile.data(), static_cast<mwSize>(inputFile.size()));
-
   std::vector<char>     dataType(mxGetNumberOfElements(matType) + 1);
   mxGetString(matType, dataType.data(), static_cast<mwSize>(dataType.size()));
 
@@ -248,22 +374,29 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
   int                   skipFrames      = 0;
   if (frameSkip) {
     if (mxGetNumberOfElements(frameSkip) != 2)
-      mexErrMsgIdAndTxt( "motionCorrect:arguments", "frameSkip must be a 2-element array [offset, skip]." );
+      mexErrMsgIdAndTxt( "getSyncInfo:arguments", "frameSkip must be a 2-element array [offset, skip]." );
     const double*       skip            = mxGetPr(frameSkip);
     firstFrame          = static_cast<int>( skip[0] );
     skipFrames          = static_cast<int>( skip[1] );
   }
-
-
-  if      (strcmp(dataType.data(), "int8"  ) == 0)   parseInfo<char          , 1>(inputFile.data(), plhs[0], plhs[1], plhs[2], plhs[3], plhs[4], mxINT8_CLASS  , firstFrame, skipFrames);
-  else if (strcmp(dataType.data(), "uint8" ) == 0)   parseInfo<unsigned char , 1>(inputFile.data(), plhs[0], plhs[1], plhs[2], plhs[3], plhs[4], mxUINT8_CLASS , firstFrame, skipFrames);  
-  else if (strcmp(dataType.data(), "int16" ) == 0)   parseInfo<short         , 2>(inputFile.data(), plhs[0], plhs[1], plhs[2], plhs[3], plhs[4], mxINT16_CLASS , firstFrame, skipFrames);  
-  else if (strcmp(dataType.data(), "uint16") == 0)   parseInfo<unsigned short, 2>(inputFile.data(), plhs[0], plhs[1], plhs[2], plhs[3], plhs[4], mxUINT16_CLASS, firstFrame, skipFrames);  
-  else if (strcmp(dataType.data(), "int32" ) == 0)   parseInfo<int           , 4>(inputFile.data(), plhs[0], plhs[1], plhs[2], plhs[3], plhs[4], mxINT32_CLASS , firstFrame, skipFrames);  
-  else if (strcmp(dataType.data(), "uint32") == 0)   parseInfo<unsigned int  , 4>(inputFile.data(), plhs[0], plhs[1], plhs[2], plhs[3], plhs[4], mxUINT32_CLASS, firstFrame, skipFrames);  
-  else if (strcmp(dataType.data(), "int64" ) == 0)   parseInfo<int64_t       , 8>(inputFile.data(), plhs[0], plhs[1], plhs[2], plhs[3], plhs[4], mxINT64_CLASS , firstFrame, skipFrames);  
-  else if (strcmp(dataType.data(), "uint64") == 0)   parseInfo<uint64_t      , 8>(inputFile.data(), plhs[0], plhs[1], plhs[2], plhs[3], plhs[4], mxUINT64_CLASS, firstFrame, skipFrames);  
-  else if (strcmp(dataType.data(), "single") == 0)   parseInfo<float         , 4>(inputFile.data(), plhs[0], plhs[1], plhs[2], plhs[3], plhs[4], mxSINGLE_CLASS, firstFrame, skipFrames);
-  else if (strcmp(dataType.data(), "double") == 0)   parseInfo<double        , 8>(inputFile.data(), plhs[0], plhs[1], plhs[2], plhs[3], plhs[4], mxDOUBLE_CLASS, firstFrame, skipFrames);  
+  if (firstFrame < 0 || skipFrames < 0)
+    mexErrMsgIdAndTxt( "getSyncInfo:arguments", "frameSkip must be non-negative." );
+
+  const int             numThreads      = ( nrhs > 3 && !mxIsEmpty(prhs[3]) ? int( mxGetScalar(prhs[3]) ) : defaultNumThreads() );
+
+
+  if      (strcmp(dataType.data(), "int8"  ) == 0)   parseInfo<char          , 1>(inputPath, nlhs, plhs, mxINT8_CLASS  , firstFrame, skipFrames, numThreads);
+  else if (strcmp(dataType.data(), "uint8" ) == 0)   parseInfo<unsigned char , 1>(inputPath, nlhs, plhs, mxUINT8_CLASS , firstFrame, skipFrames, numThreads);
+  else if (strcmp(dataType.data(), "int16" ) == 0)   parseInfo<short         , 2>(inputPath, nlhs, plhs, mxINT16_CLASS , firstFrame, skipFrames, numThreads);
+  else if (strcmp(dataType.data(), "uint16") == 0)   parseInfo<unsigned short, 2>(inputPath, nlhs, plhs, mxUINT16_CLASS, firstFrame, skipFrames, numThreads);
+  else if (strcmp(dataType.data(), "int32" ) == 0)   parseInfo<int           , 4>(inputPath, nlhs, plhs, mxINT32_CLASS , firstFrame, skipFrames, numThreads);
+  else if (strcmp(dataType.data(), "uint32") == 0)   parseInfo<unsigned int  , 4>(inputPath, nlhs, plhs, mxUINT32_CLASS, firstFrame, skipFrames, numThreads);
+  else if (strcmp(dataType.data(), "int64" ) == 0)   parseInfo<int64_t       , 8>(inputPath, nlhs, plhs, mxINT64_CLASS , firstFrame, skipFrames, numThreads);
+  else if (strcmp(dataType.data(), "uint64") == 0)   parseInfo<uint64_t      , 8>(inputPath, nlhs, plhs, mxUINT64_CLASS, firstFrame, skipFrames, numThreads);
+  else if (strcmp(dataType.data(), "single") == 0)   parseInfo<float         , 4>(inputPath, nlhs, plhs, mxSINGLE_CLASS, firstFrame, skipFrames, numThreads);
+  else if (strcmp(dataType.data(), "double") == 0)   parseInfo<double        , 8>(inputPath, nlhs, plhs, mxDOUBLE_CLASS, firstFrame, skipFrames, numThreads);
   else    mexErrMsgIdAndTxt("getSyncInfo:dataType", "Unsupported dataType '%s'.", dataType.data());
+
+  for (size_t iIn = 0; iIn < inputPath.size(); ++iIn)
+    mxFree(inputPath[iIn]);
 }
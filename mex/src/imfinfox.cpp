@@ -6,7 +6,7 @@
   correction shifts, and so forth.
 
   Usage syntax:
-    info = imfinfox( inputPath, [lazy = false] );
+    info = imfinfox( inputPath, [lazy = false], [numThreads = number of cores] );
   where inputPath can be either a string (single file), or a cellstring for 
   multi-file stacks.
 
@@ -14,10 +14,31 @@
   have the same width and height. An exception will be thrown if discrepancies 
   are encountered.
 
+  The contiguous field is true if the (first page of each) file is stored 
+  uncompressed with contiguous strips in native byte order, in which case 
+  cv.imreadx() can read the pixels via memory mapping instead of decoding.
+
+  If lazy = false, the location of all pages in each file is recorded in a 
+  sidecar index file (inputPath.idx), so that subsequent calls and readers can
+  access any frame without walking through the file. Set the TIFF_INDEX_DIR 
+  environment variable to a directory to store these elsewhere, or to '' to 
+  disable them.
+
+  Files are scanned concurrently by up to numThreads threads. The information
+  obtained for each file is cached in memory until this function is cleared, 
+  so that repeated calls for files that have not since been modified (as 
+  determined by their size and modification time) return immediately. This
+  cache is private to imfinfox; other functions such as cv.imreadx() instead
+  reuse the sidecar index files. An empty inputPath yields an empty stack.
+
   Author:   Sue Ann Koay (koay@princeton.edu)
 */
 
 
+#include <map>
+#include <mutex>
+#include <atomic>
+#include <string>
 #include <vector>
 #include <limits>
 #include <algorithm>
@@ -25,6 +46,8 @@
 #include <cstring>
 #include <mex.h>
 #include <tiffio.h>
+#include "lib/tiffIndex.h"
+#include "lib/workerThreads.h"
 
 #undef max
 
@@ -68,6 +91,122 @@ bool readVectorField(char*& desc, const char* fieldName, const size_t nameLength
 
 
 
+//_________________________________________________________________________
+/// Header information for a single file, obtained without any Matlab API calls.
+struct FileInfo
+{
+  enum Status { OK, FAIL_OPEN, FAIL_WIDTH, FAIL_HEIGHT, FAIL_BITS };
+
+  Status                      status;
+  uint32                      width;
+  uint32                      height;
+  uint16                      bitsPerSample;
+  uint16                      sampleFormat;
+  SampleFormatSource          formatSource;
+  std::vector<int>            channels;
+  bool                        isContiguous;
+  size_t                      numFrames;      ///< 0 if not counted (lazy mode)
+};
+
+/**
+  Reads the TIFF header of the given file, and if countFrames is true, also the number 
+  of frames using the page index. This is safe to call from worker threads.
+*/
+void scanFile(const char* path, const bool countFrames, FileInfo& info)
+{
+  info.numFrames              = 0;
+  TIFF*                       img             = TIFFOpen(path, "r");
+  if (img == NULL)            { info.status = FileInfo::FAIL_OPEN;    return; }
+
+  // Read info from TIFF header
+  info.status                 = FileInfo::OK;
+  if      (!TIFFGetField(img, TIFFTAG_IMAGEWIDTH   , &info.width        ))    info.status = FileInfo::FAIL_WIDTH;
+  else if (!TIFFGetField(img, TIFFTAG_IMAGELENGTH  , &info.height       ))    info.status = FileInfo::FAIL_HEIGHT;
+  else if (!TIFFGetField(img, TIFFTAG_BITSPERSAMPLE, &info.bitsPerSample))    info.status = FileInfo::FAIL_BITS;
+  if (info.status != FileInfo::OK) {
+    TIFFClose(img);
+    return;
+  }
+
+  // Same convention as used for decoding frames
+  info.sampleFormat           = tiffSampleFormat(img, &info.formatSource);
+
+  // Special case for ScanImage files: Parse image description tag for list of saved channels
+  char*                       desc            = NULL;
+  info.channels.clear();
+  if (TIFFGetField(img, TIFFTAG_IMAGEDESCRIPTION, &desc))
+    readVectorField(desc, CHANNELS_NAME, N_CHANNELSNAME, info.channels);
+
+  // Whether pixel data can be directly accessed instead of decoded
+  info.isContiguous           = ( contiguousPixelOffset(img) > 0 );
+
+  if (countFrames) {
+    TiffIndex                 index;
+    if (index.build(path, img)) {
+      info.numFrames          = index.numPages();
+      info.isContiguous       = info.isContiguous && index.isContiguous();
+    }
+    else
+      info.numFrames          = TIFFNumberOfDirectories(img);
+  }
+  TIFFClose(img);
+}
+
+
+//_________________________________________________________________________
+/**
+  In-memory cache of file information, valid for as long as the size and modification
+  time of the file are unchanged. Only complete scans (including the frame count) are
+  cached.
+*/
+class FileInfoCache
+{
+protected:
+  struct Entry
+  {
+    uint64_t                  fileSize;
+    int64_t                   modTime;
+    FileInfo                  info;
+  };
+
+  std::map<std::string, Entry>  entries;
+  std::mutex                    lock;
+
+public:
+  /// Returns cached or newly scanned information for the given file.
+  void get(const char* path, const bool countFrames, FileInfo& info)
+  {
+    Entry                     entry;
+    if (!getFileStamp(path, entry.fileSize, entry.modTime)) {
+      scanFile(path, countFrames, info);
+      return;
+    }
+
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      const std::map<std::string, Entry>::const_iterator  iEntry  = entries.find(path);
+      if ( iEntry != entries.end() 
+        && iEntry->second.fileSize == entry.fileSize 
+        && iEntry->second.modTime  == entry.modTime 
+         ) {
+        info                  = iEntry->second.info;
+        return;
+      }
+    }
+
+    scanFile(path, countFrames, info);
+    if (countFrames && info.status == FileInfo::OK) {
+      entry.info              = info;
+      std::lock_guard<std::mutex> guard(lock);
+      entries[path]           = entry;
+    }
+  }
+};
+
+static FileInfoCache          fileCache;
+
+
+
 ///////////////////////////////////////////////////////////////////////////
 // Main entry point to a MEX function
 ///////////////////////////////////////////////////////////////////////////
@@ -105,6 +244,25 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
                                             ;
 
 
+  //---------------------------------------------------------------------------
+  // Scan files concurrently, with each thread taking the next file in order. Since the
+  // files taken so far always form a prefix of the list, no more are needed once the 
+  // completed ones add up to maxNumFrames.
+  const size_t                numFiles        = ( lazy ? std::min<size_t>(1, inputPath.size()) : inputPath.size() );
+  std::vector<FileInfo>       fileInfo(numFiles);
+  std::vector<char>           isScanned(numFiles, false);
+  std::atomic<size_t>         nextFile        (0);
+  std::atomic<size_t>         scannedFrames   (0);
+  const int                   numThreads      = ( nrhs > 2 && !mxIsEmpty(prhs[2]) ? int( mxGetScalar(prhs[2]) ) : defaultNumThreads() );
+  runThreads(static_cast<int>(std::min<size_t>(std::max(numThreads, 1), numFiles)), [&](int) {
+    for (size_t iIn; scannedFrames < maxNumFrames && (iIn = nextFile++) < numFiles; ) {
+      fileCache.get(inputPath[iIn], !lazy, fileInfo[iIn]);
+      isScanned[iIn]          = true;
+      scannedFrames          += fileInfo[iIn].numFrames;
+    }
+  });
+
+
   //---------------------------------------------------------------------------
   // Get parameters of image stack
   size_t                      srcWidth        = 0;
@@ -115,70 +273,49 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
   mxArray*                    matNumFrames    = mxCreateDoubleMatrix(1, inputPath.size(), mxREAL);
   double*                     numFrames       = mxGetPr(matNumFrames);
   std::vector<int>            srcChannels;
-  for (size_t iIn = 0; iIn < inputPath.size(); ++iIn) 
+  bool                        isContiguous    = true;
+  for (size_t iIn = 0; iIn < numFiles && isScanned[iIn]; ++iIn) 
   {
-    TIFF*                     img             = TIFFOpen(inputPath[iIn], "r");
-    if (img == NULL)          mexErrMsgIdAndTxt("imfinfox:input", "Failed to load input file '%s'.", inputPath[iIn]);
-
-    // Read info from TIFF header
-    uint32                    width, height;
-    if (!TIFFGetField(img, TIFFTAG_IMAGEWIDTH, &width))
-      mexErrMsgIdAndTxt("imfinfox:header", "Failed to image width for '%s'.", inputPath[iIn]);
-    if (!TIFFGetField(img, TIFFTAG_IMAGELENGTH, &height))
-      mexErrMsgIdAndTxt("imfinfox:header", "Failed to image height for '%s'.", inputPath[iIn]);
-
-    uint16                    bitsPerSample, sampleFormat;
-    if (!TIFFGetField(img, TIFFTAG_BITSPERSAMPLE, &bitsPerSample))
-      mexErrMsgIdAndTxt("imfinfox:header", "Failed to read bits per sample for '%s'.", inputPath[iIn]);
-    if (!TIFFGetField(img, TIFFTAG_SAMPLEFORMAT, &sampleFormat)) {
-      double                  minValue;
-      if (!TIFFGetField(img, TIFFTAG_SMINSAMPLEVALUE, &minValue)) {
-        if (iIn < 1)
-          mexWarnMsgIdAndTxt("imfinfox:header", "Failed to read sample format for '%s', guessing based on number of bits per sample.", inputPath[iIn]);
-        minValue              = 0;
-      }
-      else if (iIn < 1)       mexWarnMsgIdAndTxt("imfinfox:header", "Failed to read sample format for '%s', deducing from minimum sample value instead.", inputPath[iIn]);
-      if (bitsPerSample < 32)
-        sampleFormat          = ( minValue < 0 ? SAMPLEFORMAT_INT : SAMPLEFORMAT_UINT );
-      else  sampleFormat      = SAMPLEFORMAT_IEEEFP;
+    const FileInfo&           info            = fileInfo[iIn];
+    switch (info.status) {
+    case FileInfo::FAIL_OPEN:   mexErrMsgIdAndTxt("imfinfox:input" , "Failed to load input file '%s'."         , inputPath[iIn]);
+    case FileInfo::FAIL_WIDTH:  mexErrMsgIdAndTxt("imfinfox:header", "Failed to image width for '%s'."         , inputPath[iIn]);
+    case FileInfo::FAIL_HEIGHT: mexErrMsgIdAndTxt("imfinfox:header", "Failed to image height for '%s'."        , inputPath[iIn]);
+    case FileInfo::FAIL_BITS:   mexErrMsgIdAndTxt("imfinfox:header", "Failed to read bits per sample for '%s'.", inputPath[iIn]);
+    default:                    break;
     }
 
-    // Special case for ScanImage files: Parse image description tag for list of saved channels
-    char*                     desc          = NULL;
-    if (iIn == 0 && TIFFGetField(img, TIFFTAG_IMAGEDESCRIPTION, &desc)) {
-      readVectorField(desc, CHANNELS_NAME, N_CHANNELSNAME, srcChannels);
-    }
+    if (iIn < 1 && info.formatSource == SAMPLEFORMAT_FROM_BITS)
+      mexWarnMsgIdAndTxt("imfinfox:header", "Failed to read sample format for '%s', guessing based on number of bits per sample.", inputPath[iIn]);
+    else if (iIn < 1 && info.formatSource == SAMPLEFORMAT_FROM_MINVALUE)
+      mexWarnMsgIdAndTxt("imfinfox:header", "Failed to read sample format for '%s', deducing from minimum sample value instead.", inputPath[iIn]);
+
+    // Only the first file is used for the list of channels
+    if (iIn == 0)
+      srcChannels             = info.channels;
+    if (!info.isContiguous)
+      isContiguous            = false;
 
 
     // Check for consistency across stack
     if (iIn > 0) {
-      if (srcWidth  != width        )   mexErrMsgIdAndTxt("imfinfox:stack", "Image width for '%s' is inconsistent with other file(s)."    , inputPath[iIn]);
-      if (srcHeight != height       )   mexErrMsgIdAndTxt("imfinfox:stack", "Image height for '%s' is inconsistent with other file(s)."   , inputPath[iIn]);
-      if (srcBits   != bitsPerSample)   mexErrMsgIdAndTxt("imfinfox:stack", "Bits per sample for '%s' is inconsistent with other file(s).", inputPath[iIn]);
-      if (srcFormat != sampleFormat )   mexErrMsgIdAndTxt("imfinfox:stack", "Sample format for '%s' is inconsistent with other file(s)."  , inputPath[iIn]);
-      //if (srcChannels.size() != channels.size())
-      //  mexErrMsgIdAndTxt("imfinfox:stack", "Number of channels for '%s' is inconsistent with other file(s).", inputPath[iIn]);
-      //for (size_t iChannel = 0; iChannel < channels.size(); ++iChannel)
-      //  if (srcChannels[iChannel] != channels[iChannel])
-      //    mexErrMsgIdAndTxt("imfinfox:stack", "Channel %d for '%s' is inconsistent with other file(s).", channels[iChannel], inputPath[iIn]);
+      if (srcWidth  != info.width        )  mexErrMsgIdAndTxt("imfinfox:stack", "Image width for '%s' is inconsistent with other file(s)."    , inputPath[iIn]);
+      if (srcHeight != info.height       )  mexErrMsgIdAndTxt("imfinfox:stack", "Image height for '%s' is inconsistent with other file(s)."   , inputPath[iIn]);
+      if (srcBits   != info.bitsPerSample)  mexErrMsgIdAndTxt("imfinfox:stack", "Bits per sample for '%s' is inconsistent with other file(s).", inputPath[iIn]);
+      if (srcFormat != info.sampleFormat )  mexErrMsgIdAndTxt("imfinfox:stack", "Sample format for '%s' is inconsistent with other file(s)."  , inputPath[iIn]);
     }
     else {
-      srcWidth                = width;
-      srcHeight               = height;
-      srcBits                 = bitsPerSample;
-      srcFormat               = sampleFormat;
-      //srcChannels             = channels;
+      srcWidth                = info.width;
+      srcHeight               = info.height;
+      srcBits                 = info.bitsPerSample;
+      srcFormat               = info.sampleFormat;
     }
 
 
     if (lazy) break;
 
-    //do {
-    //  ++( numFrames[iIn] );
-    //} while (TIFFReadDirectory(img));
-
-    numFrames[iIn]            = TIFFNumberOfDirectories(img);
-    totalFrames              += numFrames[iIn];
+    numFrames[iIn]            = static_cast<double>(info.numFrames);
+    totalFrames              += info.numFrames;
     if (totalFrames >= maxNumFrames)          break;
   }
 
@@ -206,8 +343,9 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
                                                 , "filePaths"
                                                 , "fileFrames"
                                                 , "channels"
+                                                , "contiguous"
                                                 };
-  plhs[0]                     = mxCreateStructMatrix(1, 1, 8, OUT_FIELDS);
+  plhs[0]                     = mxCreateStructMatrix(1, 1, 9, OUT_FIELDS);
   mxSetFieldByNumber(plhs[0], 0, 0, mxCreateDoubleScalar(srcWidth));
   mxSetFieldByNumber(plhs[0], 0, 1, mxCreateDoubleScalar(srcHeight));
   mxSetFieldByNumber(plhs[0], 0, 2, mxCreateDoubleScalar(srcBits));
@@ -224,4 +362,5 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
   mxSetFieldByNumber(plhs[0], 0, 5, matInput);
   mxSetFieldByNumber(plhs[0], 0, 6, matNumFrames);
   mxSetFieldByNumber(plhs[0], 0, 7, matChannels);
+  mxSetFieldByNumber(plhs[0], 0, 8, mxCreateLogicalScalar(isContiguous));
 }
@@ -2,13 +2,16 @@
   Loads the given image stack into memory, applying row/column shifts (rigid translation) to each frame.
 
   Usage syntax:
-    [image, stats, median] = imreadx( inputPath, [xShift = []], [yShift = []]               ...
-                                    , [xScale = 1], [yScale = 1], [maxNumFrames = inf]      ...
-                                    , [blackTolerance = nan], [subtractZero = false]        ...
-                                    , [methodInterp = cve.InterpolationFlags.INTER_LINEAR]  ...
-                                    , [methodResize = cve.InterpolationFlags.INTER_AREA]    ...
-                                    , [nanMask = []]                                        ...
-                                    );
+    [image, stats, median, sync, valid, hash]                                                      ...
+                                  = imreadx( inputPath, [xShift = []], [yShift = []]               ...
+                                           , [xScale = 1], [yScale = 1], [maxNumFrames = inf]      ...
+                                           , [blackTolerance = nan], [subtractZero = false]        ...
+                                           , [methodInterp = cve.InterpolationFlags.INTER_LINEAR]  ...
+                                           , [methodResize = cve.InterpolationFlags.INTER_AREA]    ...
+                                           , [nanMask = []], [numThreads = number of cores]        ...
+                                           , [computeMedian = true], [pixelMajor = false]          ...
+                                           , [numChannels = 1]                                     ...
+                                           );
 
   maxNumFrames = nan can be used to return only the statistics structure, which saves on memory load in 
   case the image stack is very large. Note that the median image cannot be computed in this case because
@@ -17,252 +20,115 @@
   Alternatively one can specify:
     [offset, frameSkip, maxFrame = inf]
   where offset is the first frames to skip, and frameSkip is the number of frames to skip between reads. 
+
+  Arbitrary subsets of frames can be read by specifying maxNumFrames as a cell array of frame index 
+  vectors (1-based, counting across all input files), e.g. {101:400, 2001:2300}. The output contains 
+  the requested frames in the given order, although each distinct frame is only read once, and in file 
+  order. In this mode, xShift and yShift are indexed by the frame number in the full stack, i.e. they 
+  should be the shifts for all frames as returned by motion correction.
  
   If sub-pixel registration is requested, cv::warpAffine() is used.
 
+  The sync output contains the ScanImage synchronization information for each loaded frame,
+  as also returned by getSyncInfo(), but extracted from the image description of each page
+  while the page itself is being read. It is a structure with fields acquisition, epoch (one
+  row per frame), frameTime, dataTime, and data, which contains the bytes of the first I2C
+  data packet of each frame (all-zero for frames without a packet), for conversion with 
+  typecast(). Frames in non-TIFF files have NaN timestamps. Set computeMedian = false to 
+  obtain sync without the cost of computing the median image, which is then returned empty.
+
+  The valid output is a logical vector that is false for frames that could not be read, e.g.
+  pages of a truncated file (as happens if an acquisition crashes) whose pixel data extends
+  beyond the end of the file, or that fail to decode. Such frames are filled with NaN, and
+  the remaining frames are processed as usual. If this output is not requested, unreadable
+  frames are an error. The page index (see below) records which pages are intact, so this
+  does not require any additional pass over the file. Files whose chain of directories is
+  broken, so that some pages cannot be located at all, are reported with a warning.
+
+  The hash output contains a 64-bit hash (uint64) of the stored pixel values of each frame,
+  before any processing, which is computed in parallel while frames are processed. This is
+  inexpensive compared to reading the frames, and can be compared to previously obtained
+  hashes to verify that the contents of the input files are unchanged.
+
+  Files with numChannels > 1 interleaved channels (e.g. ScanImage acquisitions, for which the
+  saved channels are listed in the channels field of cv.imfinfox()) are de-interleaved while 
+  reading, in a single pass through each file. Pages are then assigned to frames and channels
+  in the order in which they are stored, i.e. page k (0-based) is channel mod(k, numChannels) 
+  of frame floor(k / numChannels), and a trailing incomplete set of channels is ignored. All 
+  frame arguments refer to frames and not pages, so that e.g. the shifts obtained by motion 
+  correction of a single (structural) channel, via cv.motionCorrect() with frameSkip = 
+  [channel - 1, numChannels - 1], are applied to all channels. The image is then returned as 
+  a height x width x numFrames x numChannels array, the min, max, mean, std and median 
+  images are computed separately per channel (height x width x numChannels), and the valid 
+  and hash outputs are numFrames x numChannels. The sync output has one row per frame and 
+  channel, in the same order as the image. Black frames are detected using the black level
+  of the first frame of the first channel. The stack must be loaded into memory in this case.
+
+  If pixelMajor = true, the image stack is instead returned as a numFrames x (height * width)
+  matrix (numFrames x numChannels x (height * width) for multiple channels), i.e. with the 
+  time trace of each pixel contiguous in memory, which is much faster to access for per-pixel
+  temporal operations such as extracting the activity of ROIs; for a single channel, 
+  reshape(image', height, width, []) recovers the default layout. Frames are then processed
+  into staging blocks of 16 frames that are transposed into the output as soon as they are
+  complete, so that this costs little more than the default layout.
+
+  Multiple input files are decoded concurrently, each directly into its own range of 
+  the output. Decoded frames are handed off to worker threads for translation, resizing
+  etc. Set numThreads = 1 to load and process frames serially. Compressed TIFF files are
+  decompressed in parallel as well, by splitting the frames of each file among threads with
+  separate file handles, and if necessary the strips or tiles of each page. At most
+  numThreads threads are used in total, shared between decoding and processing.
+
+  Uncompressed TIFF files with contiguously stored pages (e.g. ScanImage acquisitions) are 
+  memory-mapped instead of decoded, in which case pixels are read directly from the mapped 
+  file without intermediate copies. Other files fall back to the OpenCV decoder. The page 
+  layout of each file is cached in a sidecar index file (inputPath.idx), which makes 
+  subsequent accesses to the same file faster. Set the TIFF_INDEX_DIR environment variable 
+  to a directory to store these elsewhere, or to '' to disable them.
+
+  The pages that are about to be read are prefetched into the operating system cache while 
+  the current ones are processed. The bytesPrefetched field of the stats output is the 
+  number of bytes for which this was requested (including an estimate of 16 kB per page 
+  for its directory), and bytesConsumed is the size of the pixel data of all pages read.
+
   Todo:     Binned median.
   Author:   Sue Ann Koay (koay@princeton.edu)
 */
 
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <mex.h>
 #include <opencv2/core.hpp>
 #include <opencv2/imgcodecs.hpp>
 #include <opencv2/imgproc.hpp>
 #include "lib/matUtils.h"
-#include "lib/cvToMatlab.h"
-#include "lib/manipulateImage.h"
-#include "lib/imageStatistics.h"
 #include "lib/imageCondenser.h"
+#include "lib/workerThreads.h"
+#include "lib/tiffIndex.h"
+#include "lib/mappedTiff.h"
+#include "lib/imageProcessor.h"
 
 
 
-//_________________________________________________________________________
-template<typename Pixel>
-class ImageProcessor : public cv::MatFunction
-{
-public:
-  ImageProcessor() 
-    : imgData       (0)
-    , xShift        (0)
-    , yShift        (0)
-    , xScale        (0)
-    , yScale        (0)
-    , maxNumFrames  (std::numeric_limits<int>::max())
-    , subtractZero  (false)
-    , methodInterp  (0)
-    , methodResize  (0)
-    , nanMask       (0)
-    , nFramePixels  (0)
-    , frameOffset   (0)
-    , emptyNSigmas  (5)
-    , emptyProb     (-999)
-    , stackStats    (0)
-    , offset        (0)
-    , maxZeroValue  (std::numeric_limits<double>::infinity())
-    , numFrames     (0)
-    , translator    (2, 3, CV_32F)
-    , xTrans        (translator.ptr<float>(0))
-    , yTrans        (translator.ptr<float>(1))
-    , emptyPix      ( static_cast<Pixel>(mxGetNaN()) )
-    , emptyValue    ( mxGetNaN() )
-    , condenser     (0)
-  {
-    xTrans[0]                   = 1;
-    xTrans[1]                   = 0;
-    yTrans[0]                   = 0;
-    yTrans[1]                   = 1;
-  }
-
-  bool operator()(cv::Mat& image)
-  {
-    if (numFrames >= maxNumFrames)
-      return false;
-
-    const cv::Mat*              source  = 0;
-    cv::Mat*                    target  = &frmTemp;
-    ++numFrames;
-
-    //---------------------------------------------------------------------------
-    //  Black frame detection
-    //---------------------------------------------------------------------------
-
-    if (emptyProb > 0) {
-      // Use the first frame to estimate the black level and variance
-      bool                      isEmpty = false;
-      if (numFrames == 1) {
-        cvCall<AccumulateMatStatistics>(image, statistics);
-
-        // Account for multiple samples when computing the fraction of pixels that are
-        // expected to fall below the zero + noise threshold
-        emptyProb               = std::pow(emptyProb, nFramePixels);
-        offset                  = static_cast<Pixel>( statistics.getMean() );
-        maxZeroValue            = offset + emptyNSigmas * statistics.getRMS();
-        isEmpty                 = true;   // by definition
-      }
-      else {
-        static const double     negInf  = -std::numeric_limits<double>::infinity();
-        int                     numZeros;
-        cvCall<CountPixelsInRange>(image, negInf, maxZeroValue, numZeros);
-        if (numZeros >= emptyProb * image.rows * image.cols)
-          isEmpty               = true;
-      }
-
-      // Special case where the entire frame should be set to NaN
-      if (isEmpty) {
-        if (frameOffset > 0) {  // Only required in case of storing data
-          static const Pixel    nan     = static_cast<Pixel>( mxGetNaN() );
-          for (int iPix = 0; iPix < nFramePixels; ++iPix, ++imgData)
-            *imgData            = nan;
-        }
-
-        // Move on to next shift if they have been provided
-        if (xShift) {
-          ++xShift;
-          ++yShift;
-        }
-        return true;            // Skip all further processing
-      }
-    }
-
-
-    //---------------------------------------------------------------------------
-    //  Translation
-    //---------------------------------------------------------------------------
-
-    if (xShift) {
-      // Unfortunately we have to copy the frame before warping, because otherwise
-      // the operations are performed with the input and not output precision
-      image.convertTo(frmClone, CV_32F);
-
-      // Perform an affine transformation i.e. sub-pixel shift via interpolation
-      if (methodInterp >= 0)
-      {
-        xTrans[2]               = float( *xShift );
-        yTrans[2]               = float( *yShift );
-        cv::warpAffine( frmClone, frmTemp, translator, image.size()
-                      , methodInterp, cv::BorderTypes::BORDER_CONSTANT, emptyValue
-                      );
-      }
-
-      // Perform a simple pixel shift
-      else {
-        frmTemp.create(image.size(), CV_32F);
-        cvCall<CopyShiftedImage32>(frmTemp, frmClone, *yShift, *xShift, emptyPix);
-      }
-
-      // Move on to next shift
-      ++xShift;
-      ++yShift;
-
-      // Swap source and scratch space for next operation
-      source                  = &frmTemp;
-      target                  = &frmClone;
-    }
-    else {
-      // Use original source for the next operation
-      source                  = &image;
-      target                  = &frmTemp;
-    } // translation
-
-
-    //---------------------------------------------------------------------------
-    //  One-shot masking and resize
-    //---------------------------------------------------------------------------
-
-    // For area interpolation, can directly write to output since this is the last operation
-    if (methodResize == cv::InterpolationFlags::INTER_AREA)
-      cvTypeCall<ImageCondenser2D, Pixel>(*source, imgData, condenser, offset, nanMask, emptyPix);
-
-
-    //-------------------------------------------------------------------------
-    //  Apply mask only
-    //-------------------------------------------------------------------------
-
-    else if (methodResize <= 0)
-      cvMatlabCall<MatToMatlab>(*source, imgClass, imgData, offset, nanMask, emptyPix);
-
-
-    //---------------------------------------------------------------------------
-    //  Mask and resize (but does not ignore nan)
-    //---------------------------------------------------------------------------
-
-    // No support for other type of resizing methods; use default functions regardless of ability to ignore nan
-    else {
-      if (nanMask) {
-        target->convertTo(frmClone, CV_32F);
-        cvCall<MaskPixels>(frmClone, nanMask, emptyPix);
-        target                = &frmClone;
-      } // apply mask
-
-      cv::resize(*source, *target, cv::Size(), xScale, yScale, methodResize);
-
-      // Set source for the next operation
-      source                  = target;
-
-
-      // Copy to Matlab
-      cvMatlabCall<MatToMatlab>(*source, imgClass, imgData, offset);
-    } // resize
-
-
-
-    //---------------------------------------------------------------------------
-    //  Compute image statistics
-    //---------------------------------------------------------------------------
-
-    if (stackStats)
-      stackStats->add(imgData);
-
-
-    //---------------------------------------------------------------------------
-    //  Advance write pointer
-    //---------------------------------------------------------------------------
-
-    imgData                  += frameOffset;
-
-    return true;
-  }
+static const size_t           MIN_DECODE_RUN  = 16;     // minimum number of frames worth opening a separate file handle for
 
+/// Range of requested frames [begin, end) of a single file, to be decoded by one thread.
+struct DecodeRun
+{
+  size_t                      iFile;
+  size_t                      begin;
+  size_t                      end;
 
-public:
-  cv::Mat             frmClone;
-  cv::Mat             frmTemp ;
-  mxClassID           imgClass;
-  Pixel*              imgData;
-  double*             xShift;
-  double*             yShift;
-  double              xScale;
-  double              yScale;
-  int                 maxNumFrames;
-  bool                subtractZero;
-  int                 methodInterp;
-  int                 methodResize;
-  const bool*         nanMask;
-  CondenserInfo2D*    condenser;
-
-  int                 nFramePixels;
-  int                 frameOffset;
-  double              emptyNSigmas;
-  double              emptyProb;
-  
-  ImageStatistics*    stackStats;
-  SampleStatistics    statistics;
-  Pixel               offset;
-  double              maxZeroValue;
-
-protected:
-  int                 numFrames;
-  cv::Mat             translator;
-  float*              xTrans;
-  float*              yTrans;
-  Pixel               emptyPix;
-  const cv::Scalar    emptyValue;
+  DecodeRun(const size_t iFile, const size_t begin, const size_t end)
+    : iFile(iFile), begin(begin), end(end)
+  { }
 };
 
 
 //_________________________________________________________________________
-bool checkNumShifts(const mxArray* matShifts, double*& ptrShifts, const int numFrames, const char* name)
+bool checkNumShifts(const mxArray* matShifts, const double*& ptrShifts, const int numFrames, const char* name)
 {
   const int           numRows     = mxGetM(matShifts);
   const int           numCols     = mxGetN(matShifts);
@@ -300,7 +166,7 @@ bool checkNumShifts(const mxArray* matShifts, double*& ptrShifts, const int numF
 void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
 {  
   // Check inputs to mex function
-  if (nrhs < 1 || nrhs > 12 || nlhs > 3) {
+  if (nrhs < 1 || nrhs > 15 || nlhs > 6) {
     mexEvalString("help cv.imreadx");
     mexErrMsgIdAndTxt ( "imreadx:usage", "Incorrect number of inputs/outputs provided." );
   }
@@ -323,22 +189,49 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
   
   // Parse input
   const bool                  computeStats            = ( nlhs > 1 );
-  const bool                  computeMedian           = ( nlhs > 2 );
+  const bool                  computeMedian           = ( nlhs > 2 && (nrhs <= 12 || mxGetScalar(prhs[12]) > 0) );
+  const bool                  computeSync             = ( nlhs > 3 );
+  const bool                  pixelMajor              = ( nrhs > 13 && !mxIsEmpty(prhs[13]) && mxGetScalar(prhs[13]) > 0 );
   ImageProcessor<float>       processor;
                               processor.xShift        = ( nrhs >  1 && !mxIsEmpty(prhs[1]) ) ?     mxGetPr(prhs[1])           : 0     ;
                               processor.yShift        = ( nrhs >  2 && !mxIsEmpty(prhs[2]) ) ?     mxGetPr(prhs[2])           : 0     ;
                               processor.xScale        = ( nrhs >  3 && !mxIsEmpty(prhs[3]) ) ?     mxGetScalar(prhs[3])       : -999  ;
                               processor.yScale        = ( nrhs >  4 && !mxIsEmpty(prhs[4]) ) ?     mxGetScalar(prhs[4])       : -999  ;
-  const bool                  storeStack              = ( nrhs <= 5 || !mxIsNaN(mxGetScalar(prhs[5])) );
+  const bool                  hasFrameList            = ( nrhs >  5 && mxIsCell(prhs[5]) );
+  const bool                  storeStack              = ( nrhs <= 5 || hasFrameList || !mxIsNaN(mxGetScalar(prhs[5])) );
                               processor.emptyProb     = ( nrhs >  6 ?                              mxGetScalar(prhs[6])       : -999  );
                               processor.subtractZero  = ( nrhs >  7 ?                             (mxGetScalar(prhs[7]) > 0)  : false );
   const mxArray*              nanMask                 = ( nrhs >  8 ?                                          prhs[8]        : 0     );
                               processor.methodInterp  = ( nrhs >  9 ? int( mxGetScalar(prhs[ 9]) ) : cv::InterpolationFlags::INTER_LINEAR );
                               processor.methodResize  = ( nrhs > 10 ? int( mxGetScalar(prhs[10]) ) : cv::InterpolationFlags::INTER_AREA   );
+  int                         numThreads              = ( nrhs > 11 && !mxIsEmpty(prhs[11]) ? int( mxGetScalar(prhs[11]) ) : defaultNumThreads() );
+  const int                   numChannels             = ( nrhs > 14 && !mxIsEmpty(prhs[14]) ? int( mxGetScalar(prhs[14]) ) : 1 );
 
   int                         firstFrame              = 0;
   int                         frameSkip               = 0;
-  if (nrhs > 5) {
+  std::vector<size_t>         frameList;              // explicitly requested frames, 0-based
+  if (hasFrameList) {
+    for (size_t iCell = 0; iCell < mxGetNumberOfElements(prhs[5]); ++iCell) {
+      const mxArray*          matIndex                = mxGetCell(prhs[5], iCell);
+      if (!matIndex || mxIsEmpty(matIndex))           continue;
+      if (!mxIsDouble(matIndex))
+        mexErrMsgIdAndTxt( "imreadx:arguments", "Frame indices in the maxNumFrames cell array must be of type double.");
+
+      const double*           index                   = mxGetPr(matIndex);
+      for (size_t iIndex = 0; iIndex < mxGetNumberOfElements(matIndex); ++iIndex) {
+        if (!(index[iIndex] >= 1) || index[iIndex] != std::floor(index[iIndex]))
+          mexErrMsgIdAndTxt( "imreadx:arguments", "Invalid frame index %g, must be a positive integer.", index[iIndex]);
+        frameList.push_back(static_cast<size_t>(index[iIndex]) - 1);
+      }
+    }
+    if (frameList.empty())
+      mexErrMsgIdAndTxt( "imreadx:arguments", "No frame indices provided in the maxNumFrames cell array.");
+    if (frameList.size() > static_cast<size_t>(std::numeric_limits<int>::max()))
+      mexErrMsgIdAndTxt( "imreadx:arguments", "Too many frame indices requested.");
+    processor.maxNumFrames    = static_cast<int>(frameList.size());
+  }
+
+  else if (nrhs > 5) {
     const size_t              nFrameCount             = mxGetNumberOfElements(prhs[5]);
     if (nFrameCount == 1) {
       if (mxIsFinite(mxGetScalar(prhs[5])))
@@ -356,7 +249,7 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
     }
 
     else
-      mexErrMsgIdAndTxt( "imreadx:arguments", "maxNumFrames must be a scalar or [min,frameSkip,max = inf].");
+      mexErrMsgIdAndTxt( "imreadx:arguments", "maxNumFrames must be a scalar, [min,frameSkip,max = inf], or a cell array of frame indices.");
   }
 
 
@@ -370,6 +263,12 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
     processor.methodResize    = -1;
   if (computeMedian && !storeStack)
     mexErrMsgIdAndTxt( "imreadx:arguments", "Median cannot be computed unless image stack is loaded into memory (maxNumFrames > 0).");
+  if (numChannels < 1)
+    mexErrMsgIdAndTxt( "imreadx:arguments", "numChannels must be a positive integer.");
+  if (numChannels > 1 && !storeStack)
+    mexErrMsgIdAndTxt( "imreadx:arguments", "Channels cannot be de-interleaved unless image stack is loaded into memory (maxNumFrames > 0).");
+  if (!storeStack)            // all frames are written to the same location
+    numThreads                = 1;
 
   if (nanMask) {
     if (!mxIsLogical(nanMask))
@@ -380,20 +279,84 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
 
   //---------------------------------------------------------------------------
   // Get parameters of image stack
-  int                         srcWidth        = 0;
-  int                         srcHeight       = 0;
-  int                         srcBits         = 0;
   int                         numFrames       = 0;
+  size_t                      numPages        = 0;
+  const size_t                minPages        = ( frameList.empty() ? 0 : 1 + *std::max_element(frameList.begin(), frameList.end()) );
+  std::vector<int>            fileFrames(inputPath.size(), 0);
+  std::vector<size_t>         fileTimes (inputPath.size(), 0);    // number of frames i.e. complete sets of channels
+  StackFiles                  files(inputPath.size());
+  const std::vector<size_t>&  filePages       = files.numPages;
   for (size_t iIn = 0; iIn < inputPath.size(); ++iIn) {
-    const size_t              fileFrames      = cv::imfinfo(inputPath[iIn], srcWidth, srcHeight, srcBits, iIn > 0);
-    numFrames                += static_cast<int>( std::ceil( 1.0 * (fileFrames - firstFrame) / (1 + frameSkip) ) );
+    if (!files.open(iIn, inputPath[iIn]))
+      mexErrMsgIdAndTxt ( "imreadx:load", "Inconsistent image format in %s vs. first file (%d x %d, %d bits)."
+                        , inputPath[iIn], files.width, files.height, files.bitsPerSample );
+    if (!files.index[iIn].empty() && !files.index[iIn].complete)
+      mexWarnMsgIdAndTxt( "imreadx:truncated", "Failed to read the directory following page %d of '%s', which may have been truncated. Any further pages are ignored."
+                        , static_cast<int>(filePages[iIn]), inputPath[iIn] );
+    fileTimes[iIn]            = filePages[iIn] / numChannels;
+    numPages                 += fileTimes[iIn];
+
+    // For an explicit list of frames, only need to know about files up to the last requested one
+    if (!frameList.empty()) {
+      if (numPages >= minPages)               break;
+      continue;
+    }
+
+    if (fileTimes[iIn] > static_cast<size_t>(firstFrame))
+      fileFrames[iIn]         = static_cast<int>( std::ceil( 1.0 * (fileTimes[iIn] - firstFrame) / (1 + frameSkip) ) );
+    fileFrames[iIn]           = std::min(fileFrames[iIn], processor.maxNumFrames - numFrames);
+    numFrames                += fileFrames[iIn];
     if (numFrames >= processor.maxNumFrames)  break;
   }
-  if (numFrames < processor.maxNumFrames)
+
+  if (!frameList.empty()) {
+    if (numPages < minPages)
+      mexErrMsgIdAndTxt( "imreadx:arguments", "Requested frame %d exceeds the number of frames (%d) in this image stack.", static_cast<int>(minPages), static_cast<int>(numPages));
+    numFrames                 = processor.maxNumFrames;
+  }
+  else if (numFrames < processor.maxNumFrames)
     processor.maxNumFrames    = numFrames;                // in case there are not enough available
   else if (numFrames > processor.maxNumFrames)
     numFrames                 = processor.maxNumFrames;   // user request to stop at a certain number
 
+  const int                   srcWidth        = files.width;
+  const int                   srcHeight       = files.height;
+
+  // List the pages to read from each file along with their locations in the output, which
+  // for multiple channels consists of one block of numFrames frames per channel
+  const size_t                numFiles        = inputPath.size();
+  std::vector<FrameRequest>   request(numFiles);
+  std::vector<std::pair<size_t,size_t> >      duplicates;           // (target, source) output frames
+  if (frameList.empty()) {
+    for (size_t iIn = 0, iFrame = 0; iIn < numFiles; ++iIn)
+      for (int iRead = 0; iRead < fileFrames[iIn]; ++iRead, ++iFrame)
+        for (int iChannel = 0; iChannel < numChannels; ++iChannel)
+          request[iIn].add((firstFrame + iRead * (1 + frameSkip)) * numChannels + iChannel, iChannel * numFrames + iFrame);
+  }
+  else {
+    // Sort requests by frame number, so that each distinct frame is read once and in file order
+    std::vector<size_t>       order(frameList.size());
+    for (size_t iFrame = 0; iFrame < order.size(); ++iFrame)
+      order[iFrame]           = iFrame;
+    std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) { return frameList[a] < frameList[b]; });
+
+    size_t                    iIn             = 0;
+    size_t                    firstPage       = 0;
+    for (size_t iOrder = 0; iOrder < order.size(); ++iOrder) {
+      const size_t            iFrame          = order[iOrder];
+      if (iOrder > 0 && frameList[iFrame] == frameList[order[iOrder-1]]) {
+        for (int iChannel = 0; iChannel < numChannels; ++iChannel)
+          duplicates.push_back(std::make_pair(iChannel * numFrames + iFrame, iChannel * numFrames + order[iOrder-1]));
+        continue;
+      }
+      for (; frameList[iFrame] >= firstPage + fileTimes[iIn]; ++iIn)
+        firstPage            += fileTimes[iIn];
+      for (int iChannel = 0; iChannel < numChannels; ++iChannel)
+        request[iIn].add(static_cast<int>(frameList[iFrame] - firstPage) * numChannels + iChannel, iChannel * numFrames + iFrame);
+    }
+  }
+  processor.maxNumFrames      = numFrames * numChannels;  // i.e. including all channels
+
 
   //---------------------------------------------------------------------------
   // Ensure proper size of masks
@@ -414,9 +377,20 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
 
   //---------------------------------------------------------------------------
   // Create output structure
-  if (storeStack) {
-    size_t                    dimension[]     = {imgHeight, imgWidth, processor.maxNumFrames};
-    plhs[0]                   = mxCreateNumericArray(3, dimension, mxSINGLE_CLASS, mxREAL);
+  FrameTransposer<float>*     transposer      = 0;
+  if (storeStack && pixelMajor) {
+    size_t                    dimension[]     = {numFrames, numChannels, processor.nFramePixels};
+    plhs[0]                   = ( numChannels > 1 ? mxCreateNumericArray (3, dimension, mxSINGLE_CLASS, mxREAL)
+                                                  : mxCreateNumericMatrix(numFrames, processor.nFramePixels, mxSINGLE_CLASS, mxREAL)
+                                                  );
+    processor.frameOffset     = processor.nFramePixels;
+    transposer                = new FrameTransposer<float>((float*) mxGetData(plhs[0]), processor.maxNumFrames, processor.nFramePixels);
+    for (size_t iDup = 0; iDup < duplicates.size(); ++iDup)
+      transposer->skip(duplicates[iDup].first);
+    processor.transposer      = transposer;
+  } else if (storeStack) {
+    size_t                    dimension[]     = {imgHeight, imgWidth, numFrames, numChannels};
+    plhs[0]                   = mxCreateNumericArray(numChannels > 1 ? 4 : 3, dimension, mxSINGLE_CLASS, mxREAL);
     processor.frameOffset     = processor.nFramePixels;
   } else {
     plhs[0]                   = mxCreateNumericMatrix(imgHeight, imgWidth, mxSINGLE_CLASS, mxREAL);
@@ -425,51 +399,204 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
   processor.imgClass          = mxGetClassID(plhs[0]);
   processor.imgData           = (float*) mxGetData(plhs[0]);
 
+  // Unreadable frames are tolerated if their validity is to be returned
+  if (nlhs > 4) {
+    plhs[4]                   = mxCreateLogicalMatrix(numFrames, numChannels);
+    processor.frameValid      = mxGetLogicals(plhs[4]);
+    std::fill(processor.frameValid, processor.frameValid + processor.maxNumFrames, true);
+  }
+  if (nlhs > 5) {
+    plhs[5]                   = mxCreateNumericMatrix(numFrames, numChannels, mxUINT64_CLASS, mxREAL);
+    processor.frameHash       = (uint64_t*) mxGetData(plhs[5]);
+  }
+
 
   mxArray*                    imgMin          = 0;
   mxArray*                    imgMax          = 0;
   mxArray*                    imgMean         = 0;
   mxArray*                    imgStd          = 0;
+  ImageStatistics*            stackStats      = 0;
   if (computeStats) {
-    imgMin                    = mxCreateDoubleMatrix(imgHeight, imgWidth, mxREAL);
-    imgMax                    = mxCreateDoubleMatrix(imgHeight, imgWidth, mxREAL);
-    imgMean                   = mxCreateDoubleMatrix(imgHeight, imgWidth, mxREAL);
-    imgStd                    = mxCreateDoubleMatrix(imgHeight, imgWidth, mxREAL);
-    processor.stackStats      = new ImageStatistics( processor.nFramePixels, mxGetPr(imgMean), mxGetPr(imgMin), mxGetPr(imgMax) );
+    // Channels are accumulated as separate pixels, i.e. into consecutive planes
+    size_t                    statSize[]      = {imgHeight, imgWidth, numChannels};
+    imgMin                    = mxCreateNumericArray(numChannels > 1 ? 3 : 2, statSize, mxDOUBLE_CLASS, mxREAL);
+    imgMax                    = mxCreateNumericArray(numChannels > 1 ? 3 : 2, statSize, mxDOUBLE_CLASS, mxREAL);
+    imgMean                   = mxCreateNumericArray(numChannels > 1 ? 3 : 2, statSize, mxDOUBLE_CLASS, mxREAL);
+    imgStd                    = mxCreateNumericArray(numChannels > 1 ? 3 : 2, statSize, mxDOUBLE_CLASS, mxREAL);
+    stackStats                = new ImageStatistics( processor.nFramePixels * numChannels, mxGetPr(imgMean), mxGetPr(imgMin), mxGetPr(imgMax) );
+
+    // If the stack is stored, statistics are accumulated after loading so that this can be done in parallel
+    if (!storeStack)
+      processor.stackStats    = stackStats;
   }
 
 
   // Check that we have enough frame shifts
+  std::vector<double>         listXShift, listYShift;
   if (processor.xShift) {
-    const bool                hasXShift       = checkNumShifts(prhs[1], processor.xShift, processor.maxNumFrames, "xShift");
-    const bool                hasYShift       = checkNumShifts(prhs[2], processor.yShift, processor.maxNumFrames, "yShift");
+    const int                 numShifts       = frameList.empty() ? numFrames : static_cast<int>(minPages);
+    const bool                hasXShift       = checkNumShifts(prhs[1], processor.xShift, numShifts, "xShift");
+    const bool                hasYShift       = checkNumShifts(prhs[2], processor.yShift, numShifts, "yShift");
     if (!hasXShift && !hasYShift) {
       processor.xShift        = 0;
       processor.yShift        = 0;
     }
+
+    // For an explicit list of frames or multiple channels, rearrange shifts in order of the output,
+    // where all channels of a given frame have the same shifts
+    else if (!frameList.empty() || numChannels > 1) {
+      listXShift.resize(processor.maxNumFrames);
+      listYShift.resize(processor.maxNumFrames);
+      for (int iFrame = 0; iFrame < numFrames; ++iFrame) {
+        const size_t          iShift          = ( frameList.empty() ? iFrame : frameList[iFrame] );
+        for (int iChannel = 0; iChannel < numChannels; ++iChannel) {
+          listXShift[iChannel * numFrames + iFrame] = processor.xShift[iShift];
+          listYShift[iChannel * numFrames + iFrame] = processor.yShift[iShift];
+        }
+      }
+      processor.xShift        = listXShift.data();
+      processor.yShift        = listYShift.data();
+    }
   }
 
   //---------------------------------------------------------------------------
-  // Call the stack processor
-  if (inputPath.size() == 1) {
-    cv::imreadmulti(inputPath[0], &processor, cv::ImreadModes::IMREAD_UNCHANGED, firstFrame, frameSkip);
+  // Call the stack processor. The threads are budgeted between decoding and processing so that
+  // there are at most numThreads in total, where memory-mapped files need little decoding
+  size_t                      numDecodedFiles = 0;
+  for (size_t iIn = 0; iIn < numFiles; ++iIn)
+    if (!files.mapped[iIn])   ++numDecodedFiles;
+  const int                   maxDecoders     = ( numDecodedFiles > 0 ? numThreads / 2 : std::min(numThreads / 2, static_cast<int>(numFiles)) );
+  const int                   decodeBudget    = ( numThreads < 2 ? 1 : std::max(1, maxDecoders) );
+  const int                   processThreads  = ( numThreads < 2 ? 0 : numThreads - decodeBudget );
+  FramePipeline<float>        pipeline(processor, processThreads);
+  std::vector<size_t>         fileBegin(numFiles, 0);
+  FrameSyncTable*             sync            = ( computeSync ? new FrameSyncTable(processor.maxNumFrames) : 0 );
+
+  // Frames are read in the main thread until the first valid one, which is used for calibration
+  for (size_t iIn = 0; iIn < numFiles && !pipeline.isCalibrated() && !pipeline.failed(); ++iIn)
+    while (fileBegin[iIn] < request[iIn].size() && !pipeline.isCalibrated() && !pipeline.failed()) {
+      files.read(pipeline, iIn, inputPath[iIn], request[iIn], fileBegin[iIn], fileBegin[iIn] + 1, sync);
+      ++fileBegin[iIn];
+    }
+  pipeline.start();
+
+  // Decode files concurrently, each directly into its range of the output. Files that are decompressed 
+  // via libtiff are further split into runs of frames with separate file handles, so that the work for a 
+  // single file is also shared among threads
+  std::vector<DecodeRun>      runs;
+  std::vector<std::atomic<size_t> >           runsLeft(numFiles);
+  std::atomic<size_t>         numDecoded      (0);
+  for (size_t iIn = 0; iIn < numFiles; ++iIn) {
+    const size_t              numRequest      = request[iIn].size() - std::min(fileBegin[iIn], request[iIn].size());
+    const size_t              numRuns         = ( !files.isDecoded(iIn) ? std::min<size_t>(numRequest, 1)
+                                                : std::min<size_t>(decodeBudget, (numRequest + MIN_DECODE_RUN - 1) / MIN_DECODE_RUN)
+                                                );
+    for (size_t iRun = 0; iRun < numRuns; ++iRun)
+      runs.push_back(DecodeRun( iIn
+                              , fileBegin[iIn] + numRequest *  iRun      / numRuns
+                              , fileBegin[iIn] + numRequest * (iRun + 1) / numRuns
+                              ));
+    runsLeft[iIn]             = numRuns;
+    if (numRuns < 1)          ++numDecoded;
   }
-  else {
+
+  // If there are too few runs to keep all threads busy, the strips or tiles of each page are also split
+  const int                   numDecoders     = std::max(1, std::min(decodeBudget, static_cast<int>(runs.size())));
+  const int                   stripThreads    = std::max(1, decodeBudget / numDecoders);
+  std::atomic<size_t>         nextRun         (0);
+  WorkerThreads               decoders;
+  decoders.start(numDecoders, [&](int) {
+    for (size_t iRun; (iRun = nextRun++) < runs.size(); ) {
+      const DecodeRun&        run             = runs[iRun];
+      if (!pipeline.failed()) {
+        try {
+          if (files.isDecoded(run.iFile))
+            files.readRange(pipeline, run.iFile, inputPath[run.iFile], request[run.iFile], run.begin, run.end, sync, stripThreads);
+          else
+            files.read     (pipeline, run.iFile, inputPath[run.iFile], request[run.iFile], run.begin, run.end, sync);
+        }
+        catch (const std::exception& e) {
+          pipeline.fail(e.what());
+        }
+      }
+      if (--runsLeft[run.iFile] == 0)
+        ++numDecoded;
+    }
+  });
+
+  // Display progress in the main thread while waiting for decoders
+  if (numFiles > 1) {
     mexPrintf("       ");
-    for (size_t iIn = 0; iIn < inputPath.size(); ++iIn) {
-      mexPrintf("\b\b\b\b\b\b\b%3d/%-3d", iIn+1, inputPath.size());
-      mexEvalString("drawnow");
-      if (!cv::imreadmulti(inputPath[iIn], &processor, cv::ImreadModes::IMREAD_UNCHANGED, firstFrame, frameSkip))
-        break;
+    for (size_t iShown = 0; iShown < numFiles; ) {
+      const size_t            iDone           = numDecoded;
+      if (iDone > iShown) {
+        iShown                = iDone;
+        mexPrintf("\b\b\b\b\b\b\b%3d/%-3d", iShown, numFiles);
+        mexEvalString("drawnow");
+      }
+      else std::this_thread::sleep_for(std::chrono::milliseconds(100));
     }
     mexPrintf("\b\b\b\b\b\b\b%s", "");
     mexEvalString("drawnow");
   }
+  decoders.join();
+  if (!pipeline.finish())
+    mexErrMsgIdAndTxt("imreadx:process", "Failed to process frames: %s", pipeline.error().c_str());
+  if (transposer) {
+    delete transposer;        // release staging memory
+    processor.transposer      = 0;
+  }
+
+  // Frames that were requested more than once are copied from their first occurrence
+  if (storeStack && pixelMajor) {
+    const size_t              nLoaded         = processor.maxNumFrames;
+    for (size_t iPix = 0; iPix < static_cast<size_t>(processor.nFramePixels); ++iPix) {
+      float*                  trace           = processor.imgData + iPix * nLoaded;
+      for (size_t iDup = 0; iDup < duplicates.size(); ++iDup)
+        trace[duplicates[iDup].first]         = trace[duplicates[iDup].second];
+    }
+  }
+  else
+    for (size_t iDup = 0; iDup < duplicates.size(); ++iDup)
+      std::copy ( processor.imgData + duplicates[iDup].second * processor.frameOffset
+                , processor.imgData + duplicates[iDup].second * processor.frameOffset + processor.nFramePixels
+                , processor.imgData + duplicates[iDup].first  * processor.frameOffset
+                );
+  if (sync)
+    for (size_t iDup = 0; iDup < duplicates.size(); ++iDup)
+      sync->copy(duplicates[iDup].first, duplicates[iDup].second);
+  for (size_t iDup = 0; iDup < duplicates.size(); ++iDup) {
+    if (processor.frameValid)
+      processor.frameValid[duplicates[iDup].first]  = processor.frameValid[duplicates[iDup].second];
+    if (processor.frameHash)
+      processor.frameHash [duplicates[iDup].first]  = processor.frameHash [duplicates[iDup].second];
+  }
+
+
+  // Accumulate statistics over the stored stack, with each thread responsible for a range of pixels
+  if (computeStats && storeStack) {
+    const float*              stackData       = processor.imgData;
+    const int                 nFramePixels    = processor.nFramePixels;
+    const int                 nLoaded         = numFrames;
+    const int                 nChunks         = std::max(1, std::min(numThreads, nFramePixels));
+    runThreads(nChunks, [=](int iChunk) {
+      const int               firstPix        = static_cast<int>( 1LL * nFramePixels *  iChunk      / nChunks );
+      const int               endPix          = static_cast<int>( 1LL * nFramePixels * (iChunk + 1) / nChunks );
+      for (int iChannel = 0; iChannel < numChannels; ++iChannel) {
+        if (pixelMajor)
+          for (int iPix = firstPix; iPix < endPix; ++iPix)
+            stackStats->addTrace(stackData + (1LL * iPix * numChannels + iChannel) * nLoaded, iChannel * nFramePixels + iPix, nLoaded);
+        else
+          for (int iFrame = 0; iFrame < nLoaded; ++iFrame)
+            stackStats->addRange(stackData + (1LL * iChannel * nLoaded + iFrame) * nFramePixels, firstPix, endPix, iChannel * nFramePixels);
+      }
+    });
+  }
 
 
   // Return statistics structure if so requested
   if (computeStats) {
-    processor.stackStats->getRMS(mxGetPr(imgStd));
+    stackStats->getRMS(mxGetPr(imgStd));
 
     static const char*        STAT_FIELDS[]   = { "zeroLevel"
                                                 , "zeroNoise"
@@ -478,8 +605,10 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
                                                 , "max"
                                                 , "mean"
                                                 , "std"
+                                                , "bytesPrefetched"
+                                                , "bytesConsumed"
                                                 };
-    plhs[1]                   = mxCreateStructMatrix(1, 1, 7, STAT_FIELDS);
+    plhs[1]                   = mxCreateStructMatrix(1, 1, 9, STAT_FIELDS);
     mxSetField(plhs[1], 0, "zeroLevel"    , mxCreateDoubleScalar(processor.statistics.getMean()));
     mxSetField(plhs[1], 0, "zeroNoise"    , mxCreateDoubleScalar(processor.statistics.getRMS()));
     mxSetField(plhs[1], 0, "zeroThreshold", mxCreateDoubleScalar(processor.maxZeroValue));
@@ -487,34 +616,83 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
     mxSetField(plhs[1], 0, "max"          , imgMax );
     mxSetField(plhs[1], 0, "mean"         , imgMean);
     mxSetField(plhs[1], 0, "std"          , imgStd );
+    mxSetField(plhs[1], 0, "bytesPrefetched", mxCreateDoubleScalar(static_cast<double>(files.bytesPrefetched())));
+    mxSetField(plhs[1], 0, "bytesConsumed"  , mxCreateDoubleScalar(static_cast<double>(files.bytesConsumed  ())));
+  }
+
+  // Return synchronization information if so requested
+  if (sync) {
+    const int                 packetBytes     = sync->packetBytes();
+    if (packetBytes < 0)
+      mexErrMsgIdAndTxt( "imreadx:sync", "Inconsistent number of %s bytes across frames.", DATA_NAME);
+
+    const size_t              numSync         = sync->size();
+    mxArray*                  matAcquisition  = mxCreateDoubleMatrix (1          , numSync    , mxREAL);
+    mxArray*                  matEpoch        = mxCreateDoubleMatrix (numSync    , N_TIMESTAMP, mxREAL);
+    mxArray*                  matFrameTime    = mxCreateDoubleMatrix (1          , numSync    , mxREAL);
+    mxArray*                  matDataTime     = mxCreateDoubleMatrix (1          , numSync    , mxREAL);
+    mxArray*                  matData         = mxCreateNumericMatrix(packetBytes, numSync    , mxUINT8_CLASS, mxREAL);
+    std::copy(sync->acquisition.begin(), sync->acquisition.end(), mxGetPr(matAcquisition));
+    std::copy(sync->frameTime  .begin(), sync->frameTime  .end(), mxGetPr(matFrameTime  ));
+    std::copy(sync->dataTime   .begin(), sync->dataTime   .end(), mxGetPr(matDataTime   ));
+
+    double*                   outEpoch        = mxGetPr(matEpoch);
+    unsigned char*            outData         = (unsigned char*) mxGetData(matData);
+    for (size_t iFrame = 0; iFrame < numSync; ++iFrame, outData += packetBytes) {
+      for (int iTime = 0; iTime < N_TIMESTAMP; ++iTime)
+        outEpoch[iFrame + iTime * numSync]    = sync->epoch[iFrame * N_TIMESTAMP + iTime];
+      std::copy(sync->data[iFrame].begin(), sync->data[iFrame].end(), outData);
+    }
+
+    static const char*        SYNC_FIELDS[]   = { "acquisition"
+                                                , "epoch"
+                                                , "frameTime"
+                                                , "dataTime"
+                                                , "data"
+                                                };
+    plhs[3]                   = mxCreateStructMatrix(1, 1, 5, SYNC_FIELDS);
+    mxSetField(plhs[3], 0, "acquisition"  , matAcquisition);
+    mxSetField(plhs[3], 0, "epoch"        , matEpoch      );
+    mxSetField(plhs[3], 0, "frameTime"    , matFrameTime  );
+    mxSetField(plhs[3], 0, "dataTime"     , matDataTime   );
+    mxSetField(plhs[3], 0, "data"         , matData       );
   }
 
   // Compute median if so requested
+  if (nlhs > 2 && !computeMedian)
+    plhs[2]                   = mxCreateNumericMatrix(0, 0, mxSINGLE_CLASS, mxREAL);
   if (computeMedian) {
-    std::vector<float>        traceTemp(processor.maxNumFrames);
-    plhs[2]                   = mxCreateNumericMatrix(imgHeight, imgWidth, mxSINGLE_CLASS, mxREAL);
+    std::vector<float>        traceTemp(numFrames);
+    size_t                    medianSize[]    = {imgHeight, imgWidth, numChannels};
+    plhs[2]                   = mxCreateNumericArray(numChannels > 1 ? 3 : 2, medianSize, mxSINGLE_CLASS, mxREAL);
     float*                    medData         = (float*) mxGetData(plhs[2]);
 
-    // Loop over each pixel in the image stack
-    const float*              pixCol          = (float*) mxGetData(plhs[0]);
-    for (size_t iCol = 0; iCol < imgWidth; ++iCol) {
-      for (size_t iRow = 0; iRow < imgHeight; ++iRow) {
+    // Loop over each pixel in the image stack, in column-major order; the time trace of a pixel is 
+    // contiguous in pixel-major layout
+    const float*              stackData       = (float*) mxGetData(plhs[0]);
+    const size_t              nFramePixels    = processor.nFramePixels;
+    const size_t              frameStride     = ( pixelMajor ? 1 : nFramePixels );
+    for (size_t iChannel = 0; iChannel < static_cast<size_t>(numChannels); ++iChannel) {
+      for (size_t iPix = 0; iPix < nFramePixels; ++iPix) {
+        const float*          pixTrace        = ( pixelMajor ? stackData + (iPix * numChannels + iChannel) * numFrames
+                                                             : stackData + iChannel * numFrames * nFramePixels + iPix
+                                                );
+
         // Copy the stack of pixels into temporary storage
         int                   nTrace          = 0;
-        for (size_t iFrame = 0; iFrame < processor.maxNumFrames; ++iFrame) {
-          const float         pixValue        = pixCol[iFrame * processor.nFramePixels];
+        for (size_t iFrame = 0; iFrame < static_cast<size_t>(numFrames); ++iFrame) {
+          const float         pixValue        = pixTrace[iFrame * frameStride];
           if (!mxIsNaN(pixValue)) {
             traceTemp[nTrace] = pixValue;
             ++nTrace;
           }
         }
-        ++pixCol;
 
         // Store the computed median
         *medData              = quickSelect(traceTemp, nTrace);
         ++medData;
-      } // end loop over columns
-    } // end loop over rows
+      } // end loop over pixels
+    } // end loop over channels
   }
 
 
@@ -525,6 +703,8 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
 
   if (processor.condenser)
     delete processor.condenser;
-  if (processor.stackStats)
-    delete processor.stackStats;
+  if (stackStats)
+    delete stackStats;
+  if (sync)
+    delete sync;
 }
@@ -0,0 +1,160 @@
+/**
+  Streams an image stack in chunks of frames, applying the same processing as cv.imreadx().
+
+  Usage syntax:
+    stream          = imstreamx( 'open', inputPath, [xShift = []], [yShift = []]                  ...
+                               , [xScale = 1], [yScale = 1], [maxNumFrames = inf]                 ...
+                               , [blackTolerance = nan], [subtractZero = false]                   ...
+                               , [methodInterp = cve.InterpolationFlags.INTER_LINEAR]             ...
+                               , [methodResize = cve.InterpolationFlags.INTER_AREA]               ...
+                               , [nanMask = []], [numThreads = number of cores]                   ...
+                               , [chunkSize = 1000]                                               ...
+                               );
+    [chunk, frames] = imstreamx( 'next', stream );
+    stats           = imstreamx( 'close', stream );
+
+  The arguments following 'open' are the same as for cv.imreadx(), except that maxNumFrames must be
+  either a scalar or [offset, frameSkip, maxFrame = inf]. Each call to 'next' returns the following
+  chunk of up to chunkSize processed frames, and their 1-based indices in the (selected) stack. An
+  empty chunk is returned once all frames have been streamed.
+
+  Frames are read in a background thread, which stays at most one chunk ahead of the frames that have
+  been returned. Memory usage is therefore determined by chunkSize and not the size of the stack, so
+  that arbitrarily large stacks can be processed chunk by chunk.
+
+  The stats structure returned when closing the stream contains the pixel-wise min, max, mean and std
+  over all frames that have been streamed, as for cv.imreadx(). This function is locked in memory
+  while any stream is open, so all streams must be closed before it can be cleared.
+*/
+
+
+#include <map>
+#include <string>
+#include <algorithm>
+#include <mex.h>
+#include <opencv2/core.hpp>
+#include <opencv2/imgcodecs.hpp>
+#include <opencv2/imgproc.hpp>
+#include "lib/matUtils.h"
+#include "lib/imageCondenser.h"
+#include "lib/workerThreads.h"
+#include "lib/tiffIndex.h"
+#include "lib/mappedTiff.h"
+#include "lib/imageProcessor.h"
+#include "lib/frameStream.h"
+
+
+
+//_________________________________________________________________________
+static std::map<int, FrameStream*>    streams;
+static int                            lastStream      = 0;
+
+/// Releases all streams when the MEX function is unloaded, i.e. upon exiting Matlab if any are still open.
+void closeAllStreams()
+{
+  for (std::map<int, FrameStream*>::iterator iStream = streams.begin(); iStream != streams.end(); ++iStream)
+    delete iStream->second;
+  streams.clear();
+}
+
+FrameStream* getStream(const mxArray* handle)
+{
+  if (!handle || mxGetNumberOfElements(handle) != 1)
+    mexErrMsgIdAndTxt("imstreamx:arguments", "stream must be a handle returned by imstreamx('open', ...).");
+  std::map<int, FrameStream*>::iterator   iStream = streams.find(static_cast<int>(mxGetScalar(handle)));
+  if (iStream == streams.end())
+    mexErrMsgIdAndTxt("imstreamx:arguments", "Invalid or already closed stream handle.");
+  return iStream->second;
+}
+
+
+
+//_________________________________________________________________________
+void openStream(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
+{
+  if (nrhs < 1 || nrhs > 13)
+    mexErrMsgIdAndTxt ( "imstreamx:usage", "Incorrect number of inputs provided." );
+
+  const double                chunkSize       = ( nrhs > 12 ? mxGetScalar(prhs[12]) : 1000 );
+  if (!(chunkSize >= 1))
+    mexErrMsgIdAndTxt( "imstreamx:arguments", "chunkSize must be a positive number.");
+
+  FrameStream*                stream          = openFrameStream("imstreamx", nrhs, prhs, static_cast<size_t>(chunkSize));
+
+  //---------------------------------------------------------------------------
+  // Register stream and start reading
+  if (streams.empty())
+    mexLock();
+  streams[++lastStream]       = stream;
+  stream->start();
+  plhs[0]                     = mxCreateDoubleScalar(lastStream);
+}
+
+
+//_________________________________________________________________________
+void nextChunk(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
+{
+  if (nrhs != 1)
+    mexErrMsgIdAndTxt ( "imstreamx:usage", "Incorrect number of inputs provided." );
+
+  FrameStream*                stream          = getStream(prhs[0]);
+  const size_t                numChunk        = std::min(stream->chunkSize, stream->numFrames - stream->numStreamed);
+  size_t                      dimension[]     = { static_cast<size_t>(stream->imgHeight), static_cast<size_t>(stream->imgWidth), numChunk };
+  plhs[0]                     = mxCreateNumericArray(3, dimension, mxSINGLE_CLASS, mxREAL);
+
+  const size_t                firstFrame      = stream->numStreamed;
+  std::string                 error;
+  if (numChunk > 0 && !stream->next((float*) mxGetData(plhs[0]), numChunk, error))
+    mexErrMsgIdAndTxt("imstreamx:process", "Failed to process frames: %s", error.c_str());
+
+  if (nlhs > 1) {
+    plhs[1]                   = mxCreateDoubleMatrix(1, numChunk, mxREAL);
+    double*                   frames          = mxGetPr(plhs[1]);
+    for (size_t iFrame = 0; iFrame < numChunk; ++iFrame)
+      frames[iFrame]          = static_cast<double>(firstFrame + iFrame + 1);
+  }
+}
+
+
+//_________________________________________________________________________
+void closeStream(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
+{
+  if (nrhs != 1)
+    mexErrMsgIdAndTxt ( "imstreamx:usage", "Incorrect number of inputs provided." );
+
+  FrameStream*                stream          = getStream(prhs[0]);
+  if (nlhs > 0)
+    plhs[0]                   = stream->createStats();
+
+  streams.erase(static_cast<int>(mxGetScalar(prhs[0])));
+  delete stream;
+  if (streams.empty())
+    mexUnlock();
+}
+
+
+
+///////////////////////////////////////////////////////////////////////////
+// Main entry point to a MEX function
+///////////////////////////////////////////////////////////////////////////
+
+
+void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
+{
+  mexAtExit(closeAllStreams);
+
+  // Check inputs to mex function
+  if (nrhs < 2 || !mxIsChar(prhs[0]) || nlhs > 2) {
+    mexEvalString("help cv.imstreamx");
+    mexErrMsgIdAndTxt ( "imstreamx:usage", "Incorrect number of inputs/outputs provided." );
+  }
+
+  char*                       command         = mxArrayToString(prhs[0]);
+  const std::string           action          = command;
+  mxFree(command);
+
+  if      (action == "open" )   openStream (nlhs, plhs, nrhs - 1, prhs + 1);
+  else if (action == "next" )   nextChunk  (nlhs, plhs, nrhs - 1, prhs + 1);
+  else if (action == "close")   closeStream(nlhs, plhs, nrhs - 1, prhs + 1);
+  else    mexErrMsgIdAndTxt("imstreamx:usage", "Unknown command '%s', must be 'open', 'next' or 'close'.", action.c_str());
+}
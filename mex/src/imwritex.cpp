@@ -0,0 +1,197 @@
+/**
+  Writes an image stack to disk after applying the same processing as cv.imreadx(), without loading
+  the entire stack into memory.
+
+  Usage syntax:
+    stats = imwritex( outputPath, inputPath, [xShift = []], [yShift = []]                        ...
+                    , [xScale = 1], [yScale = 1], [maxNumFrames = inf]                           ...
+                    , [blackTolerance = nan], [subtractZero = false]                             ...
+                    , [methodInterp = cve.InterpolationFlags.INTER_LINEAR]                       ...
+                    , [methodResize = cve.InterpolationFlags.INTER_AREA]                         ...
+                    , [nanMask = []], [numThreads = number of cores]                             ...
+                    , [compression = 'none'], [chunkSize = 100]                                  ...
+                    , [metadata = struct()], [layout = 'frames']                                 ...
+                    );
+
+  The arguments following outputPath are the same as for cv.imreadx(), except that maxNumFrames must
+  be either a scalar or [offset, frameSkip, maxFrame = inf]. The processed (e.g. motion corrected and
+  downsampled) frames are written as single precision values, in a format determined by the extension
+  of outputPath:
+    .tif, .tiff   : multi-page TIFF, which is automatically written as BigTIFF if the output could
+                    exceed 4GB in size
+    .btf, .tf8    : multi-page BigTIFF
+    .ecsmov       : chunked movie file, which can be read back with cv.readMovie()
+    anything else : headerless raw file, with frames in the same column-major layout as the output
+                    of cv.imreadx(), i.e. reshape(fread(fid, inf, '*single'), height, width, [])
+
+  TIFF pages can be compressed by specifying compression as 'lzw', 'deflate' or 'zstd' (if supported
+  by the libtiff library), in which case the floating point predictor is used.
+
+  Movie files store chunks of chunkSize frames, which can be compressed with compression = 'shuffle'
+  (byte shuffling followed by run-length encoding). With layout = 'pixels', the values within each
+  chunk are stored pixel-major, so that time traces of pixels can be loaded efficiently; the default
+  'frames' layout stores frames contiguously, as for the other formats. The movie header records the
+  original input size ([height, width, numFrames] of the selected frames), the shifts that were
+  applied (if any), and all fields of the metadata structure, e.g. struct('params', motionCorr.params).
+  Fields of metadata must be numeric, logical, character arrays, or scalar structures thereof.
+
+  Frames are processed in chunks of chunkSize frames, as for cv.imstreamx(), and each chunk is written
+  in a background thread while the next one is being processed. Memory usage is therefore determined
+  by chunkSize and not the size of the stack. The returned stats structure contains the pixel-wise
+  min, max, mean and std over all frames, as for cv.imreadx().
+*/
+
+
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <mex.h>
+#include <opencv2/core.hpp>
+#include <opencv2/imgcodecs.hpp>
+#include <opencv2/imgproc.hpp>
+#include "lib/matUtils.h"
+#include "lib/workerThreads.h"
+#include "lib/tiffIndex.h"
+#include "lib/mappedTiff.h"
+#include "lib/imageProcessor.h"
+#include "lib/frameStream.h"
+#include "lib/stackWriter.h"
+
+
+
+///////////////////////////////////////////////////////////////////////////
+// Main entry point to a MEX function
+///////////////////////////////////////////////////////////////////////////
+
+
+void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
+{
+  // Check inputs to mex function
+  if (nrhs < 2 || nrhs > 17 || nlhs > 1) {
+    mexEvalString("help cv.imwritex");
+    mexErrMsgIdAndTxt ( "imwritex:usage", "Incorrect number of inputs/outputs provided." );
+  }
+  if (!mxIsChar(prhs[0]))
+    mexErrMsgIdAndTxt( "imwritex:arguments", "outputPath must be a string.");
+
+  // Parse output options
+  char*                       outputPath      = mxArrayToString(prhs[0]);
+  const StackWriter::Format   format          = StackWriter::formatOf(outputPath);
+  std::string                 compression     = "none";
+  if (nrhs > 13 && !mxIsEmpty(prhs[13])) {
+    char*                     name            = mxArrayToString(prhs[13]);
+    if (name)                 compression     = name;
+    mxFree(name);
+  }
+  if (!StackWriter::isSupported(format, compression)) {
+    mxFree(outputPath);
+    mexErrMsgIdAndTxt( "imwritex:arguments", "Unsupported compression '%s' for this output format, must be 'none', 'lzw', 'deflate' or 'zstd' for TIFF, or 'none' or 'shuffle' for movies.", compression.c_str());
+  }
+
+  const double                chunkSize       = ( nrhs > 14 ? mxGetScalar(prhs[14]) : 100 );
+  if (!(chunkSize >= 1))
+    mexErrMsgIdAndTxt( "imwritex:arguments", "chunkSize must be a positive number.");
+
+  const mxArray*              metadata        = ( nrhs > 15 && !mxIsEmpty(prhs[15]) ? prhs[15] : 0 );
+  if (metadata && (!mxIsStruct(metadata) || mxGetNumberOfElements(metadata) != 1))
+    mexErrMsgIdAndTxt( "imwritex:arguments", "metadata must be a scalar structure.");
+
+  MovieLayout                 layout          = MOVIE_FRAME_MAJOR;
+  if (nrhs > 16 && !mxIsEmpty(prhs[16])) {
+    char*                     name            = mxArrayToString(prhs[16]);
+    const std::string         what            = ( name ? name : "" );
+    mxFree(name);
+    if      (what == "pixels")  layout        = MOVIE_PIXEL_MAJOR;
+    else if (what != "frames")  mexErrMsgIdAndTxt( "imwritex:arguments", "layout must be either 'frames' or 'pixels'.");
+  }
+
+  FrameStream*                stream          = openFrameStream("imwritex", std::min(nrhs - 1, 12), prhs + 1, static_cast<size_t>(chunkSize));
+
+
+  //---------------------------------------------------------------------------
+  // Record provenance of the processed frames in movie files
+  StackWriter                 writer;
+  writer.movieLayout          = layout;
+  writer.framesPerChunk       = stream->chunkSize;
+  if (format == StackWriter::FORMAT_MOVIE) {
+    mxArray*                  inputSize       = mxCreateDoubleMatrix(1, 3, mxREAL);
+    mxGetPr(inputSize)[0]     = stream->files.height;
+    mxGetPr(inputSize)[1]     = stream->files.width;
+    mxGetPr(inputSize)[2]     = static_cast<double>(stream->numFrames);
+    appendMetadata(writer.movieMetadata, "inputSize", inputSize);
+    mxDestroyArray(inputSize);
+
+    for (int iAxis = 0; iAxis < 2; ++iAxis) {
+      const std::vector<double>&  shifts      = ( iAxis ? stream->yShift : stream->xShift );
+      if (shifts.empty())     continue;
+      mxArray*                matShifts       = mxCreateDoubleMatrix(shifts.size(), 1, mxREAL);
+      std::copy(shifts.begin(), shifts.end(), mxGetPr(matShifts));
+      appendMetadata(writer.movieMetadata, iAxis ? "yShift" : "xShift", matShifts);
+      mxDestroyArray(matShifts);
+    }
+
+    for (int iField = 0; metadata && iField < mxGetNumberOfFields(metadata); ++iField)
+      if (!appendMetadata(writer.movieMetadata, mxGetFieldNameByNumber(metadata, iField), mxGetFieldByNumber(metadata, 0, iField))) {
+        const std::string     field           = mxGetFieldNameByNumber(metadata, iField);
+        delete stream;
+        mxFree(outputPath);
+        mexErrMsgIdAndTxt( "imwritex:arguments", "Unsupported type of metadata field '%s', must be a numeric, logical or character array or a scalar structure thereof.", field.c_str());
+      }
+  }
+
+  // Create output file
+  std::string                 error;
+  const bool                  isOpen          = writer.open(outputPath, stream->imgWidth, stream->imgHeight, stream->numFrames, compression, error);
+  mxFree(outputPath);
+  if (!isOpen) {
+    delete stream;
+    mexErrMsgIdAndTxt("imwritex:write", "%s", error.c_str());
+  }
+
+  // Double buffering so that one chunk can be written while the next is processed
+  const size_t                chunkPixels     = stream->chunkSize * stream->framePixels();
+  std::vector<float>          buffer[2]       = { std::vector<float>(chunkPixels), std::vector<float>(chunkPixels) };
+  WorkerThreads               output;
+
+  stream->start();
+  bool                        isOK            = true;
+  for (size_t iChunk = 0; isOK && stream->numStreamed < stream->numFrames; ++iChunk) {
+    const size_t              numChunk        = std::min(stream->chunkSize, stream->numFrames - stream->numStreamed);
+    float*                    chunk           = buffer[iChunk % 2].data();
+    isOK                      = stream->next(chunk, numChunk, error);
+
+    // The previous chunk must be written before its buffer can be reused
+    output.join();
+    if (output.failed()) {
+      error                   = output.error();
+      isOK                    = false;
+    }
+    if (isOK)
+      output.start(1, [&writer, &output, chunk, numChunk](int) {
+        std::string           what;
+        if (!writer.write(chunk, numChunk, what))
+          output.fail(what);
+      });
+  }
+
+  output.join();
+  if (isOK && output.failed()) {
+    error                     = output.error();
+    isOK                      = false;
+  }
+  std::string                 closeError;
+  if (!writer.close(closeError) && isOK) {
+    error                     = closeError;
+    isOK                      = false;
+  }
+  if (!isOK) {
+    delete stream;
+    mexErrMsgIdAndTxt("imwritex:write", "Failed to write processed frames: %s", error.c_str());
+  }
+
+
+  //---------------------------------------------------------------------------
+  if (nlhs > 0)
+    plhs[0]                   = stream->createStats();
+  delete stream;
+}
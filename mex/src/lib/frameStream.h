@@ -0,0 +1,414 @@
+/**
+  Chunk-wise processing of image stacks with the same stages as cv.imreadx(), for programs
+  that consume frames incrementally instead of returning the entire stack at once.
+
+  FrameStream reads all requested frames in a background thread, and processes them in
+  chunks of a fixed number of frames into a caller-supplied buffer, so that memory usage
+  is independent of the size of the stack. openFrameStream() parses the arguments that
+  are shared with cv.imreadx() (from inputPath up to numThreads) into a new stream.
+*/
+
+
+#ifndef FRAMESTREAM_H
+#define FRAMESTREAM_H
+
+#include <string>
+#include <vector>
+#include <limits>
+#include <atomic>
+#include <algorithm>
+#include <stdexcept>
+#include <mex.h>
+#include <opencv2/core.hpp>
+#include <opencv2/imgproc.hpp>
+#include "matUtils.h"
+#include "imageCondenser.h"
+#include "workerThreads.h"
+#include "imageProcessor.h"
+
+
+
+//_________________________________________________________________________
+/// Frame handed over from the reader thread.
+struct StreamFrame
+{
+  cv::Mat             image;
+  size_t              index;
+};
+
+
+//_________________________________________________________________________
+/**
+  Sink for readFrames() that queues frames for processing. Decoded frames have to be
+  copied since the decoder reuses its buffers, whereas memory-mapped frames are not.
+  Decoding errors and unreadable (e.g. truncated) pages close the queue, after which the
+  error message can be retrieved by the consumer.
+*/
+class FrameQueue : public BoundedQueue<StreamFrame>
+{
+public:
+  FrameQueue(const size_t capacity) : BoundedQueue<StreamFrame>(capacity) { }
+
+  bool submit(const cv::Mat& image, const size_t iFrame, const bool persistent = false)
+  {
+    StreamFrame               frame;
+    frame.image               = ( persistent ? image : image.clone() );
+    frame.index               = iFrame;
+    return push(frame);
+  }
+
+  bool invalidate(const size_t, const std::string& what)
+  {
+    fail(what);
+    return false;
+  }
+
+  void fail(const std::string& what)
+  {
+    message                   = what;         // visible to consumers once they fail to pop()
+    close();
+  }
+  bool failed() { return isClosed(); }
+  const std::string& error() const { return message; }
+
+protected:
+  std::string                 message;
+};
+
+
+//_________________________________________________________________________
+/**
+  State of a single stream. All frames are read by one background thread in order of
+  their index, so that the frames for a chunk are simply the next ones in the queue.
+*/
+class FrameStream
+{
+public:
+  ImageProcessor<float>       processor;
+  std::vector<std::string>    inputPath;              ///< copied since Matlab frees its strings after each call
+  StackFiles                  files;
+  std::vector<FrameRequest>   request;
+  std::vector<double>         xShift;
+  std::vector<double>         yShift;
+  std::vector<unsigned char>  nanMask;
+  int                         imgWidth;
+  int                         imgHeight;
+  size_t                      numFrames;
+  size_t                      numStreamed;
+  size_t                      chunkSize;
+  int                         numThreads;
+
+  std::vector<double>         statMean;
+  std::vector<double>         statMin;
+  std::vector<double>         statMax;
+  ImageStatistics*            stackStats;
+
+  FrameQueue                  queue;
+  WorkerThreads               reader;
+
+public:
+  FrameStream(const std::vector<std::string>& inputPath, const size_t chunkSize, const int numThreads)
+    : inputPath   (inputPath)
+    , files       (inputPath.size())
+    , request     (inputPath.size())
+    , imgWidth    (0)
+    , imgHeight   (0)
+    , numFrames   (0)
+    , numStreamed (0)
+    , chunkSize   (chunkSize)
+    , numThreads  (numThreads)
+    , stackStats  (0)
+    , queue       (chunkSize)
+  { }
+
+  ~FrameStream()
+  {
+    queue.close();            // unblocks the reader thread
+    reader.join();
+    if (processor.condenser)
+      delete processor.condenser;
+    if (stackStats)
+      delete stackStats;
+  }
+
+  /// Number of pixels in a processed frame.
+  size_t framePixels() const { return static_cast<size_t>(imgWidth) * imgHeight; }
+
+  /// Starts reading all requested frames in a background thread.
+  void start()
+  {
+    reader.start(1, [this](int) {
+      for (size_t iIn = 0; iIn < inputPath.size() && !queue.isClosed(); ++iIn)
+        files.read(queue, iIn, inputPath[iIn].c_str(), request[iIn], 0, request[iIn].size());
+      queue.close();
+    });
+  }
+
+  /// Processes the next numChunk frames into imgData, returning false upon failure.
+  bool next(float* imgData, const size_t numChunk, std::string& error)
+  {
+    processor.imgData         = imgData;
+    processor.firstIndex      = numStreamed;
+
+    // The very first frame is processed in the main thread since it is used for calibration
+    size_t                    numDone         = 0;
+    if (numStreamed == 0 && numChunk > 0) {
+      StreamFrame             frame;
+      if (!queue.pop(frame))  return fail(error);
+      FrameScratch            scratch;
+      processor.calibrate(frame.image, frame.index);
+      processor(frame.image, frame.index, scratch);
+      numDone                 = 1;
+    }
+
+    std::atomic<size_t>       numTaken        (numDone);
+    const int                 numWorkers      = static_cast<int>( std::min<size_t>(std::max(numThreads, 1), numChunk - numDone) );
+    if (numWorkers > 0) {
+      const bool              isOK            = runThreads(numWorkers, [&](int) {
+        FrameScratch          scratch;
+        StreamFrame           frame;
+        while (numTaken++ < numChunk) {
+          if (!queue.pop(frame))
+            throw std::runtime_error("No more frames available from input.");
+          processor(frame.image, frame.index, scratch);
+        }
+      }, &error);
+      if (!isOK)              return fail(error);
+    }
+
+    // Accumulate statistics with each thread responsible for a range of pixels
+    const int                 nFramePixels    = processor.nFramePixels;
+    const int                 nChunks         = std::max(1, std::min(numThreads, nFramePixels));
+    ImageStatistics*          statistics      = stackStats;
+    runThreads(nChunks, [=](int iChunk) {
+      const int               firstPix        = static_cast<int>( 1LL * nFramePixels *  iChunk      / nChunks );
+      const int               endPix          = static_cast<int>( 1LL * nFramePixels * (iChunk + 1) / nChunks );
+      for (size_t iFrame = 0; iFrame < numChunk; ++iFrame)
+        statistics->addRange(imgData + iFrame * nFramePixels, firstPix, endPix);
+    });
+
+    numStreamed              += numChunk;
+    return true;
+  }
+
+  /// Returns the statistics over all frames streamed so far, in the same format as cv.imreadx().
+  mxArray* createStats() const
+  {
+    mxArray*                  imgMin          = mxCreateDoubleMatrix(imgHeight, imgWidth, mxREAL);
+    mxArray*                  imgMax          = mxCreateDoubleMatrix(imgHeight, imgWidth, mxREAL);
+    mxArray*                  imgMean         = mxCreateDoubleMatrix(imgHeight, imgWidth, mxREAL);
+    mxArray*                  imgStd          = mxCreateDoubleMatrix(imgHeight, imgWidth, mxREAL);
+    std::copy(statMin .begin(), statMin .end(), mxGetPr(imgMin ));
+    std::copy(statMax .begin(), statMax .end(), mxGetPr(imgMax ));
+    std::copy(statMean.begin(), statMean.end(), mxGetPr(imgMean));
+    stackStats->getRMS(mxGetPr(imgStd));
+
+    static const char*        STAT_FIELDS[]   = { "zeroLevel"
+                                                , "zeroNoise"
+                                                , "zeroThreshold"
+                                                , "min"
+                                                , "max"
+                                                , "mean"
+                                                , "std"
+                                                , "numFrames"
+                                                };
+    mxArray*                  stats           = mxCreateStructMatrix(1, 1, 8, STAT_FIELDS);
+    mxSetField(stats, 0, "zeroLevel"    , mxCreateDoubleScalar(processor.statistics.getMean()));
+    mxSetField(stats, 0, "zeroNoise"    , mxCreateDoubleScalar(processor.statistics.getRMS()));
+    mxSetField(stats, 0, "zeroThreshold", mxCreateDoubleScalar(processor.maxZeroValue));
+    mxSetField(stats, 0, "min"          , imgMin );
+    mxSetField(stats, 0, "max"          , imgMax );
+    mxSetField(stats, 0, "mean"         , imgMean);
+    mxSetField(stats, 0, "std"          , imgStd );
+    mxSetField(stats, 0, "numFrames"    , mxCreateDoubleScalar(static_cast<double>(numStreamed)));
+    return stats;
+  }
+
+protected:
+  bool fail(std::string& error)
+  {
+    if (!queue.error().empty()) error = queue.error();
+    else if (reader.failed()) error = reader.error();
+    else if (error.empty())   error = "No more frames available from input.";
+    return false;
+  }
+
+private:
+  FrameStream(const FrameStream&);
+  FrameStream& operator=(const FrameStream&);
+};
+
+
+
+//_________________________________________________________________________
+/// Copies the last column of shifts if a matrix is provided, as for cv.imreadx(). Returns false if there are too few.
+inline bool copyShifts(const mxArray* matShifts, std::vector<double>& shifts, const size_t numFrames)
+{
+  const size_t        numRows     = mxGetM(matShifts);
+  const size_t        numCols     = mxGetN(matShifts);
+  const double*       ptrShifts   = mxGetPr(matShifts);
+  if (numCols > 1 && numRows > 1)
+    ptrShifts        += (numCols - 1) * numRows;
+
+  const size_t        numShifts   = ( numCols > 1 && numRows > 1 ? numRows : numRows * numCols );
+  if (numShifts < numFrames)
+    return false;
+  shifts.assign(ptrShifts, ptrShifts + numFrames);
+  return true;
+}
+
+inline bool hasShifts(const std::vector<double>& shifts)
+{
+  for (size_t iFrame = 0; iFrame < shifts.size(); ++iFrame)
+    if (shifts[iFrame])
+      return true;
+  return false;
+}
+
+
+/**
+  Creates a stream from the arguments of cv.imreadx() in prhs[0] (inputPath) to prhs[11]
+  (numThreads), where maxNumFrames must be either a scalar or [offset, frameSkip, maxFrame].
+  Errors are reported with identifiers prefixed by the given program name. The returned
+  stream has not been started yet.
+*/
+inline FrameStream* openFrameStream(const char* program, const int nrhs, const mxArray* prhs[], const size_t chunkSize)
+{
+  const std::string           argError        = std::string(program) + ":arguments";
+  const std::string           loadError       = std::string(program) + ":load";
+  const std::string           shiftError      = std::string(program) + ":shifts";
+
+  // Handle single vs. multiple input files
+  const mxArray*              input           = prhs[0];
+  std::vector<std::string>    inputPath;
+  if (mxIsCell(input)) {
+    inputPath.resize(mxGetNumberOfElements(input));
+    for (size_t iIn = 0; iIn < inputPath.size(); ++iIn) {
+      char*                   path            = mxArrayToString(mxGetCell(input, iIn));
+      if (!path)              mexErrMsgIdAndTxt(argError.c_str(), "Non-string item encountered in inputPath array.");
+      inputPath[iIn]          = path;
+      mxFree(path);
+    }
+  }
+  else if (!mxIsChar(input))
+    mexErrMsgIdAndTxt(argError.c_str(), "inputPath must be a string or cell array of strings.");
+  else {
+    char*                     path            = mxArrayToString(input);
+    inputPath.push_back(path);
+    mxFree(path);
+  }
+
+
+  // Parse input
+  const mxArray*              matXShift               = ( nrhs >  1 && !mxIsEmpty(prhs[1]) ) ?                 prhs[1]        : 0     ;
+  const mxArray*              matYShift               = ( nrhs >  2 && !mxIsEmpty(prhs[2]) ) ?                 prhs[2]        : 0     ;
+  const double                xScale                  = ( nrhs >  3 && !mxIsEmpty(prhs[3]) ) ?     mxGetScalar(prhs[3])       : -999  ;
+  const double                yScale                  = ( nrhs >  4 && !mxIsEmpty(prhs[4]) ) ?     mxGetScalar(prhs[4])       : -999  ;
+  const double                emptyProb               = ( nrhs >  6 ?                              mxGetScalar(prhs[6])       : -999  );
+  const bool                  subtractZero            = ( nrhs >  7 ?                             (mxGetScalar(prhs[7]) > 0)  : false );
+  const mxArray*              nanMask                 = ( nrhs >  8 && !mxIsEmpty(prhs[8]) ) ?                 prhs[8]        : 0     ;
+  const int                   methodInterp            = ( nrhs >  9 ? int( mxGetScalar(prhs[ 9]) ) : cv::InterpolationFlags::INTER_LINEAR );
+  int                         methodResize            = ( nrhs > 10 ? int( mxGetScalar(prhs[10]) ) : cv::InterpolationFlags::INTER_AREA   );
+  const int                   numThreads              = ( nrhs > 11 && !mxIsEmpty(prhs[11]) ? int( mxGetScalar(prhs[11]) ) : defaultNumThreads() );
+
+  int                         firstFrame              = 0;
+  int                         frameSkip               = 0;
+  int                         maxNumFrames            = std::numeric_limits<int>::max();
+  if (nrhs > 5 && !mxIsEmpty(prhs[5])) {
+    const size_t              nFrameCount             = mxGetNumberOfElements(prhs[5]);
+    const double*             frameRange              = mxGetPr(prhs[5]);
+    if (mxIsCell(prhs[5]) || !frameRange || nFrameCount > 3)
+      mexErrMsgIdAndTxt( argError.c_str(), "maxNumFrames must be a scalar or [min,frameSkip,max = inf].");
+    if (nFrameCount == 1) {
+      if (mxIsFinite(frameRange[0]))
+        maxNumFrames          = cv::saturate_cast<int>(frameRange[0]);
+    }
+    else {
+      firstFrame              = cv::saturate_cast<int>(frameRange[0]);
+      frameSkip               = cv::saturate_cast<int>(frameRange[1]);
+      if (nFrameCount > 2 && mxIsFinite(frameRange[2]))
+        maxNumFrames          = cv::saturate_cast<int>(frameRange[2]);
+    }
+  }
+
+  // Sanity checks
+  if ((matXShift == 0) != (matYShift == 0))
+    mexErrMsgIdAndTxt( argError.c_str(), "If xShift is provided, yShift must be provided as well, and vice versa.");
+  if ((xScale <= 0) != (yScale <= 0))
+    mexErrMsgIdAndTxt( argError.c_str(), "If xScale is provided, yScale must be provided as well, and vice versa.");
+  if (xScale <= 0 || (xScale == 1 && yScale == 1))
+    methodResize              = -1;
+  if (nanMask && !mxIsLogical(nanMask))
+    mexErrMsgIdAndTxt( argError.c_str(), "nanMask must be a logical matrix.");
+
+
+  //---------------------------------------------------------------------------
+  FrameStream*                stream          = new FrameStream(inputPath, chunkSize, numThreads);
+  ImageProcessor<float>&      processor       = stream->processor;
+  processor.xScale            = xScale;
+  processor.yScale            = yScale;
+  processor.emptyProb         = emptyProb;
+  processor.subtractZero      = subtractZero;
+  processor.methodInterp      = methodInterp;
+  processor.methodResize      = methodResize;
+
+  // Get parameters of image stack
+  int                         numFrames       = 0;
+  for (size_t iIn = 0; iIn < inputPath.size() && numFrames < maxNumFrames; ++iIn) {
+    if (!stream->files.open(iIn, inputPath[iIn].c_str())) {
+      delete stream;
+      mexErrMsgIdAndTxt(loadError.c_str(), "Inconsistent image format in input file %d vs. first file.", static_cast<int>(iIn + 1));
+    }
+    const size_t              numPages        = stream->files.numPages[iIn];
+    for (size_t iPage = firstFrame; iPage < numPages && numFrames < maxNumFrames; iPage += 1 + frameSkip, ++numFrames)
+      stream->request[iIn].add(static_cast<int>(iPage), numFrames);
+  }
+  stream->numFrames           = numFrames;
+  processor.maxNumFrames      = numFrames;
+
+  const int                   srcWidth        = stream->files.width;
+  const int                   srcHeight       = stream->files.height;
+  if (nanMask) {
+    if (mxGetM(nanMask) != srcHeight || mxGetN(nanMask) != srcWidth) {
+      delete stream;
+      mexErrMsgIdAndTxt( loadError.c_str(), "Incorrect size of nanMask, must be equal to original image size (width = %d, height = %d).", srcWidth, srcHeight);
+    }
+    const mxLogical*          mask            = mxGetLogicals(nanMask);
+    stream->nanMask.assign(mask, mask + mxGetNumberOfElements(nanMask));
+    processor.nanMask         = (const bool*) stream->nanMask.data();
+  }
+
+  // Shifts are copied since the input arrays are not retained by Matlab
+  if (matXShift) {
+    if (!copyShifts(matXShift, stream->xShift, numFrames) || !copyShifts(matYShift, stream->yShift, numFrames)) {
+      delete stream;
+      mexErrMsgIdAndTxt( shiftError.c_str(), "Number of shifts is less than the number of frames (%d) in this image stack.", numFrames);
+    }
+    if (hasShifts(stream->xShift) || hasShifts(stream->yShift)) {
+      processor.xShift        = stream->xShift.data();
+      processor.yShift        = stream->yShift.data();
+    }
+  }
+
+  // Adjust for scaling if provided
+  stream->imgWidth            = srcWidth ;
+  stream->imgHeight           = srcHeight;
+  if (processor.methodResize >= 0) {
+    stream->imgWidth          = cvRound(srcWidth  * processor.xScale);
+    stream->imgHeight         = cvRound(srcHeight * processor.yScale);
+    processor.condenser       = new CondenserInfo2D(srcWidth, srcHeight, stream->imgWidth, stream->imgHeight);
+  }
+  processor.nFramePixels      = stream->imgHeight * stream->imgWidth;
+  processor.frameOffset       = processor.nFramePixels;
+  processor.imgClass          = mxSINGLE_CLASS;
+
+  stream->statMean.assign(processor.nFramePixels, 0.);
+  stream->statMin .assign(processor.nFramePixels, 0.);
+  stream->statMax .assign(processor.nFramePixels, 0.);
+  stream->stackStats          = new ImageStatistics( processor.nFramePixels, stream->statMean.data(), stream->statMin.data(), stream->statMax.data() );
+
+  return stream;
+}
+
+
+#endif //FRAMESTREAM_H
@@ -0,0 +1,146 @@
+/**
+  Pixel-major (time-contiguous) storage of image stacks, i.e. a numFrames x numPixels
+  column-major array in which the time trace of each pixel is contiguous in memory.
+
+  Writing frames one at a time into such an array touches a different cache line for
+  every pixel, which is slow and causes false sharing between threads that process
+  neighboring frames. Instead, frames are processed into staging blocks of BLOCK_FRAMES
+  consecutive frames each, and every block is transposed into the output as soon as all
+  of its frames are available. The transposition is tiled so that each output cache line
+  is completely written while it is still in the L1 cache.
+*/
+
+
+#ifndef FRAMETRANSPOSE_H
+#define FRAMETRANSPOSE_H
+
+#include <map>
+#include <mutex>
+#include <vector>
+#include <algorithm>
+
+
+
+//_________________________________________________________________________
+/**
+  Transposes blocks of frames into a pixel-major output array. acquire() returns the
+  staging memory for a given frame, and release() signals that the frame has been
+  written, which triggers the transposition of its block once it is complete. Both are
+  thread-safe, so that frames can be processed concurrently and in any order. Frames
+  that are never written must be announced with skip() before any are acquired, so that
+  the blocks containing them can be considered complete.
+*/
+template<typename Pixel>
+class FrameTransposer
+{
+public:
+  static const size_t         BLOCK_FRAMES    = 16;     ///< frames per staging block
+  static const size_t         TILE_PIXELS     = 64;     ///< pixels per tile of the transposition
+
+protected:
+  struct Block
+  {
+    std::vector<Pixel>        data;                     ///< frame-major copy of the block
+    size_t                    numLeft;                  ///< frames that have yet to be released
+  };
+
+  Pixel*                      output;
+  const size_t                numFrames;
+  const size_t                framePixels;
+  std::vector<size_t>         blockFrames;              ///< frames to be written per block
+  std::map<size_t, Block*>    pending;
+  std::vector<Block*>         spare;                    ///< recycled blocks
+  std::mutex                  lock;
+
+public:
+  FrameTransposer(Pixel* output, const size_t numFrames, const size_t framePixels)
+    : output      (output)
+    , numFrames   (numFrames)
+    , framePixels (framePixels)
+    , blockFrames ((numFrames + BLOCK_FRAMES - 1) / BLOCK_FRAMES, BLOCK_FRAMES)
+  {
+    if (!blockFrames.empty())
+      blockFrames.back()      = numFrames - (blockFrames.size() - 1) * BLOCK_FRAMES;
+  }
+
+  ~FrameTransposer()
+  {
+    for (typename std::map<size_t, Block*>::iterator iBlock = pending.begin(); iBlock != pending.end(); ++iBlock)
+      delete iBlock->second;
+    for (size_t iSpare = 0; iSpare < spare.size(); ++iSpare)
+      delete spare[iSpare];
+  }
+
+  /// Excludes frame iFrame from the output, e.g. if it is to be filled in by other means.
+  void skip(const size_t iFrame)
+  {
+    --blockFrames[iFrame / BLOCK_FRAMES];
+  }
+
+  /// Returns the staging memory (of framePixels values, in frame layout) for frame iFrame.
+  Pixel* acquire(const size_t iFrame)
+  {
+    const size_t              iBlock          = iFrame / BLOCK_FRAMES;
+    std::lock_guard<std::mutex>   guard(lock);
+    Block*&                   block           = pending[iBlock];
+    if (!block) {
+      if (spare.empty())      block           = new Block;
+      else {
+        block                 = spare.back();
+        spare.pop_back();
+      }
+      block->data.resize(BLOCK_FRAMES * framePixels);
+      block->numLeft          = blockFrames[iBlock];
+    }
+    return block->data.data() + (iFrame % BLOCK_FRAMES) * framePixels;
+  }
+
+  /// Signals that frame iFrame has been written to the memory returned by acquire().
+  void release(const size_t iFrame)
+  {
+    const size_t              iBlock          = iFrame / BLOCK_FRAMES;
+    Block*                    block           = 0;
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      typename std::map<size_t, Block*>::iterator found = pending.find(iBlock);
+      if (--found->second->numLeft > 0)       return;
+      block                   = found->second;
+      pending.erase(found);
+    }
+
+    // The block is no longer accessible to other threads, so the transposition can be done without locking
+    transpose(block->data.data(), iBlock * BLOCK_FRAMES, std::min(BLOCK_FRAMES, numFrames - iBlock * BLOCK_FRAMES));
+
+    std::lock_guard<std::mutex>   guard(lock);
+    spare.push_back(block);
+  }
+
+protected:
+  /**
+    Copies numBlock frames starting at firstFrame from the frame-major source to the
+    pixel-major output. Frames that were skipped contain garbage that is overwritten
+    later by the caller.
+  */
+  void transpose(const Pixel* source, const size_t firstFrame, const size_t numBlock) const
+  {
+    for (size_t firstPix = 0; firstPix < framePixels; firstPix += TILE_PIXELS) {
+      const size_t            endPix          = std::min(firstPix + TILE_PIXELS, framePixels);
+      for (size_t iFrame = 0; iFrame < numBlock; ++iFrame) {
+        const Pixel*          frame           = source + iFrame * framePixels;
+        Pixel*                target          = output + firstFrame + iFrame;
+        for (size_t iPix = firstPix; iPix < endPix; ++iPix)
+          target[iPix * numFrames]            = frame[iPix];
+      }
+    }
+  }
+
+private:
+  FrameTransposer(const FrameTransposer&);
+  FrameTransposer& operator=(const FrameTransposer&);
+};
+
+template<typename Pixel> const size_t FrameTransposer<Pixel>::BLOCK_FRAMES;
+template<typename Pixel> const size_t FrameTransposer<Pixel>::TILE_PIXELS;
+
+
+#endif //FRAMETRANSPOSE_H
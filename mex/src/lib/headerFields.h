@@ -0,0 +1,221 @@
+/**
+  Single-pass tokenizer for text headers consisting of "key = value" lines, such as the
+  TIFF image description written by ScanImage for every frame.
+
+  HeaderFields locates all lines of a description once, using memchr() (which the C
+  library implements with vectorized scans) to find line breaks and separators, and then
+  serves field lookups from the resulting index without rescanning the text. Numbers are
+  parsed with fastParseDouble(), which handles the common case of decimal values with up
+  to 19 significant digits exactly without going through strtod().
+*/
+
+
+#ifndef HEADERFIELDS_H
+#define HEADERFIELDS_H
+
+#include <vector>
+#include <cstring>
+#include <cstdlib>
+#include <cstdint>
+#include <algorithm>
+
+
+
+/**
+  Parses an integer starting at str (after any leading whitespace), and advances str past
+  it. Returns false if there are no digits before end.
+*/
+inline bool fastParseInteger(const char*& str, const char* end, int64_t& value)
+{
+  const char*                 ptr             = str;
+  while (ptr < end && (*ptr == ' ' || *ptr == '\t'))  ++ptr;
+
+  const bool                  isNegative      = ( ptr < end && *ptr == '-' );
+  if (ptr < end && (*ptr == '-' || *ptr == '+'))      ++ptr;
+
+  const char*                 digits          = ptr;
+  uint64_t                    magnitude       = 0;
+  for (; ptr < end && *ptr >= '0' && *ptr <= '9'; ++ptr)
+    magnitude                 = 10 * magnitude + (*ptr - '0');
+  if (ptr == digits)          return false;
+
+  value                       = ( isNegative ? -static_cast<int64_t>(magnitude) : static_cast<int64_t>(magnitude) );
+  str                         = ptr;
+  return true;
+}
+
+
+/**
+  Parses a floating point number starting at str (after any leading whitespace), and
+  advances str past it. Numbers with at most 19 significant digits and a decimal exponent
+  of at most 22 in magnitude are converted exactly via a single multiplication or
+  division (Clinger's fast path); anything else, including nan and inf, is deferred to
+  strtod(). Returns false if no number could be parsed.
+*/
+inline bool fastParseDouble(const char*& str, const char* end, double& value)
+{
+  static const double         POW10[]         = { 1e0 , 1e1 , 1e2 , 1e3 , 1e4 , 1e5 , 1e6 , 1e7
+                                                , 1e8 , 1e9 , 1e10, 1e11, 1e12, 1e13, 1e14, 1e15
+                                                , 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+                                                };
+
+  const char*                 ptr             = str;
+  while (ptr < end && (*ptr == ' ' || *ptr == '\t'))  ++ptr;
+  const char*                 start           = ptr;
+
+  const bool                  isNegative      = ( ptr < end && *ptr == '-' );
+  if (ptr < end && (*ptr == '-' || *ptr == '+'))      ++ptr;
+
+  // Accumulate up to 19 significant digits, which always fit in 64 bits
+  uint64_t                    mantissa        = 0;
+  int                         numDigits       = 0;
+  int                         exponent        = 0;
+  bool                        hasDigits       = false;
+  bool                        isExact         = true;
+  for (; ptr < end && *ptr >= '0' && *ptr <= '9'; ++ptr, hasDigits = true) {
+    if (numDigits < 19)       { mantissa = 10 * mantissa + (*ptr - '0'); numDigits += (mantissa > 0); }
+    else                      { ++exponent; isExact = isExact && *ptr == '0'; }
+  }
+  if (ptr < end && *ptr == '.') {
+    for (++ptr; ptr < end && *ptr >= '0' && *ptr <= '9'; ++ptr, hasDigits = true) {
+      if (numDigits < 19)     { mantissa = 10 * mantissa + (*ptr - '0'); numDigits += (mantissa > 0); --exponent; }
+      else                    isExact = isExact && *ptr == '0';
+    }
+  }
+
+  if (hasDigits && ptr < end && (*ptr == 'e' || *ptr == 'E')) {
+    const char*               expStart        = ptr + 1;
+    int64_t                   expValue;
+    if (expStart < end && *expStart != ' ' && fastParseInteger(expStart, end, expValue)) {
+      if (expValue > 1000 || expValue < -1000)  isExact = false;
+      else                    exponent       += static_cast<int>(expValue);
+      ptr                     = expStart;
+    }
+  }
+
+  if (hasDigits && isExact && mantissa <= (uint64_t(1) << 53) && exponent >= -22 && exponent <= 22) {
+    double                    result          = static_cast<double>(mantissa);
+    result                    = ( exponent < 0 ? result / POW10[-exponent] : result * POW10[exponent] );
+    value                     = ( isNegative ? -result : result );
+    str                       = ptr;
+    return true;
+  }
+
+  // Slow path, where strtod() requires a terminated string
+  char                        buffer[64];
+  const size_t                length          = std::min<size_t>(end - start, sizeof(buffer) - 1);
+  std::memcpy(buffer, start, length);
+  buffer[length]              = 0;
+  char*                       parsed;
+  value                       = std::strtod(buffer, &parsed);
+  if (parsed == buffer)       return false;
+  str                         = start + (parsed - buffer);
+  return true;
+}
+
+
+
+//_________________________________________________________________________
+/**
+  Index of the "key = value" lines of a text header. Keys and values are stored as
+  pointers into the original text with surrounding whitespace removed, so the text must
+  outlive any lookups. Lines without a '=' separator are ignored.
+*/
+class HeaderFields
+{
+public:
+  struct Field
+  {
+    const char*               key;
+    size_t                    keyLength;
+    const char*               value;
+    const char*               valueEnd;
+  };
+
+protected:
+  std::vector<Field>          fields;
+
+public:
+  /// Indexes all fields of the given null-terminated text, replacing any previous content.
+  void parse(const char* text)
+  {
+    parse(text, std::strlen(text));
+  }
+
+  void parse(const char* text, const size_t length)
+  {
+    fields.clear();
+    const char*               end             = text + length;
+    for (const char* line = text; line < end; ) {
+      const char*             lineEnd         = static_cast<const char*>( std::memchr(line, '\n', end - line) );
+      if (!lineEnd)           lineEnd         = end;
+
+      const char*             separator       = static_cast<const char*>( std::memchr(line, '=', lineEnd - line) );
+      if (separator) {
+        Field                 field;
+        const char*           keyEnd          = separator;
+        while (line   < keyEnd  && isBlank(*line      ))  ++line;
+        while (keyEnd > line    && isBlank(keyEnd[-1] ))  --keyEnd;
+        field.key             = line;
+        field.keyLength       = keyEnd - line;
+        field.value           = separator + 1;
+        field.valueEnd        = lineEnd;
+        while (field.value    < field.valueEnd && isBlank(*field.value      ))  ++field.value;
+        while (field.valueEnd > field.value    && isBlank(field.valueEnd[-1]))  --field.valueEnd;
+        fields.push_back(field);
+      }
+      line                    = lineEnd + 1;
+    }
+  }
+
+  size_t        size() const                  { return fields.size(); }
+  const Field&  operator[](const size_t i) const  { return fields[i]; }
+
+  /// Returns the field with the given key, or null if there is none.
+  const Field* find(const char* key, const size_t keyLength) const
+  {
+    for (size_t iField = 0; iField < fields.size(); ++iField) {
+      const Field&            field           = fields[iField];
+      if (field.keyLength == keyLength && std::memcmp(field.key, key, keyLength) == 0)
+        return &field;
+    }
+    return 0;
+  }
+
+  /// Parses a scalar value, returning false if the field is missing or not a number.
+  bool getScalar(const char* key, const size_t keyLength, double& value) const
+  {
+    const Field*              field           = find(key, keyLength);
+    const char*               str             = ( field ? field->value : 0 );
+    return field && fastParseDouble(str, field->valueEnd, value);
+  }
+
+  /**
+    Parses a vector value of the form [x1 x2 ... xN] or [x1,x2,...,xN] (or with ';' as
+    separator), appending the numbers to data. Returns false if the field is missing or
+    the value is not bracketed.
+  */
+  template<typename Number>
+  bool getVector(const char* key, const size_t keyLength, std::vector<Number>& data) const
+  {
+    const Field*              field           = find(key, keyLength);
+    if (!field)               return false;
+
+    const char*               str             = static_cast<const char*>( std::memchr(field->value, '[', field->valueEnd - field->value) );
+    if (!str)                 return false;
+    for (++str; str < field->valueEnd && *str != ']'; ) {
+      double                  number;
+      if (!fastParseDouble(str, field->valueEnd, number))
+        return false;
+      data.push_back(static_cast<Number>(number));
+      while (str < field->valueEnd && (*str == ' ' || *str == ',' || *str == ';'))  ++str;
+    }
+    return true;
+  }
+
+protected:
+  static bool isBlank(const char c) { return c == ' ' || c == '\t' || c == '\r'; }
+};
+
+
+#endif //HEADERFIELDS_H
@@ -0,0 +1,794 @@
+/**
+  Processing stages for loading image stacks frame by frame: black frame detection,
+  translation, masking and resizing, with the output written directly to Matlab arrays.
+  FramePipeline distributes this work over a pool of threads, and readFrames() feeds it
+  with frames from memory-mapped or decoded files.
+
+  TIFF files are decoded via libtiff (see tiffFrames.h). Other formats require the
+  modified OpenCV build (__OPENCV_HACK_SAK__) for multi-page access, and are otherwise
+  read as single images.
+*/
+
+
+#ifndef IMAGEPROCESSOR_H
+#define IMAGEPROCESSOR_H
+
+#include <mutex>
+#include <atomic>
+#include <vector>
+#include <limits>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <mex.h>
+#include <opencv2/core.hpp>
+#include <opencv2/imgcodecs.hpp>
+#include <opencv2/imgproc.hpp>
+#include "matUtils.h"
+#include "cvToMatlab.h"
+#include "manipulateImage.h"
+#include "imageStatistics.h"
+#include "imageCondenser.h"
+#include "workerThreads.h"
+#include "tiffIndex.h"
+#include "mappedTiff.h"
+#include "readAhead.h"
+#include "tiffFrames.h"
+#include "scanImageSync.h"
+#include "frameTranspose.h"
+
+
+
+//_________________________________________________________________________
+/**
+  Fast (non-cryptographic) 64-bit hash of the pixel data of a frame, which can be compared
+  across reads to verify that the content of a file has not changed. This is FNV-1a applied
+  to eight bytes at a time, with an additional shift to mix the high into the low bits.
+*/
+inline uint64_t hashFrame(const cv::Mat& image)
+{
+  static const uint64_t       FNV_PRIME       = 0x100000001b3ULL;
+  uint64_t                    hash            = 0xcbf29ce484222325ULL;
+  const size_t                rowBytes        = image.cols * image.elemSize();
+  for (int iRow = 0; iRow < image.rows; ++iRow) {
+    const unsigned char*      row             = image.ptr(iRow);
+    size_t                    iByte           = 0;
+    for (uint64_t word; iByte + sizeof(word) <= rowBytes; iByte += sizeof(word)) {
+      std::memcpy(&word, row + iByte, sizeof(word));
+      hash                    = (hash ^ word) * FNV_PRIME;
+      hash                   ^= hash >> 32;
+    }
+    for (; iByte < rowBytes; ++iByte)
+      hash                    = (hash ^ row[iByte]) * FNV_PRIME;
+  }
+  return hash;
+}
+
+
+//_________________________________________________________________________
+/// Per-thread temporary storage for ImageProcessor.
+struct FrameScratch
+{
+  cv::Mat             frmClone;
+  cv::Mat             frmTemp ;
+  cv::Mat             translator;
+  float*              xTrans;
+  float*              yTrans;
+
+  FrameScratch()
+    : translator    (2, 3, CV_32F)
+    , xTrans        (translator.ptr<float>(0))
+    , yTrans        (translator.ptr<float>(1))
+  {
+    xTrans[0]                   = 1;
+    xTrans[1]                   = 0;
+    yTrans[0]                   = 0;
+    yTrans[1]                   = 1;
+  }
+};
+
+
+//_________________________________________________________________________
+/**
+  Processing stages (black frame detection, translation, masking and resizing) for a 
+  single frame. Once calibrate() has been called with the first frame of the stack, 
+  the configuration is read-only and frames can be processed by concurrent threads,
+  each with their own FrameScratch storage.
+
+  Frame iFrame is written to imgData + (iFrame - firstIndex) * frameOffset, so that
+  imgData can hold either the full stack or only a chunk of it. Alternatively, if a
+  transposer is provided, frames are written to its staging blocks for pixel-major output.
+
+  If frameValid is provided, frames that cannot be read (e.g. truncated pages) are filled
+  with NaN and flagged via invalidate() instead of aborting the read. If frameHash is
+  provided, the hashFrame() of each input frame (before any processing) is stored there.
+  Both are indexed in the same way as imgData, i.e. relative to firstIndex.
+*/
+template<typename Pixel>
+class ImageProcessor
+{
+public:
+  ImageProcessor() 
+    : imgData       (0)
+    , firstIndex    (0)
+    , xShift        (0)
+    , yShift        (0)
+    , xScale        (0)
+    , yScale        (0)
+    , maxNumFrames  (std::numeric_limits<int>::max())
+    , subtractZero  (false)
+    , methodInterp  (0)
+    , methodResize  (0)
+    , nanMask       (0)
+    , condenser     (0)
+    , transposer    (0)
+    , frameValid    (0)
+    , frameHash     (0)
+    , nFramePixels  (0)
+    , frameOffset   (0)
+    , emptyNSigmas  (5)
+    , emptyProb     (-999)
+    , calibrationIndex(0)
+    , stackStats    (0)
+    , offset        (0)
+    , maxZeroValue  (std::numeric_limits<double>::infinity())
+    , emptyPix      ( static_cast<Pixel>(mxGetNaN()) )
+    , emptyValue    ( mxGetNaN() )
+  {
+  }
+
+  /// Use the first frame read to estimate the black level and variance.
+  void calibrate(const cv::Mat& image, const size_t iFrame)
+  {
+    calibrationIndex            = iFrame;
+    if (emptyProb <= 0)
+      return;
+
+    cvCall<AccumulateMatStatistics>(image, statistics);
+
+    // Account for multiple samples when computing the fraction of pixels that are
+    // expected to fall below the zero + noise threshold
+    emptyProb                   = std::pow(emptyProb, nFramePixels);
+    offset                      = static_cast<Pixel>( statistics.getMean() );
+    maxZeroValue                = offset + emptyNSigmas * statistics.getRMS();
+  }
+
+  void operator()(const cv::Mat& image, const size_t iFrame, FrameScratch& scratch) const
+  {
+    if (frameHash)
+      frameHash[iFrame - firstIndex]      = hashFrame(image);
+
+    if (!transposer) {
+      process(image, iFrame, scratch, imgData + (iFrame - firstIndex) * frameOffset);
+      return;
+    }
+
+    Pixel*                      frmData = transposer->acquire(iFrame);
+    process(image, iFrame, scratch, frmData);
+    transposer->release(iFrame);
+  }
+
+  /// Fills the given frame with NaN and marks it as invalid; requires frameValid to be set.
+  void invalidate(const size_t iFrame) const
+  {
+    frameValid[iFrame - firstIndex]       = false;
+    if (frameOffset < 1)      return;     // data is not stored
+
+    Pixel*                      frmData = ( transposer ? transposer->acquire(iFrame) : imgData + (iFrame - firstIndex) * frameOffset );
+    std::fill(frmData, frmData + nFramePixels, emptyPix);
+    if (transposer)
+      transposer->release(iFrame);
+  }
+
+protected:
+  void process(const cv::Mat& image, const size_t iFrame, FrameScratch& scratch, Pixel* frmData) const
+  {
+    const cv::Mat*              source  = 0;
+    cv::Mat*                    target  = &scratch.frmTemp;
+
+    //---------------------------------------------------------------------------
+    //  Black frame detection
+    //---------------------------------------------------------------------------
+
+    if (emptyProb > 0) {
+      bool                      isEmpty = ( iFrame == calibrationIndex );   // by definition
+      if (!isEmpty) {
+        static const double     negInf  = -std::numeric_limits<double>::infinity();
+        int                     numZeros;
+        cvCall<CountPixelsInRange>(image, negInf, maxZeroValue, numZeros);
+        if (numZeros >= emptyProb * image.rows * image.cols)
+          isEmpty               = true;
+      }
+
+      // Special case where the entire frame should be set to NaN
+      if (isEmpty) {
+        if (frameOffset > 0) {  // Only required in case of storing data
+          for (int iPix = 0; iPix < nFramePixels; ++iPix)
+            frmData[iPix]       = emptyPix;
+        }
+        return;                 // Skip all further processing
+      }
+    }
+
+
+    //---------------------------------------------------------------------------
+    //  Translation
+    //---------------------------------------------------------------------------
+
+    if (xShift) {
+      // Unfortunately we have to copy the frame before warping, because otherwise
+      // the operations are performed with the input and not output precision
+      image.convertTo(scratch.frmClone, CV_32F);
+
+      // Perform an affine transformation i.e. sub-pixel shift via interpolation
+      if (methodInterp >= 0)
+      {
+        scratch.xTrans[2]       = float( xShift[iFrame] );
+        scratch.yTrans[2]       = float( yShift[iFrame] );
+        cv::warpAffine( scratch.frmClone, scratch.frmTemp, scratch.translator, image.size()
+                      , methodInterp, cv::BorderTypes::BORDER_CONSTANT, emptyValue
+                      );
+      }
+
+      // Perform a simple pixel shift
+      else {
+        scratch.frmTemp.create(image.size(), CV_32F);
+        cvCall<CopyShiftedImage32>(scratch.frmTemp, scratch.frmClone, yShift[iFrame], xShift[iFrame], emptyPix);
+      }
+
+      // Swap source and scratch space for next operation
+      source                  = &scratch.frmTemp;
+      target                  = &scratch.frmClone;
+    }
+    else {
+      // Use original source for the next operation
+      source                  = &image;
+      target                  = &scratch.frmTemp;
+    } // translation
+
+
+    //---------------------------------------------------------------------------
+    //  One-shot masking and resize
+    //---------------------------------------------------------------------------
+
+    // For area interpolation, can directly write to output since this is the last operation
+    if (methodResize == cv::InterpolationFlags::INTER_AREA)
+      cvTypeCall<ImageCondenser2D, Pixel>(*source, frmData, condenser, offset, nanMask, emptyPix);
+
+
+    //-------------------------------------------------------------------------
+    //  Apply mask only
+    //-------------------------------------------------------------------------
+
+    else if (methodResize <= 0)
+      cvMatlabCall<MatToMatlab>(*source, imgClass, frmData, offset, nanMask, emptyPix);
+
+
+    //---------------------------------------------------------------------------
+    //  Mask and resize (but does not ignore nan)
+    //---------------------------------------------------------------------------
+
+    // No support for other type of resizing methods; use default functions regardless of ability to ignore nan
+    else {
+      if (nanMask) {
+        target->convertTo(scratch.frmClone, CV_32F);
+        cvCall<MaskPixels>(scratch.frmClone, nanMask, emptyPix);
+        target                = &scratch.frmClone;
+      } // apply mask
+
+      cv::resize(*source, *target, cv::Size(), xScale, yScale, methodResize);
+
+      // Set source for the next operation
+      source                  = target;
+
+
+      // Copy to Matlab
+      cvMatlabCall<MatToMatlab>(*source, imgClass, frmData, offset);
+    } // resize
+
+
+
+    //---------------------------------------------------------------------------
+    //  Compute image statistics
+    //---------------------------------------------------------------------------
+
+    if (stackStats)
+      stackStats->add(frmData);
+  }
+
+
+public:
+  mxClassID           imgClass;
+  Pixel*              imgData;
+  size_t              firstIndex;
+  const double*       xShift;
+  const double*       yShift;
+  double              xScale;
+  double              yScale;
+  int                 maxNumFrames;
+  bool                subtractZero;
+  int                 methodInterp;
+  int                 methodResize;
+  const bool*         nanMask;
+  CondenserInfo2D*    condenser;
+  FrameTransposer<Pixel>* transposer;
+  mxLogical*          frameValid;
+  uint64_t*           frameHash;
+
+  int                 nFramePixels;
+  int                 frameOffset;
+  double              emptyNSigmas;
+  double              emptyProb;
+  size_t              calibrationIndex;
+  
+  ImageStatistics*    stackStats;
+  SampleStatistics    statistics;
+  Pixel               offset;
+  double              maxZeroValue;
+
+protected:
+  Pixel               emptyPix;
+  const cv::Scalar    emptyValue;
+};
+
+
+//_________________________________________________________________________
+/**
+  Producer/consumer pipeline that runs the ImageProcessor stages on decoded frames. 
+  Frames submitted by one or more decoding threads are copied into a bounded ring of 
+  buffers, from which a pool of worker threads take them for processing. Since each 
+  frame's output location is fixed by its index, workers can write out of order.
+
+  The first frame submitted is always processed directly in the submitting thread since
+  it is used for calibration, and start() should only be called once isCalibrated() is
+  true, i.e. the caller should submit frames from the main thread until a valid one has
+  been found. With numThreads < 1 all frames are processed directly in the submitting
+  threads, one at a time.
+*/
+template<typename Pixel>
+class FramePipeline
+{
+protected:
+  struct FrameSlot
+  {
+    cv::Mat           image;
+    size_t            index;
+  };
+
+public:
+  FramePipeline(ImageProcessor<Pixel>& processor, const int numThreads)
+    : processor (processor)
+    , numThreads(numThreads)
+    , calibrated(false)
+    , ring      (numThreads > 0 ? 2*numThreads : 0)
+    , freeSlots (ring.size())
+    , readySlots(ring.size())
+  {
+    for (size_t iSlot = 0; iSlot < ring.size(); ++iSlot)
+      freeSlots.push(&ring[iSlot]);
+  }
+
+  ~FramePipeline() { finish(); }
+
+  /// True once the first valid frame has been submitted and used for calibration.
+  bool isCalibrated() const { return calibrated; }
+
+  /// Starts worker threads, if any; must be called after the first frame has been submitted.
+  void start()
+  {
+    if (!ring.empty())
+      workers.start(numThreads, [this](int) { consume(); });
+  }
+
+  /**
+    If persistent is true, the image data is guaranteed to remain valid until finish() 
+    (e.g. for memory-mapped files), and is handed off to workers without copying.
+  */
+  bool submit(const cv::Mat& image, const size_t iFrame, const bool persistent = false)
+  {
+    if (workers.failed())
+      return false;
+
+    // Calibration is guarded in case the caller has not found a valid frame before start(),
+    // so that it happens exactly once. Any problems with the data format will be detected
+    // here, before starting workers
+    if (!calibrated) {
+      std::lock_guard<std::mutex> guard(lock);
+      if (!calibrated) {
+        processor.calibrate(image, iFrame);
+        processor(image, iFrame, scratch);
+        calibrated            = true;
+        return true;
+      }
+    }
+
+    // Serial processing, with the shared scratch space used by one thread at a time
+    if (ring.empty()) {
+      std::lock_guard<std::mutex> guard(lock);
+      processor(image, iFrame, scratch);
+      return true;
+    }
+
+    // Hand off to worker threads
+    FrameSlot*                slot;
+    if (!freeSlots.pop(slot))
+      return false;
+    if (persistent)           slot->image = image;
+    else                      image.copyTo(slot->image);
+    slot->index               = iFrame;
+    return readySlots.push(slot);
+  }
+
+  /// Waits for all frames to be processed; returns false if any of the workers failed.
+  bool finish()
+  {
+    readySlots.close();
+    workers.join();
+    return !workers.failed();
+  }
+
+  /**
+    Records that the given frame cannot be read, which is tolerated if the processor keeps
+    track of valid frames, and otherwise fails with the given message. Returns false in the
+    latter case.
+  */
+  bool invalidate(const size_t iFrame, const std::string& what)
+  {
+    if (!processor.frameValid) {
+      fail(what);
+      return false;
+    }
+    processor.invalidate(iFrame);
+    return true;
+  }
+
+  void fail(const std::string& what) { workers.fail(what); }
+  bool failed() const { return workers.failed(); }
+  const std::string& error() const { return workers.error(); }
+
+protected:
+  void consume()
+  {
+    FrameScratch              workspace;
+    FrameSlot*                slot;
+    while (readySlots.pop(slot)) {
+      if (!workers.failed()) {
+        try                             { processor(slot->image, slot->index, workspace); }
+        catch (const std::exception& e) { workers.fail(e.what()); }
+      }
+      freeSlots.push(slot);
+    }
+  }
+
+protected:
+  ImageProcessor<Pixel>&        processor;
+  const int                     numThreads;
+  std::atomic<bool>             calibrated;
+  std::mutex                    lock;                   ///< for calibration and serial processing
+  FrameScratch                  scratch;
+  std::vector<FrameSlot>        ring;
+  BoundedQueue<FrameSlot*>      freeSlots;
+  BoundedQueue<FrameSlot*>      readySlots;
+  WorkerThreads                 workers;
+};
+
+
+//_________________________________________________________________________
+/// Pages to be read from a single file (in increasing order), and their output indices.
+struct FrameRequest
+{
+  std::vector<int>        pages;
+  std::vector<size_t>     frames;
+
+  void add(const int iPage, const size_t iFrame)
+  {
+    pages .push_back(iPage );
+    frames.push_back(iFrame);
+  }
+  size_t size() const { return pages.size(); }
+};
+
+
+#ifdef __OPENCV_HACK_SAK__
+//_________________________________________________________________________
+/**
+  Receives frames of a single file from cv::imreadmulti(), and submits them to the 
+  given sink (e.g. FramePipeline) with the output indices of the requested frames 
+  starting at begin. Stops reading after maxNumFrames have been received. If provided,
+  readAhead is advanced to the next page before each frame is submitted.
+*/
+template<typename Sink>
+class FileFrames : public cv::MatFunction
+{
+public:
+  FileFrames(Sink& pipeline, const FrameRequest& request, const size_t begin, const int maxNumFrames, TiffReadAhead* readAhead = 0)
+    : pipeline    (pipeline)
+    , request     (request)
+    , begin       (begin)
+    , maxNumFrames(maxNumFrames)
+    , numFrames   (0)
+    , readAhead   (readAhead)
+  { }
+
+  bool operator()(cv::Mat& image)
+  {
+    if (numFrames >= maxNumFrames)
+      return false;
+    const size_t          iRequest        = begin + numFrames++;
+    if (readAhead && numFrames < maxNumFrames)
+      readAhead->advance(request.pages, iRequest + 1);
+    return pipeline.submit(image, request.frames[iRequest]);
+  }
+
+protected:
+  Sink&                   pipeline;
+  const FrameRequest&     request;
+  const size_t            begin;
+  const int               maxNumFrames;
+  int                     numFrames;
+  TiffReadAhead*          readAhead;
+};
+#endif //__OPENCV_HACK_SAK__
+
+
+//_________________________________________________________________________
+/// Reports a failure to locate (if desc is null) or parse the image description of the given page.
+template<typename Sink>
+void failSync(Sink& pipeline, const FrameSyncParser& parser, const char* desc, const int iPage, const char* path)
+{
+  if (desc)   pipeline.fail(cv::format("Failed to parse %s for page %d of '%s'.", parser.errorField, iPage + 1, path));
+  else        pipeline.fail(cv::format("Failed to read image description tag for page %d of '%s'.", iPage + 1, path));
+}
+
+
+//_________________________________________________________________________
+/**
+  Submits the requested frames [begin, end) of a single file to the pipeline, which can be
+  any sink that provides the submit(), fail() and failed() methods of FramePipeline. If the
+  file has been memory-mapped, frames are headers that reference the mapped data directly.
+  Otherwise TIFF files are decoded page by page via libtiff, seeking with the page index if
+  provided. Failing that, the file is decoded by cv::imreadmulti(), once per run of pages 
+  with constant spacing, so that the decoder can skip over unwanted pages. In all cases 
+  readAhead, if provided, prefetches the following pages while the current one is being 
+  processed.
+
+  If sync is provided, the ScanImage synchronization information in the description of
+  each page is recorded as the page is read, so that the directory is traversed only once.
+  This is done for memory-mapped and libtiff-decoded files but not by the OpenCV fallbacks.
+
+  Pages that are truncated according to the page index, or that fail to decode, are passed
+  to the invalidate() method of the sink, which decides whether to skip or fail on them.
+
+  Compressed pages can be decompressed by up to stripThreads threads at once, each taking
+  a share of the strips or tiles of the page (see ParallelTiffSource).
+*/
+template<typename Sink>
+void readFrames ( Sink& pipeline, const char* path, const MappedTiff* mapped, const int mappedType
+                , const FrameRequest& request, const size_t begin, const size_t end
+                , TiffReadAhead* readAhead = 0, const TiffIndex* index = 0, FrameSyncTable* sync = 0
+                , const int stripThreads = 1
+                )
+{
+  FrameSyncParser             syncParser;
+  if (mapped) {
+    for (size_t iRequest = begin; iRequest < end; ++iRequest) {
+      if (readAhead)
+        readAhead->advance(request.pages, iRequest);
+      if (!mapped->isIntact(request.pages[iRequest])) {
+        if (!pipeline.invalidate(request.frames[iRequest], cv::format("Page %d of '%s' is truncated.", request.pages[iRequest] + 1, path)))
+          break;
+        continue;
+      }
+
+      const char*             desc            = 0;
+      size_t                  descLength      = 0;
+      if (sync && !( mapped->description(request.pages[iRequest], desc, descLength)
+                  && sync->record(request.frames[iRequest], desc, descLength, syncParser)
+                   )) {
+        failSync(pipeline, syncParser, desc, request.pages[iRequest], path);
+        break;
+      }
+
+      const cv::Mat           frame           ( mapped->height, mapped->width, mappedType
+                                              , const_cast<void*>(mapped->pageData(request.pages[iRequest]))
+                                              );
+      if (!pipeline.submit(frame, request.frames[iRequest], true))
+        break;
+    }
+    return;
+  }
+
+  ParallelTiffSource          source;
+  if (source.open(path, index, stripThreads)) {
+    cv::Mat                   frame;
+    for (size_t iRequest = begin; iRequest < end && !pipeline.failed(); ++iRequest) {
+      if (readAhead)
+        readAhead->advance(request.pages, iRequest);
+
+      const int               iPage           = request.pages[iRequest];
+      const bool              isTruncated     = ( index && static_cast<size_t>(iPage) < index->numPages() && !(*index)[iPage].intact );
+      if (isTruncated || !source.read(iPage, frame)) {
+        if (!pipeline.invalidate(request.frames[iRequest], cv::format(isTruncated ? "Page %d of '%s' is truncated." : "Failed to decode page %d of '%s'.", iPage + 1, path)))
+          break;
+        continue;
+      }
+
+      const char*             desc            = ( sync ? source.description() : 0 );
+      if (sync && !( desc && sync->record(request.frames[iRequest], desc, std::strlen(desc), syncParser) )) {
+        failSync(pipeline, syncParser, desc, request.pages[iRequest], path);
+        break;
+      }
+      if (!pipeline.submit(frame, request.frames[iRequest]))
+        break;
+    }
+    return;
+  }
+
+#ifdef __OPENCV_HACK_SAK__
+  for (size_t iRun = begin, iNext; iRun < end && !pipeline.failed(); iRun = iNext) {
+    const int                 stride          = ( iRun + 1 < end ? request.pages[iRun + 1] - request.pages[iRun] : 1 );
+    for (iNext = iRun + 1; iNext < end && request.pages[iNext] - request.pages[iNext - 1] == stride; ++iNext);
+
+    if (readAhead)
+      readAhead->advance(request.pages, iRun);
+    FileFrames<Sink>          frames(pipeline, request, iRun, static_cast<int>(iNext - iRun), readAhead);
+    cv::imreadmulti(path, &frames, cv::ImreadModes::IMREAD_UNCHANGED, request.pages[iRun], stride - 1);
+  }
+
+#else
+  if (begin < end && request.pages[begin] == 0) {
+    const cv::Mat             image           = cv::imread(path, cv::ImreadModes::IMREAD_UNCHANGED);
+    if (image.empty())        pipeline.fail(cv::format("Failed to decode '%s'.", path));
+    else                      pipeline.submit(image, request.frames[begin]);
+  }
+#endif //__OPENCV_HACK_SAK__
+}
+
+
+
+//_________________________________________________________________________
+/**
+  Collection of input files for a single image stack, which must all have the same image
+  format. Files are memory-mapped where the layout allows for it, and otherwise will be
+  decoded via libtiff (see readRange() for splitting this work), or by OpenCV for other
+  formats. The page index for each file is used to obtain the number of frames without
+  walking through the file, and to prefetch pages ahead of where they are read.
+*/
+class StackFiles
+{
+public:
+  std::vector<MappedTiff*>    mapped;         ///< null if the file is to be decoded
+  std::vector<int>            mappedType;     ///< OpenCV type of mapped frames
+  std::vector<TiffReadAhead*> readAhead;      ///< null if there is no page index
+  std::vector<TiffIndex>      index;          ///< empty if not a TIFF file
+  std::vector<size_t>         numPages;
+  int                         width;
+  int                         height;
+  int                         bitsPerSample;
+
+protected:
+  mutable std::atomic<uint64_t> rangePrefetched;    ///< by the read-aheads of readRange()
+  mutable std::atomic<uint64_t> rangeConsumed;
+
+public:
+  StackFiles(const size_t numFiles)
+    : mapped        (numFiles, 0)
+    , mappedType    (numFiles, -1)
+    , readAhead     (numFiles, 0)
+    , index         (numFiles)
+    , numPages      (numFiles, 0)
+    , width         (0)
+    , height        (0)
+    , bitsPerSample (0)
+    , rangePrefetched (0)
+    , rangeConsumed   (0)
+  { }
+
+  ~StackFiles()
+  {
+    for (size_t iFile = 0; iFile < mapped.size(); ++iFile) {
+      delete mapped[iFile];
+      delete readAhead[iFile];
+    }
+  }
+
+  /// Returns false if the image format of this file is inconsistent with previously opened ones.
+  bool open(const size_t iFile, const char* path)
+  {
+    TiffIndex&                index           = this->index[iFile];
+    if (!index.build(path)) {
+#ifdef __OPENCV_HACK_SAK__
+      numPages[iFile]         = cv::imfinfo(path, width, height, bitsPerSample, bitsPerSample > 0);
+#else
+      const cv::Mat           image           = cv::imread(path, cv::ImreadModes::IMREAD_UNCHANGED);
+      const int               imageBits       = static_cast<int>(8 * image.elemSize1());
+      if (bitsPerSample > 0 && (image.cols != width || image.rows != height || imageBits != bitsPerSample))
+        return false;
+      width                   = image.cols;
+      height                  = image.rows;
+      bitsPerSample           = imageBits;
+      numPages[iFile]         = ( image.empty() ? 0 : 1 );
+#endif
+      return true;
+    }
+
+    const int                 pageWidth       = static_cast<int>(index[0].width );
+    const int                 pageHeight      = static_cast<int>(index[0].height);
+    const int                 pageBits        = static_cast<int>(index[0].bitsPerSample);
+    if (bitsPerSample > 0 && (pageWidth != width || pageHeight != height || pageBits != bitsPerSample))
+      return false;
+    width                     = pageWidth;
+    height                    = pageHeight;
+    bitsPerSample             = pageBits;
+    numPages[iFile]           = index.numPages();
+
+    // Use memory mapping where the file layout allows for it
+    mapped[iFile]             = new MappedTiff;
+    if (mapped[iFile]->open(path, index))
+      mappedType[iFile]       = cvTiffSampleType(mapped[iFile]->bitsPerSample, mapped[iFile]->sampleFormat);
+    if (mappedType[iFile] < 0) {
+      delete mapped[iFile];
+      mapped[iFile]           = 0;
+    }
+
+    readAhead[iFile]          = new TiffReadAhead;
+    if (!readAhead[iFile]->open(path, index)) {
+      delete readAhead[iFile];
+      readAhead[iFile]        = 0;
+    }
+    return true;
+  }
+
+  /// Reads the requested frames [begin, end) of the given file into the sink, optionally recording their synchronization information.
+  template<typename Sink>
+  void read(Sink& sink, const size_t iFile, const char* path, const FrameRequest& request, const size_t begin, const size_t end, FrameSyncTable* sync = 0) const
+  {
+    readFrames(sink, path, mapped[iFile], mappedType[iFile], request, begin, end, readAhead[iFile], &index[iFile], sync);
+  }
+
+  /// True if the given file is a TIFF file that is decoded via libtiff, rather than memory-mapped.
+  bool isDecoded(const size_t iFile) const
+  {
+    return !mapped[iFile] && !index[iFile].empty();
+  }
+
+  /**
+    As read(), but with its own read-ahead so that this can be called concurrently for
+    disjoint ranges of frames of the same file. Pages are decompressed by up to 
+    stripThreads threads.
+  */
+  template<typename Sink>
+  void readRange(Sink& sink, const size_t iFile, const char* path, const FrameRequest& request, const size_t begin, const size_t end, FrameSyncTable* sync = 0, const int stripThreads = 1) const
+  {
+    TiffReadAhead             rangeAhead;
+    const bool                hasAhead        = ( !index[iFile].empty() && rangeAhead.open(path, index[iFile]) );
+    readFrames(sink, path, mapped[iFile], mappedType[iFile], request, begin, end, hasAhead ? &rangeAhead : 0, &index[iFile], sync, stripThreads);
+    rangePrefetched          += rangeAhead.bytesPrefetched;
+    rangeConsumed            += rangeAhead.bytesConsumed;
+  }
+
+  /// Total number of bytes for which read-ahead has been requested so far, over all files.
+  uint64_t bytesPrefetched() const
+  {
+    uint64_t                  total           = rangePrefetched;
+    for (size_t iFile = 0; iFile < readAhead.size(); ++iFile)
+      if (readAhead[iFile])   total          += readAhead[iFile]->bytesPrefetched;
+    return total;
+  }
+
+  /// Total number of bytes of pages that have been read so far, over all files with read-ahead.
+  uint64_t bytesConsumed() const
+  {
+    uint64_t                  total           = rangeConsumed;
+    for (size_t iFile = 0; iFile < readAhead.size(); ++iFile)
+      if (readAhead[iFile])   total          += readAhead[iFile]->bytesConsumed;
+    return total;
+  }
+
+private:
+  StackFiles(const StackFiles&);
+  StackFiles& operator=(const StackFiles&);
+};
+
+
+#endif //IMAGEPROCESSOR_H
@@ -150,17 +150,28 @@ struct DetectEmptyFrames
 
 
     // Iterate through frames and decide if each one is completely black
-    const int                 nFramePixels  = stack[0].rows * stack[0].cols;
-    emptyProb                 = std::pow(emptyProb, nFramePixels);
     for (size_t iFrame = 0; iFrame < stack.size(); ++iFrame)
     {
-      static const double     negInf        = -std::numeric_limits<double>::infinity();
-      int                     numZeros;
-      cvCall<CountPixelsInRange>(stack[iFrame], negInf, maxZeroValue, numZeros);
-      if (numZeros >= emptyProb * nFramePixels)
+      bool                    frameIsEmpty  = false;
+      operator()(stack[iFrame], frameIsEmpty, emptyProb, maxZeroValue);
+      if (frameIsEmpty)
         isEmpty[iFrame]       = true;
     }
   }
+
+  /**
+    Decides if a single frame is empty given the zero level maxZeroValue, e.g. as computed 
+    from the first frame of the stack by the above. This is for frames that are not all
+    held in memory at the same time.
+  */
+  void operator()(const cv::Mat& frame, bool& isEmpty, const double emptyProb, const double maxZeroValue)
+  {
+    static const double       negInf        = -std::numeric_limits<double>::infinity();
+    const int                 nFramePixels  = frame.rows * frame.cols;
+    int                       numZeros;
+    cvCall<CountPixelsInRange>(frame, negInf, maxZeroValue, numZeros);
+    isEmpty                   = ( numZeros >= std::pow(emptyProb, nFramePixels) * nFramePixels );
+  }
 };
 
 
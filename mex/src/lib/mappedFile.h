@@ -0,0 +1,111 @@
+/**
+  Read-only memory mapping of an entire file, via mmap() or the Windows equivalent.
+*/
+
+
+#ifndef MAPPEDFILE_H
+#define MAPPEDFILE_H
+
+#include <cstdint>
+
+#ifdef _WIN32
+#  ifndef NOMINMAX
+#    define NOMINMAX
+#  endif
+#  include <windows.h>
+#else
+#  include <fcntl.h>
+#  include <unistd.h>
+#  include <sys/mman.h>
+#  include <sys/stat.h>
+#endif
+
+
+
+class MappedFile
+{
+protected:
+  const unsigned char*        base;
+  uint64_t                    fileSize;
+#ifdef _WIN32
+  HANDLE                      file;
+  HANDLE                      mapping;
+#else
+  int                         file;
+#endif
+
+public:
+  MappedFile()
+    : base(0), fileSize(0)
+#ifdef _WIN32
+    , file(INVALID_HANDLE_VALUE), mapping(NULL)
+#else
+    , file(-1)
+#endif
+  { }
+
+  ~MappedFile() { close(); }
+
+  /// Returns false if the file cannot be opened or mapped.
+  bool open(const char* path)
+  {
+    close();
+
+#ifdef _WIN32
+    file                      = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE)       return fail();
+    LARGE_INTEGER             size;
+    if (!GetFileSizeEx(file, &size))        return fail();
+    fileSize                  = static_cast<uint64_t>(size.QuadPart);
+    mapping                   = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (mapping == NULL)                    return fail();
+    base                      = (const unsigned char*) MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    if (base == NULL)                       return fail();
+#else
+    file                      = ::open(path, O_RDONLY);
+    if (file < 0)                           return fail();
+    struct stat               info;
+    if (fstat(file, &info) != 0)            return fail();
+    fileSize                  = static_cast<uint64_t>(info.st_size);
+    void*                     view            = mmap(0, fileSize, PROT_READ, MAP_SHARED, file, 0);
+    if (view == MAP_FAILED)                 return fail();
+    base                      = (const unsigned char*) view;
+#endif
+    return true;
+  }
+
+  void close()
+  {
+#ifdef _WIN32
+    if (base)                               UnmapViewOfFile(base);
+    if (mapping != NULL)                    CloseHandle(mapping);
+    if (file != INVALID_HANDLE_VALUE)       CloseHandle(file);
+    mapping                   = NULL;
+    file                      = INVALID_HANDLE_VALUE;
+#else
+    if (base)                               munmap(const_cast<unsigned char*>(base), fileSize);
+    if (file >= 0)                          ::close(file);
+    file                      = -1;
+#endif
+    base                      = 0;
+    fileSize                  = 0;
+  }
+
+  bool                  isOpen() const  { return base != 0; }
+  const unsigned char*  data  () const  { return base; }
+  uint64_t              size  () const  { return fileSize; }
+
+protected:
+  bool fail()
+  {
+    close();
+    return false;
+  }
+
+private:
+  MappedFile(const MappedFile&);
+  MappedFile& operator=(const MappedFile&);
+};
+
+
+#endif //MAPPEDFILE_H
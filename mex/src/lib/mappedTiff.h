@@ -0,0 +1,168 @@
+/**
+  Memory-mapped access to the pixel data of uncompressed TIFF stacks.
+
+  This applies to files in which every page is stored uncompressed, in native byte
+  order, and as one or more strips that are contiguous in the file -- which is the
+  case for ScanImage acquisition files. Pixels can then be read directly from the
+  mapped file without any decoding or intermediate copies.
+*/
+
+
+#ifndef MAPPEDTIFF_H
+#define MAPPEDTIFF_H
+
+#include <vector>
+#include <cstring>
+#include <cstdint>
+#include <tiffio.h>
+#include "tiffIndex.h"
+#include "mappedFile.h"
+
+
+
+/**
+  Read-only memory mapping of a TIFF stack in which all pages have the layout required
+  by contiguousPixelOffset(), as well as identical dimensions and sample format. The
+  location of pages is obtained from the file's TiffIndex.
+*/
+class MappedTiff
+{
+public:
+  uint32                      width;
+  uint32                      height;
+  uint16                      bitsPerSample;
+  uint16                      sampleFormat;
+
+protected:
+  std::vector<uint64_t>       pageOffset;
+  std::vector<uint64_t>       ifdOffset;
+  std::vector<char>           pageIntact;
+  MappedFile                  mapped;
+  const unsigned char*        base;
+  uint64_t                    fileSize;
+  bool                        bigTiff;
+
+public:
+  MappedTiff()
+    : width(0), height(0), bitsPerSample(0), sampleFormat(0), base(0), fileSize(0), bigTiff(false)
+  { }
+
+  ~MappedTiff() { close(); }
+
+  /// Returns false if the file cannot be opened, or does not have a suitable layout for mapping.
+  bool open(const char* path)
+  {
+    TiffIndex                 index;
+    return index.build(path) && open(path, index);
+  }
+
+  /// As above, but with the index for the file already available.
+  bool open(const char* path, const TiffIndex& index)
+  {
+    close();
+    pageOffset.clear();
+    if (!index.isContiguous() || !index.isUniform())
+      return false;
+
+    width                     = index[0].width;
+    height                    = index[0].height;
+    bitsPerSample             = index[0].bitsPerSample;
+    sampleFormat              = index[0].sampleFormat;
+    pageOffset.resize(index.numPages());
+    ifdOffset .resize(index.numPages());
+    for (size_t iPage = 0; iPage < pageOffset.size(); ++iPage) {
+      pageOffset[iPage]       = index[iPage].dataOffset;
+      ifdOffset [iPage]       = index[iPage].ifdOffset;
+    }
+
+    if (!mapped.open(path))                 return fail();
+    base                      = mapped.data();
+    fileSize                  = mapped.size();
+
+    // Guard against truncated files, in which only some of the pages may be accessible
+    if (fileSize < 8)                       return fail();
+    bigTiff                   = ( read16(base + 2) == 43 );
+    const uint64_t            pageBytes       = frameBytes();
+    pageIntact.resize(pageOffset.size());
+    for (size_t iPage = 0; iPage < pageOffset.size(); ++iPage)
+      pageIntact[iPage]       = ( index[iPage].intact && pageOffset[iPage] + pageBytes <= fileSize );
+    return true;
+  }
+
+  void close()
+  {
+    mapped.close();
+    base                      = 0;
+    fileSize                  = 0;
+  }
+
+  bool          isOpen    () const  { return base != 0; }
+  size_t        numPages  () const  { return pageOffset.size(); }
+  uint64_t      frameBytes() const  { return uint64_t(width) * height * (bitsPerSample / 8); }
+
+  /// False if the pixel data of the given page extends beyond the end of the file, in which case it must not be accessed.
+  bool          isIntact  (const size_t iPage) const  { return pageIntact[iPage] != 0; }
+
+  /// Pixel data for the given page, stored in row-major order. The page must be intact.
+  const void*   pageData(const size_t iPage) const
+  {
+    return base + pageOffset[iPage];
+  }
+
+  /**
+    Locates the image description of the given page by parsing its directory directly in
+    the mapped file, which is in native byte order. The text is not necessarily null-
+    terminated. Returns false if there is no description or the directory is malformed.
+  */
+  bool description(const size_t iPage, const char*& text, size_t& length) const
+  {
+    const uint64_t            countBytes      = ( bigTiff ?  8 :  2 );
+    const uint64_t            entryBytes      = ( bigTiff ? 20 : 12 );
+    const uint64_t            valueBytes      = ( bigTiff ?  8 :  4 );
+    const uint64_t            ifd             = ifdOffset[iPage];
+    if (ifd + countBytes > fileSize)        return false;
+
+    const uint64_t            numEntries      = ( bigTiff ? read64(base + ifd) : read16(base + ifd) );
+    if (ifd + countBytes + numEntries * entryBytes > fileSize)
+      return false;
+
+    for (uint64_t iEntry = 0; iEntry < numEntries; ++iEntry) {
+      const unsigned char*    entry           = base + ifd + countBytes + iEntry * entryBytes;
+      if (read16(entry) != TIFFTAG_IMAGEDESCRIPTION)
+        continue;
+      if (read16(entry + 2) != TIFF_ASCII)  return false;
+
+      // The value is stored in the entry itself if it fits, and otherwise at the given offset
+      const uint64_t          count           = ( bigTiff ? read64(entry + 4) : read32(entry + 4) );
+      const unsigned char*    value           = entry + 4 + valueBytes;
+      const uint64_t          offset          = ( count <= valueBytes ? uint64_t(value - base) : bigTiff ? read64(value) : read32(value) );
+      if (offset + count > fileSize)        return false;
+
+      text                    = reinterpret_cast<const char*>(base + offset);
+      for (length = static_cast<size_t>(count); length > 0 && text[length - 1] == 0; --length);
+      return true;
+    }
+    return false;
+  }
+
+protected:
+  static uint16_t read16(const unsigned char* ptr) { uint16_t value; std::memcpy(&value, ptr, sizeof(value)); return value; }
+  static uint32_t read32(const unsigned char* ptr) { uint32_t value; std::memcpy(&value, ptr, sizeof(value)); return value; }
+  static uint64_t read64(const unsigned char* ptr) { uint64_t value; std::memcpy(&value, ptr, sizeof(value)); return value; }
+
+  bool fail()
+  {
+    close();
+    pageOffset.clear();
+    ifdOffset .clear();
+    pageIntact.clear();
+    return false;
+  }
+
+private:
+  MappedTiff(const MappedTiff&);
+  MappedTiff& operator=(const MappedTiff&);
+};
+
+
+#endif //MAPPEDTIFF_H
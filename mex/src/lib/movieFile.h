@@ -0,0 +1,616 @@
+/**
+  Chunked binary format for processed (e.g. motion corrected and downsampled) movies, so that
+  repeated analyses can load them without decoding and registering the original TIFF stacks.
+
+  A movie is a height x width x numFrames array of single precision values that is stored
+  in chunks of up to framesPerChunk frames times pixelsPerChunk pixels, where pixels are
+  indexed in the column-major order of Matlab. Within a chunk, values are stored either
+  frame-major (all pixels of a frame are contiguous) or pixel-major (the time trace of a
+  pixel is contiguous), as specified by the layout of the file. Chunks can be compressed
+  with a byte shuffle followed by run-length encoding, which is cheap to decode and works
+  well for the sign and exponent bytes of floating point data; chunks for which this does
+  not help are stored uncompressed, and read directly from the memory-mapped file.
+
+  File layout, in native (little-endian) byte order:
+    MovieHeader                       fixed size header
+    metadata                          sequence of named arrays (see appendMetadata())
+    chunks                            in order of frame block, then pixel block
+    MovieChunk[numChunks()]           offset, size and codec of each chunk
+*/
+
+
+#ifndef MOVIEFILE_H
+#define MOVIEFILE_H
+
+#include <string>
+#include <vector>
+#include <atomic>
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include <mex.h>
+#include "workerThreads.h"
+#include "mappedFile.h"
+
+
+static const char             MOVIE_MAGIC[8]      = { 'E', 'C', 'S', 'M', 'O', 'V', 'I', 'E' };
+static const uint32_t         MOVIE_VERSION       = 1;
+static const size_t           MOVIE_CHUNK_VALUES  = 1 << 20;      ///< target size of pixel-major chunks
+
+
+enum MovieLayout  { MOVIE_FRAME_MAJOR, MOVIE_PIXEL_MAJOR };
+enum MovieCodec   { MOVIE_RAW, MOVIE_SHUFFLE_RLE };
+
+
+
+//_________________________________________________________________________
+struct MovieHeader
+{
+  char                        magic[8];
+  uint32_t                    version;
+  uint32_t                    layout;           ///< MovieLayout
+  uint32_t                    codec;            ///< MovieCodec requested when writing, individual chunks may be MOVIE_RAW
+  uint32_t                    bytesPerValue;
+  uint64_t                    height;
+  uint64_t                    width;
+  uint64_t                    numFrames;
+  uint64_t                    framesPerChunk;
+  uint64_t                    pixelsPerChunk;
+  uint64_t                    metadataOffset;
+  uint64_t                    metadataBytes;
+  uint64_t                    chunkTableOffset;
+  uint64_t                    reserved[5];
+
+  uint64_t framePixels   () const { return height * width; }
+  uint64_t numFrameBlocks() const { return (numFrames     + framesPerChunk - 1) / framesPerChunk; }
+  uint64_t numPixelBlocks() const { return (framePixels() + pixelsPerChunk - 1) / pixelsPerChunk; }
+  uint64_t numChunks     () const { return numFrameBlocks() * numPixelBlocks(); }
+
+  /// Number of frames and pixels in the given chunk.
+  uint64_t chunkFrames(const uint64_t iChunk) const
+  {
+    const uint64_t            first           = (iChunk / numPixelBlocks()) * framesPerChunk;
+    return std::min(framesPerChunk, numFrames - first);
+  }
+  uint64_t chunkPixels(const uint64_t iChunk) const
+  {
+    const uint64_t            first           = (iChunk % numPixelBlocks()) * pixelsPerChunk;
+    return std::min(pixelsPerChunk, framePixels() - first);
+  }
+};
+
+struct MovieChunk
+{
+  uint64_t                    offset;
+  uint64_t                    bytes;
+  uint32_t                    codec;            ///< MovieCodec
+  uint32_t                    reserved;
+};
+
+static_assert(sizeof(MovieHeader) == 128, "MovieHeader must have a fixed size.");
+static_assert(sizeof(MovieChunk ) ==  24, "MovieChunk must have a fixed size.");
+
+
+
+//_________________________________________________________________________
+/**
+  Compresses numValues values of valueBytes each into out, by first gathering byte i of
+  all values into the i-th plane, then run-length encoding the planes in the PackBits
+  scheme: a header h < 128 is followed by h+1 literal bytes, and h > 128 by a single byte
+  to be repeated 257-h times.
+*/
+inline void shuffleEncode( const unsigned char* src, const size_t numValues, const size_t valueBytes
+                         , std::vector<unsigned char>& scratch, std::vector<unsigned char>& out
+                         )
+{
+  const size_t                numBytes        = numValues * valueBytes;
+  scratch.resize(numBytes);
+  for (size_t iValue = 0; iValue < numValues; ++iValue)
+    for (size_t iByte = 0; iByte < valueBytes; ++iByte)
+      scratch[iByte * numValues + iValue] = src[iValue * valueBytes + iByte];
+
+  out.clear();
+  out.reserve(numBytes + numBytes / 128 + 1);
+  for (size_t pos = 0; pos < numBytes; ) {
+    size_t                    run             = 1;
+    while (pos + run < numBytes && run < 128 && scratch[pos + run] == scratch[pos])
+      ++run;
+    if (run >= 3) {
+      out.push_back(static_cast<unsigned char>(257 - run));
+      out.push_back(scratch[pos]);
+      pos                    += run;
+      continue;
+    }
+
+    // Literals up to the start of the next run of at least 3 bytes
+    size_t                    end             = pos + 1;
+    while (end < numBytes && end - pos < 128) {
+      if (end + 2 < numBytes && scratch[end] == scratch[end + 1] && scratch[end] == scratch[end + 2])
+        break;
+      ++end;
+    }
+    out.push_back(static_cast<unsigned char>(end - pos - 1));
+    out.insert(out.end(), scratch.begin() + pos, scratch.begin() + end);
+    pos                       = end;
+  }
+}
+
+/// Inverse of shuffleEncode(), returning false if src does not decode to exactly numValues values.
+inline bool shuffleDecode( const unsigned char* src, const size_t srcBytes, unsigned char* dst
+                         , const size_t numValues, const size_t valueBytes, std::vector<unsigned char>& scratch
+                         )
+{
+  const size_t                numBytes        = numValues * valueBytes;
+  const unsigned char*        srcEnd          = src + srcBytes;
+  scratch.resize(numBytes);
+
+  size_t                      pos             = 0;
+  while (src < srcEnd) {
+    const unsigned int        header          = *src++;
+    if (header < 128) {
+      const size_t            count           = header + 1;
+      if (static_cast<size_t>(srcEnd - src) < count || numBytes - pos < count)
+        return false;
+      std::memcpy(&scratch[pos], src, count);
+      src                    += count;
+      pos                    += count;
+    }
+    else if (header > 128) {
+      const size_t            count           = 257 - header;
+      if (src >= srcEnd || numBytes - pos < count)
+        return false;
+      std::memset(&scratch[pos], *src++, count);
+      pos                    += count;
+    }
+  }
+  if (pos != numBytes)        return false;
+
+  for (size_t iValue = 0; iValue < numValues; ++iValue)
+    for (size_t iByte = 0; iByte < valueBytes; ++iByte)
+      dst[iValue * valueBytes + iByte]  = scratch[iByte * numValues + iValue];
+  return true;
+}
+
+
+
+//_________________________________________________________________________
+/**
+  Serializes a Matlab array for storage as movie metadata, as an entry consisting of the
+  name length (uint32), name, class ID (uint32), number of dimensions (uint32), dimensions
+  (uint64 each) and the raw data. Scalar structures are stored as one entry per field
+  with dot-separated names, and missing fields as empty matrices. Returns false if value
+  (or one of its fields) is not a real, full numeric, logical or character array.
+*/
+inline bool appendMetadata(std::vector<unsigned char>& blob, const std::string& name, const mxArray* value)
+{
+  if (value && mxIsStruct(value)) {
+    if (mxGetNumberOfElements(value) != 1)
+      return false;
+    for (int iField = 0; iField < mxGetNumberOfFields(value); ++iField)
+      if (!appendMetadata(blob, name + "." + mxGetFieldNameByNumber(value, iField), mxGetFieldByNumber(value, 0, iField)))
+        return false;
+    return true;
+  }
+  if (value && (!(mxIsNumeric(value) || mxIsLogical(value) || mxIsChar(value)) || mxIsComplex(value) || mxIsSparse(value)))
+    return false;
+
+  const mwSize                emptySize[]     = { 0, 0 };
+  const uint32_t              nameLength      = static_cast<uint32_t>(name.size());
+  const uint32_t              classID         = static_cast<uint32_t>( value ? mxGetClassID(value) : mxDOUBLE_CLASS );
+  const uint32_t              numDims         = static_cast<uint32_t>( value ? mxGetNumberOfDimensions(value) : 2 );
+  const mwSize*               dims            = ( value ? mxGetDimensions(value) : emptySize );
+  const size_t                dataBytes       = ( value ? mxGetNumberOfElements(value) * mxGetElementSize(value) : 0 );
+
+  const unsigned char*        fields[]        = { (const unsigned char*) &nameLength, (const unsigned char*) name.data()
+                                                , (const unsigned char*) &classID   , (const unsigned char*) &numDims
+                                                };
+  const size_t                fieldBytes[]    = { sizeof(nameLength), name.size(), sizeof(classID), sizeof(numDims) };
+  for (size_t iField = 0; iField < 4; ++iField)
+    blob.insert(blob.end(), fields[iField], fields[iField] + fieldBytes[iField]);
+  for (uint32_t iDim = 0; iDim < numDims; ++iDim) {
+    const uint64_t            dim             = dims[iDim];
+    blob.insert(blob.end(), (const unsigned char*) &dim, (const unsigned char*) &dim + sizeof(dim));
+  }
+  if (dataBytes > 0) {
+    const unsigned char*      data            = (const unsigned char*) mxGetData(value);
+    blob.insert(blob.end(), data, data + dataBytes);
+  }
+  return true;
+}
+
+/// Reconstructs a structure from metadata written by appendMetadata(), or returns null if it is malformed.
+inline mxArray* parseMetadata(const unsigned char* data, const size_t numBytes)
+{
+  mxArray*                    root            = mxCreateStructMatrix(1, 1, 0, 0);
+  const unsigned char*        end             = data + numBytes;
+  for (const unsigned char* ptr = data; ptr < end; ) {
+    uint32_t                  nameLength, classID, numDims;
+    if (end - ptr < 4)                                    { mxDestroyArray(root); return 0; }
+    std::memcpy(&nameLength, ptr, 4);                     ptr  += 4;
+    if (static_cast<size_t>(end - ptr) < nameLength + 8)  { mxDestroyArray(root); return 0; }
+    const std::string         name            ((const char*) ptr, nameLength);
+    ptr                      += nameLength;
+    std::memcpy(&classID, ptr, 4);                        ptr  += 4;
+    std::memcpy(&numDims, ptr, 4);                        ptr  += 4;
+    if (numDims < 2 || static_cast<size_t>(end - ptr) / 8 < numDims)
+                                                          { mxDestroyArray(root); return 0; }
+
+    std::vector<mwSize>       dims            (numDims);
+    for (uint32_t iDim = 0; iDim < numDims; ++iDim, ptr += 8) {
+      uint64_t                dim;
+      std::memcpy(&dim, ptr, 8);
+      dims[iDim]              = static_cast<mwSize>(dim);
+    }
+
+    mxArray*                  value;
+    if      (classID == mxLOGICAL_CLASS)  value   = mxCreateLogicalArray(numDims, dims.data());
+    else if (classID == mxCHAR_CLASS)     value   = mxCreateCharArray(numDims, dims.data());
+    else if (classID >= mxDOUBLE_CLASS && classID <= mxUINT64_CLASS)
+                                          value   = mxCreateNumericArray(numDims, dims.data(), static_cast<mxClassID>(classID), mxREAL);
+    else                                                  { mxDestroyArray(root); return 0; }
+
+    const size_t              dataBytes       = mxGetNumberOfElements(value) * mxGetElementSize(value);
+    if (static_cast<size_t>(end - ptr) < dataBytes)       { mxDestroyArray(value); mxDestroyArray(root); return 0; }
+    if (dataBytes > 0)
+      std::memcpy(mxGetData(value), ptr, dataBytes);
+    ptr                      += dataBytes;
+
+    // Descend into (and if necessary create) nested structures for dot-separated names
+    mxArray*                  parent          = root;
+    size_t                    start           = ( name.empty() || name[0] != '.' ? 0 : 1 );
+    for (size_t dot; (dot = name.find('.', start)) != std::string::npos; start = dot + 1) {
+      const std::string       field           = name.substr(start, dot - start);
+      mxArray*                child           = mxGetField(parent, 0, field.c_str());
+      if (!child || !mxIsStruct(child)) {
+        if (mxGetFieldNumber(parent, field.c_str()) < 0)
+          mxAddField(parent, field.c_str());
+        child                 = mxCreateStructMatrix(1, 1, 0, 0);
+        mxSetField(parent, 0, field.c_str(), child);
+      }
+      parent                  = child;
+    }
+    const std::string         field           = name.substr(start);
+    if (mxGetFieldNumber(parent, field.c_str()) < 0)
+      mxAddField(parent, field.c_str());
+    mxSetField(parent, 0, field.c_str(), value);
+  }
+  return root;
+}
+
+
+
+//_________________________________________________________________________
+/**
+  Writes a movie incrementally, frame by frame. Frames are buffered until a complete
+  block of framesPerChunk frames is available, so that chunks always span the full
+  number of frames except for the last block.
+*/
+class MovieWriter
+{
+public:
+  MovieHeader                 header;
+
+protected:
+  FILE*                       file;
+  uint64_t                    offset;           ///< current end of file
+  std::vector<MovieChunk>     chunks;
+  std::vector<float>          pending;          ///< frames of the current block
+  size_t                      numPending;
+  size_t                      numWritten;
+  std::vector<float>          block;            ///< values of a pixel-major chunk
+  std::vector<unsigned char>  scratch;
+  std::vector<unsigned char>  encoded;
+
+public:
+  MovieWriter() : file(0), offset(0), numPending(0), numWritten(0)
+  {
+    std::memset(&header, 0, sizeof(header));
+  }
+
+  ~MovieWriter()
+  {
+    std::string               ignored;
+    close(ignored);
+  }
+
+  bool open( const char* path, const int width, const int height, const size_t numFrames
+           , const MovieLayout layout, const MovieCodec codec, const size_t framesPerChunk
+           , const std::vector<unsigned char>& metadata, std::string& error
+           )
+  {
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, MOVIE_MAGIC, sizeof(MOVIE_MAGIC));
+    header.version            = MOVIE_VERSION;
+    header.layout             = layout;
+    header.codec              = codec;
+    header.bytesPerValue      = sizeof(float);
+    header.height             = height;
+    header.width              = width;
+    header.numFrames          = numFrames;
+    header.framesPerChunk     = std::max<size_t>(1, framesPerChunk);
+    header.pixelsPerChunk     = std::max<uint64_t>(1, header.framePixels());
+    if (layout == MOVIE_PIXEL_MAJOR)
+      header.pixelsPerChunk   = std::max<uint64_t>(1, std::min<uint64_t>(header.pixelsPerChunk, MOVIE_CHUNK_VALUES / header.framesPerChunk));
+    header.metadataOffset     = sizeof(header);
+    header.metadataBytes      = metadata.size();
+
+    file                      = std::fopen(path, "wb");
+    if (!file)                return fail(error, "Failed to create output file.");
+    if (!put(&header, sizeof(header)) || !put(metadata.data(), metadata.size()))
+      return fail(error, "Failed to write movie header.");
+
+    chunks.clear();
+    pending.resize(header.framesPerChunk * header.framePixels());
+    numPending                = 0;
+    numWritten                = 0;
+    return true;
+  }
+
+  /// Appends numFrames consecutive frames stored in imgData, returning false upon failure.
+  bool write(const float* imgData, const size_t numFrames, std::string& error)
+  {
+    const size_t              framePixels     = static_cast<size_t>(header.framePixels());
+    for (size_t iFrame = 0; iFrame < numFrames; ) {
+      const size_t            numCopy         = std::min<size_t>(numFrames - iFrame, header.framesPerChunk - numPending);
+      std::copy(imgData + iFrame * framePixels, imgData + (iFrame + numCopy) * framePixels, pending.begin() + numPending * framePixels);
+      iFrame                 += numCopy;
+      numPending             += numCopy;
+      if (numPending == header.framesPerChunk && !flush(error))
+        return false;
+    }
+    return true;
+  }
+
+  /**
+    Writes any remaining frames and the chunk table, and finalizes the header. The number
+    of frames recorded in the file is the number actually written, which can be less than
+    was specified when opening the file. The file is closed even upon failure, in which
+    case error is set to the first problem encountered.
+  */
+  bool close(std::string& error)
+  {
+    if (!file)                return true;
+    const bool                isFlushed       = ( numPending < 1 || flush(error) );
+    numPending                = 0;
+
+    header.numFrames          = numWritten;
+    header.chunkTableOffset   = offset;
+    const bool                isOK            = isFlushed
+                                             && put(chunks.data(), chunks.size() * sizeof(MovieChunk))
+                                             && std::fseek(file, 0, SEEK_SET) == 0
+                                             && std::fwrite(&header, sizeof(header), 1, file) == 1
+                                              ;
+    const bool                isClosed        = ( std::fclose(file) == 0 );
+    file                      = 0;
+    pending.clear();
+    if (isFlushed && (!isOK || !isClosed))
+      error                   = "Failed to finalize movie file.";
+    return isOK && isClosed;
+  }
+
+protected:
+  /// Writes the pending frames as one chunk per pixel block.
+  bool flush(std::string& error)
+  {
+    const size_t              framePixels     = static_cast<size_t>(header.framePixels());
+    const size_t              numPixelBlocks  = static_cast<size_t>(header.numPixelBlocks());
+    for (size_t iBlock = 0; iBlock < numPixelBlocks; ++iBlock) {
+      const size_t            firstPixel      = iBlock * static_cast<size_t>(header.pixelsPerChunk);
+      const size_t            numPixels       = std::min<size_t>(header.pixelsPerChunk, framePixels - firstPixel);
+      const size_t            numValues       = numPixels * numPending;
+
+      // Frame-major chunks span all pixels, and so are identical to the pending buffer
+      const float*            values          = pending.data();
+      if (header.layout == MOVIE_PIXEL_MAJOR) {
+        block.resize(numValues);
+        for (size_t iFrame = 0; iFrame < numPending; ++iFrame) {
+          const float*        source          = pending.data() + iFrame * framePixels + firstPixel;
+          for (size_t iPixel = 0; iPixel < numPixels; ++iPixel)
+            block[iPixel * numPending + iFrame] = source[iPixel];
+        }
+        values                = block.data();
+      }
+
+      MovieChunk              chunk;
+      chunk.offset            = offset;
+      chunk.bytes             = numValues * sizeof(float);
+      chunk.codec             = MOVIE_RAW;
+      chunk.reserved          = 0;
+      const void*             data            = values;
+      if (header.codec == MOVIE_SHUFFLE_RLE) {
+        shuffleEncode((const unsigned char*) values, numValues, sizeof(float), scratch, encoded);
+        if (encoded.size() < chunk.bytes) {
+          chunk.bytes         = encoded.size();
+          chunk.codec         = MOVIE_SHUFFLE_RLE;
+          data                = encoded.data();
+        }
+      }
+      if (!put(data, static_cast<size_t>(chunk.bytes)))
+        return fail(error, "Failed to write frames to movie file.");
+      chunks.push_back(chunk);
+    }
+
+    numWritten               += numPending;
+    numPending                = 0;
+    return true;
+  }
+
+  bool put(const void* data, const size_t numBytes)
+  {
+    if (numBytes > 0 && std::fwrite(data, 1, numBytes, file) != numBytes)
+      return false;
+    offset                   += numBytes;
+    return true;
+  }
+
+  bool fail(std::string& error, const char* what)
+  {
+    error                     = what;
+    return false;
+  }
+
+private:
+  MovieWriter(const MovieWriter&);
+  MovieWriter& operator=(const MovieWriter&);
+};
+
+
+
+//_________________________________________________________________________
+/**
+  Memory-mapped movie file, from which arbitrary ranges of frames can be read. Chunks are
+  decoded (if necessary) and copied into the output by several threads in parallel.
+*/
+class MovieFile
+{
+public:
+  MovieHeader                 header;
+
+protected:
+  MappedFile                  mapped;
+  std::vector<MovieChunk>     chunks;
+
+public:
+  MovieFile() { std::memset(&header, 0, sizeof(header)); }
+
+  /// Returns false and sets error if the file cannot be mapped or is not a valid movie.
+  bool open(const char* path, std::string& error)
+  {
+    chunks.clear();
+    if (!mapped.open(path))   return fail(error, "Failed to open movie file.");
+    if (!validate(error)) {
+      mapped.close();
+      chunks.clear();
+      return false;
+    }
+    return true;
+  }
+
+  const unsigned char* metadata() const { return mapped.data() + header.metadataOffset; }
+
+  /**
+    Reads frames [firstFrame, firstFrame + numFrames) into imgData, which is laid out as
+    height x width x numFrames for frame-major files, and numFrames x (height * width)
+    for pixel-major files.
+  */
+  bool read(float* imgData, const size_t firstFrame, const size_t numFrames, const int numThreads, std::string& error) const
+  {
+    if (numFrames < 1)        return true;
+    if (firstFrame + numFrames > header.numFrames)
+      return fail(error, "Requested frames exceed the number of frames in the movie.");
+
+    const size_t              framesPerChunk  = static_cast<size_t>(header.framesPerChunk);
+    const size_t              numPixelBlocks  = static_cast<size_t>(header.numPixelBlocks());
+    const size_t              firstChunk      = ( firstFrame                  / framesPerChunk) * numPixelBlocks;
+    const size_t              endChunk        = ((firstFrame + numFrames - 1) / framesPerChunk + 1) * numPixelBlocks;
+
+    std::atomic<size_t>       nextChunk       (firstChunk);
+    std::atomic<bool>         isCorrupt       (false);
+    const int                 numWorkers      = static_cast<int>( std::min<size_t>(std::max(numThreads, 1), endChunk - firstChunk) );
+    runThreads(numWorkers, [&](int) {
+      std::vector<float>          decoded;
+      std::vector<unsigned char>  scratch;
+      for (size_t iChunk; !isCorrupt && (iChunk = nextChunk++) < endChunk; ) {
+        if (!copyChunk(iChunk, imgData, firstFrame, numFrames, decoded, scratch))
+          isCorrupt           = true;
+      }
+    });
+
+    if (isCorrupt)            return fail(error, "Failed to decode movie chunk (the file may be corrupted).");
+    return true;
+  }
+
+protected:
+  /// Checks the header and chunk table against the size of the mapped file.
+  bool validate(std::string& error)
+  {
+    const uint64_t            fileSize        = mapped.size();
+    if (fileSize < sizeof(header))            return fail(error, "File is too small to be a movie.");
+    std::memcpy(&header, mapped.data(), sizeof(header));
+    if (std::memcmp(header.magic, MOVIE_MAGIC, sizeof(MOVIE_MAGIC)) != 0)
+      return fail(error, "File is not a movie.");
+    if (header.version != MOVIE_VERSION)      return fail(error, "Unsupported movie format version.");
+    if ( header.bytesPerValue != sizeof(float) || header.framesPerChunk < 1 || header.pixelsPerChunk < 1
+      || header.layout > MOVIE_PIXEL_MAJOR
+       )
+      return fail(error, "Invalid movie header.");
+    if (header.metadataOffset > fileSize || header.metadataBytes > fileSize - header.metadataOffset)
+      return fail(error, "Movie metadata exceeds file size.");
+
+    // Validate the chunk table, which has to be copied since it need not be aligned
+    const uint64_t            numChunks       = header.numChunks();
+    if (header.chunkTableOffset > fileSize || numChunks > (fileSize - header.chunkTableOffset) / sizeof(MovieChunk))
+      return fail(error, "Movie chunk table exceeds file size (the file may be truncated).");
+    chunks.resize(static_cast<size_t>(numChunks));
+    if (!chunks.empty())
+      std::memcpy(chunks.data(), mapped.data() + header.chunkTableOffset, chunks.size() * sizeof(MovieChunk));
+
+    for (size_t iChunk = 0; iChunk < chunks.size(); ++iChunk) {
+      const MovieChunk&       chunk           = chunks[iChunk];
+      const uint64_t          rawBytes        = header.chunkFrames(iChunk) * header.chunkPixels(iChunk) * sizeof(float);
+      if (chunk.offset > fileSize || chunk.bytes > fileSize - chunk.offset)
+        return fail(error, "Movie chunk exceeds file size.");
+      if (chunk.codec > MOVIE_SHUFFLE_RLE || (chunk.codec == MOVIE_RAW && chunk.bytes != rawBytes))
+        return fail(error, "Invalid movie chunk.");
+    }
+    return true;
+  }
+
+  bool copyChunk( const size_t iChunk, float* imgData, const size_t firstFrame, const size_t numFrames
+                , std::vector<float>& decoded, std::vector<unsigned char>& scratch
+                ) const
+  {
+    const MovieChunk&         chunk           = chunks[iChunk];
+    const size_t              framePixels     = static_cast<size_t>(header.framePixels());
+    const size_t              numPixelBlocks  = static_cast<size_t>(header.numPixelBlocks());
+    const size_t              chunkFrames     = static_cast<size_t>(header.chunkFrames(iChunk));
+    const size_t              chunkPixels     = static_cast<size_t>(header.chunkPixels(iChunk));
+    const size_t              chunkFirstFrame = (iChunk / numPixelBlocks) * static_cast<size_t>(header.framesPerChunk);
+    const size_t              chunkFirstPixel = (iChunk % numPixelBlocks) * static_cast<size_t>(header.pixelsPerChunk);
+
+    // Uncompressed chunks are copied directly from the mapped file
+    const unsigned char*      values          = mapped.data() + chunk.offset;
+    if (chunk.codec == MOVIE_SHUFFLE_RLE) {
+      decoded.resize(chunkFrames * chunkPixels);
+      if (!shuffleDecode(values, static_cast<size_t>(chunk.bytes), (unsigned char*) decoded.data(), decoded.size(), sizeof(float), scratch))
+        return false;
+      values                  = (const unsigned char*) decoded.data();
+    }
+
+    // Overlap of the chunk with the requested frames
+    const size_t              beginFrame      = std::max(firstFrame, chunkFirstFrame);
+    const size_t              endFrame        = std::min(firstFrame + numFrames, chunkFirstFrame + chunkFrames);
+    const size_t              numCopy         = endFrame - beginFrame;
+
+    // Memory is copied in contiguous runs, so that the mapped data need not be aligned
+    if (header.layout == MOVIE_FRAME_MAJOR) {
+      for (size_t iFrame = beginFrame; iFrame < endFrame; ++iFrame)
+        std::memcpy ( imgData + (iFrame - firstFrame) * framePixels + chunkFirstPixel
+                    , values + (iFrame - chunkFirstFrame) * chunkPixels * sizeof(float)
+                    , chunkPixels * sizeof(float)
+                    );
+    }
+    else {
+      for (size_t iPixel = 0; iPixel < chunkPixels; ++iPixel)
+        std::memcpy ( imgData + (chunkFirstPixel + iPixel) * numFrames + (beginFrame - firstFrame)
+                    , values + (iPixel * chunkFrames + beginFrame - chunkFirstFrame) * sizeof(float)
+                    , numCopy * sizeof(float)
+                    );
+    }
+    return true;
+  }
+
+  bool fail(std::string& error, const char* what) const
+  {
+    error                     = what;
+    return false;
+  }
+
+private:
+  MovieFile(const MovieFile&);
+  MovieFile& operator=(const MovieFile&);
+};
+
+
+#endif //MOVIEFILE_H
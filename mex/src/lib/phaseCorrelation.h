@@ -0,0 +1,204 @@
+/**
+  Registration of frames to a reference image by phase correlation, i.e. the inverse
+  Fourier transform of the normalized cross-power spectrum of the two images. This costs
+  O(N log N) per frame for N pixels, independent of the range of shifts searched, unlike
+  cv::matchTemplate() which costs O(N * maxShift^2).
+
+  The Fourier transform of the reference is computed once per reference image. Both
+  images are mean subtracted and apodized with a Hanning window to suppress the edge
+  discontinuities of the periodic extension, then zero padded to a size that is efficient
+  for the DFT. The correlation surface is sampled at the same shifts as the output of
+  cv::matchTemplate(), so that it can be used in its place.
+
+  Sub-pixel resolution is obtained by evaluating the inverse DFT of the cross-power
+  spectrum on an upsampled grid around the integer peak, via matrix multiplication
+  (Guizar-Sicairos, Thurman & Fienup, Opt. Lett. 33, 156 (2008)).
+*/
+
+
+#ifndef PHASECORRELATION_H
+#define PHASECORRELATION_H
+
+#include <cmath>
+#include <vector>
+#include <complex>
+#include <opencv2/core.hpp>
+#include <opencv2/imgproc.hpp>
+
+
+
+//_________________________________________________________________________
+/**
+  Cached spectrum of a reference image. Any number of threads can call correlate() and
+  refinePeak() concurrently, each with its own Scratch workspace.
+*/
+class PhaseCorrelation
+{
+public:
+  typedef std::complex<float> Complex;
+
+  static const int            UPSAMPLING      = 16;     ///< sub-pixel resolution of refinePeak() is 1/UPSAMPLING
+  static const int            HALF_WINDOW     = 12;     ///< refinePeak() searches +/- HALF_WINDOW/UPSAMPLING pixels
+
+  /// Per-thread temporary storage.
+  struct Scratch
+  {
+    cv::Mat                   padded;                   ///< apodized and zero padded frame
+    cv::Mat                   spectrum;                 ///< normalized cross-power spectrum
+    cv::Mat                   surface;                  ///< correlation as a function of (circular) shift
+    std::vector<Complex>      rowKernel;
+    std::vector<Complex>      colKernel;
+    std::vector<Complex>      partial;                  ///< row-upsampled spectrum
+  };
+
+protected:
+  int                         rows;
+  int                         cols;
+  cv::Mat                     window;                   ///< rows x cols Hanning window
+  cv::Mat                     reference;                ///< complex DFT of the padded reference
+
+public:
+  PhaseCorrelation() : rows(0), cols(0) { }
+
+  bool empty() const { return reference.empty(); }
+
+  /// Computes the DFT of the reference image, which must have the same size as frames to be registered.
+  void setReference(const cv::Mat& image)
+  {
+    if (image.rows != rows || image.cols != cols) {
+      rows                    = image.rows;
+      cols                    = image.cols;
+      cv::createHanningWindow(window, cv::Size(cols, rows), CV_32F);
+    }
+
+    // Undefined pixels (e.g. of bins without any non-empty frames) are set to the mean
+    cv::Mat                   copy            = image.clone();
+    const cv::Mat             isDefined       = ( copy == copy );
+    cv::patchNaNs(copy, cv::mean(copy, isDefined)[0]);
+
+    cv::Mat                   padded;
+    apodize(copy, padded);
+    cv::dft(padded, reference, cv::DFT_COMPLEX_OUTPUT);
+  }
+
+  /**
+    Computes the correlation of frame (of type CV_32F) with the reference for all shifts
+    within +/- maxRowShift and +/- maxColShift, stored in metric such that metric(y,x)
+    corresponds to the shift (y - maxRowShift, x - maxColShift). This is the same
+    convention as for cv::matchTemplate() of a template cropped by the maximum shift.
+  */
+  void correlate(const cv::Mat& frame, Scratch& scratch, cv::Mat& metric, const int maxRowShift, const int maxColShift) const
+  {
+    apodize(frame, scratch.padded);
+    cv::dft(scratch.padded, scratch.spectrum, cv::DFT_COMPLEX_OUTPUT);
+    cv::mulSpectrums(scratch.spectrum, reference, scratch.spectrum, 0, true);
+
+    // Normalize to unit magnitude, so that only the phase difference remains
+    for (int row = 0; row < scratch.spectrum.rows; ++row) {
+      Complex*                value           = scratch.spectrum.ptr<Complex>(row);
+      for (int col = 0; col < scratch.spectrum.cols; ++col) {
+        const float           magnitude       = std::abs(value[col]);
+        value[col]            = ( magnitude > 1e-20f ? value[col] / magnitude : Complex(0) );
+      }
+    }
+    cv::idft(scratch.spectrum, scratch.surface, cv::DFT_REAL_OUTPUT | cv::DFT_SCALE);
+
+    // Unwrap the circular shifts of interest
+    const int                 padRows         = scratch.surface.rows;
+    const int                 padCols         = scratch.surface.cols;
+    metric.create(2*maxRowShift + 1, 2*maxColShift + 1, CV_32F);
+    for (int y = 0; y < metric.rows; ++y) {
+      const float*            source          = scratch.surface.ptr<float>( (y - maxRowShift + padRows) % padRows );
+      float*                  target          = metric.ptr<float>(y);
+      for (int x = 0; x < metric.cols; ++x)
+        target[x]             = source[ (x - maxColShift + padCols) % padCols ];
+    }
+  }
+
+  /**
+    Locates the maximum of the correlation around the integer shift (rowShift, colShift),
+    which should be the optimum found by the last call to correlate() with this scratch
+    space. The sub-pixel offsets from that shift are returned in (yPeak, xPeak).
+  */
+  void refinePeak(Scratch& scratch, const int rowShift, const int colShift, double& yPeak, double& xPeak) const
+  {
+    const int                 padRows         = scratch.spectrum.rows;
+    const int                 padCols         = scratch.spectrum.cols;
+    const int                 numSteps        = 2*HALF_WINDOW + 1;
+
+    // Fourier kernels for evaluation at the upsampled shifts, with signed frequencies
+    // so that the interpolation is band limited
+    upsamplingKernel(scratch.rowKernel, padRows, rowShift);
+    upsamplingKernel(scratch.colKernel, padCols, colShift);
+
+    // partial(j, col) = sum_row rowKernel(j, row) * spectrum(row, col)
+    scratch.partial.assign(static_cast<size_t>(numSteps) * padCols, Complex(0));
+    for (int row = 0; row < padRows; ++row) {
+      const Complex*          value           = scratch.spectrum.ptr<Complex>(row);
+      for (int j = 0; j < numSteps; ++j) {
+        const Complex         kernel          = scratch.rowKernel[static_cast<size_t>(j) * padRows + row];
+        Complex*              target          = &scratch.partial[static_cast<size_t>(j) * padCols];
+        for (int col = 0; col < padCols; ++col)
+          target[col]        += kernel * value[col];
+      }
+    }
+
+    // correlation(j, i) = sum_col partial(j, col) * colKernel(i, col), of which only the real part is of interest
+    double                    bestValue       = -1e308;
+    int                       bestJ           = HALF_WINDOW;
+    int                       bestI           = HALF_WINDOW;
+    for (int j = 0; j < numSteps; ++j) {
+      const Complex*          source          = &scratch.partial[static_cast<size_t>(j) * padCols];
+      for (int i = 0; i < numSteps; ++i) {
+        const Complex*        kernel          = &scratch.colKernel[static_cast<size_t>(i) * padCols];
+        double                value           = 0;
+        for (int col = 0; col < padCols; ++col)
+          value              += source[col].real() * kernel[col].real() - source[col].imag() * kernel[col].imag();
+        if (value > bestValue) {
+          bestValue           = value;
+          bestJ               = j;
+          bestI               = i;
+        }
+      }
+    }
+
+    yPeak                     = 1. * (bestJ - HALF_WINDOW) / UPSAMPLING;
+    xPeak                     = 1. * (bestI - HALF_WINDOW) / UPSAMPLING;
+  }
+
+protected:
+  /// Mean subtracts, apodizes and zero pads image into padded.
+  void apodize(const cv::Mat& image, cv::Mat& padded) const
+  {
+    padded.create(cv::getOptimalDFTSize(rows), cv::getOptimalDFTSize(cols), CV_32F);
+    padded                    = cv::Scalar(0);
+
+    cv::Mat                   region          = padded(cv::Rect(0, 0, cols, rows));
+    cv::subtract(image, cv::mean(image), region);
+    cv::multiply(region, window, region);
+  }
+
+  /// kernel(j, k) = exp(2 pi i * f(k) * (shift + (j - HALF_WINDOW) / UPSAMPLING) / size), for signed frequencies f(k).
+  static void upsamplingKernel(std::vector<Complex>& kernel, const int size, const int shift)
+  {
+    const int                 numSteps        = 2*HALF_WINDOW + 1;
+    const double              twoPi           = 2 * 3.14159265358979323846;
+    kernel.resize(static_cast<size_t>(numSteps) * size);
+    for (int j = 0; j < numSteps; ++j) {
+      const double            offset          = shift + 1. * (j - HALF_WINDOW) / UPSAMPLING;
+      Complex*                target          = &kernel[static_cast<size_t>(j) * size];
+      for (int k = 0; k < size; ++k) {
+        const int             frequency       = ( k < (size + 1)/2 ? k : k - size );
+        const double          phase           = twoPi * frequency * offset / size;
+        target[k]             = Complex(static_cast<float>(std::cos(phase)), static_cast<float>(std::sin(phase)));
+      }
+    }
+  }
+
+private:
+  PhaseCorrelation(const PhaseCorrelation&);
+  PhaseCorrelation& operator=(const PhaseCorrelation&);
+};
+
+
+#endif //PHASECORRELATION_H
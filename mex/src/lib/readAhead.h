@@ -0,0 +1,249 @@
+/**
+  Asynchronous read-ahead of file regions that are about to be accessed.
+
+  On network file systems the latency of synchronous reads dominates the time taken to
+  scan through a stack. ReadAhead asks the operating system to start loading regions of
+  the file into the page cache before they are needed, via posix_fadvise() on Linux, or
+  elsewhere by reading them in a background thread. Subsequent reads by libtiff, OpenCV
+  or via memory mapping are then served from the cache while the current frame is being
+  processed. Prefetching is only a hint, so requests are dropped if the background
+  thread falls behind, and all failures are silently ignored.
+*/
+
+
+#ifndef READAHEAD_H
+#define READAHEAD_H
+
+#include <vector>
+#include <atomic>
+#include <cstdio>
+#include <cstdint>
+#include <algorithm>
+#include "workerThreads.h"
+#include "tiffIndex.h"
+
+#if defined(__linux__)
+#  include <fcntl.h>
+#  include <unistd.h>
+#  define READAHEAD_FADVISE
+#endif
+
+
+
+//_________________________________________________________________________
+/**
+  Issues read-ahead requests for arbitrary byte ranges of a single file. The counters
+  record the number of bytes for which read-ahead has been requested, and the number
+  reported as consumed by the caller, for diagnosing the effectiveness of prefetching.
+*/
+class ReadAhead
+{
+public:
+  std::atomic<uint64_t>       bytesPrefetched;
+  std::atomic<uint64_t>       bytesConsumed;
+
+protected:
+  struct Region
+  {
+    uint64_t                  offset;
+    uint64_t                  bytes;
+  };
+
+#ifdef READAHEAD_FADVISE
+  int                         file;
+#else
+  static const size_t         BLOCK_BYTES     = 1 << 20;
+
+  FILE*                       file;
+  BoundedQueue<Region>*       pending;
+  WorkerThreads               loader;
+#endif
+
+public:
+  ReadAhead()
+    : bytesPrefetched (0)
+    , bytesConsumed   (0)
+#ifdef READAHEAD_FADVISE
+    , file            (-1)
+#else
+    , file            (0)
+    , pending         (0)
+#endif
+  { }
+
+  ~ReadAhead() { close(); }
+
+  /// maxPending is the number of requests that can be queued for the background thread, if used.
+  bool open(const char* path, const size_t maxPending = 64)
+  {
+    close();
+#ifdef READAHEAD_FADVISE
+    file                      = ::open(path, O_RDONLY);
+    return file >= 0;
+#else
+    file                      = std::fopen(path, "rb");
+    if (!file)                return false;
+    pending                   = new BoundedQueue<Region>(maxPending);
+    loader.start(1, [this](int) { load(); });
+    return true;
+#endif
+  }
+
+  void close()
+  {
+#ifdef READAHEAD_FADVISE
+    if (file >= 0)            ::close(file);
+    file                      = -1;
+#else
+    if (pending) {
+      pending->close();
+      loader.join();
+      delete pending;
+      pending                 = 0;
+    }
+    if (file)                 std::fclose(file);
+    file                      = 0;
+#endif
+  }
+
+#ifdef READAHEAD_FADVISE
+  bool isOpen() const { return file >= 0; }
+#else
+  bool isOpen() const { return file != 0; }
+#endif
+
+  /// Requests that the given region be loaded in the background.
+  void prefetch(const uint64_t offset, const uint64_t bytes)
+  {
+    if (!isOpen() || bytes < 1)
+      return;
+#ifdef READAHEAD_FADVISE
+    if (posix_fadvise(file, static_cast<off_t>(offset), static_cast<off_t>(bytes), POSIX_FADV_WILLNEED) == 0)
+      bytesPrefetched        += bytes;
+#else
+    Region                    region          = { offset, bytes };
+    if (pending->tryPush(region))
+      bytesPrefetched        += bytes;
+#endif
+  }
+
+  void consumed(const uint64_t bytes) { bytesConsumed += bytes; }
+
+protected:
+#ifndef READAHEAD_FADVISE
+  /// Reads queued regions into a scratch buffer, only for the side effect of caching them.
+  void load()
+  {
+    std::vector<char>         buffer(BLOCK_BYTES);
+    Region                    region;
+    while (pending->pop(region)) {
+#  ifdef _WIN32
+      if (_fseeki64(file, static_cast<__int64>(region.offset), SEEK_SET) != 0)
+#  else
+      if (fseeko(file, static_cast<off_t>(region.offset), SEEK_SET) != 0)
+#  endif
+        continue;
+      for (uint64_t numRead = 0; numRead < region.bytes && !pending->isClosed(); ) {
+        const size_t          numBytes        = static_cast<size_t>( std::min<uint64_t>(buffer.size(), region.bytes - numRead) );
+        const size_t          numGot          = std::fread(buffer.data(), 1, numBytes, file);
+        numRead              += numGot;
+        if (numGot < numBytes)  break;
+      }
+    }
+  }
+#endif
+
+private:
+  ReadAhead(const ReadAhead&);
+  ReadAhead& operator=(const ReadAhead&);
+};
+
+
+//_________________________________________________________________________
+/**
+  Read-ahead of the pages of a TIFF file in the order in which they are to be accessed,
+  using the locations recorded in its TiffIndex. Callers invoke advance() just before
+  reading each page, which requests the following depth pages in the schedule. Each
+  page is prefetched only once provided that the schedule is in increasing order.
+
+  bytesPrefetched includes an estimate of HEADER_BYTES per directory in addition to the
+  pixel data, whereas bytesConsumed counts only the (exact) pixel data size of each page
+  that advance() is called for, i.e. that the caller is about to read.
+*/
+class TiffReadAhead : public ReadAhead
+{
+public:
+  static const uint64_t       HEADER_BYTES    = 1 << 14;    ///< bytes to prefetch for each image file directory
+
+protected:
+  std::vector<TiffPage>       pages;
+  size_t                      depth;
+  bool                        withData;
+  size_t                      nextPage;       ///< all pages before this have been prefetched
+
+public:
+  /// If withData is false, only the directory headers of each page are prefetched.
+  TiffReadAhead(const size_t depth = 16, const bool withData = true)
+    : depth     (depth)
+    , withData  (withData)
+    , nextPage  (0)
+  { }
+
+  bool open(const char* path, const TiffIndex& index)
+  {
+    pages                     = index.pages;
+    nextPage                  = 0;
+    return ReadAhead::open(path, 4 * depth);
+  }
+
+  /// Number of bytes prefetched for the given page.
+  uint64_t pageBytes(const size_t iPage) const
+  {
+    return HEADER_BYTES + ( withData ? pages[iPage].dataBytes : 0 );
+  }
+
+  /// Called before reading schedule[iCurrent], where schedule is a list of pages in increasing order.
+  void advance(const std::vector<int>& schedule, const size_t iCurrent)
+  {
+    if (iCurrent >= schedule.size())
+      return;
+    consumePage(schedule[iCurrent]);
+
+    const size_t              iEnd            = std::min(schedule.size(), iCurrent + 1 + depth);
+    for (size_t iAhead = iCurrent; iAhead < iEnd; ++iAhead)
+      prefetchPage(schedule[iAhead]);
+  }
+
+  /// As above, for the regularly spaced schedule iPage, iPage + stride, iPage + 2*stride, ...
+  void advance(const size_t iPage, const size_t stride = 1)
+  {
+    if (iPage >= pages.size())
+      return;
+    consumePage(iPage);
+
+    for (size_t iAhead = 0, iNext = iPage; iAhead <= depth && iNext < pages.size(); ++iAhead, iNext += stride)
+      prefetchPage(iNext);
+  }
+
+protected:
+  void consumePage(const size_t iPage)
+  {
+    if (iPage < pages.size())
+      consumed(pages[iPage].dataBytes);
+  }
+
+  void prefetchPage(const size_t iPage)
+  {
+    if (iPage < nextPage || iPage >= pages.size())
+      return;
+    nextPage                  = iPage + 1;
+
+    const TiffPage&           page            = pages[iPage];
+    prefetch(page.ifdOffset, HEADER_BYTES);
+    if (withData)
+      prefetch(page.dataOffset, page.dataBytes);
+  }
+};
+
+
+#endif //READAHEAD_H
@@ -0,0 +1,213 @@
+/**
+  Synchronization information that ScanImage records in the image description of every
+  frame: the frame timestamp, the wall clock time of the acquisition, and the first data
+  packet (if any) received over the I2C bus during the frame.
+
+  FrameSyncParser extracts these fields from a single description, and is shared by
+  getSyncInfo (which reads only headers) and imreadx (which parses headers while decoding
+  the corresponding frames). FrameSyncTable collects the results for all frames of a stack.
+*/
+
+
+#ifndef SCANIMAGESYNC_H
+#define SCANIMAGESYNC_H
+
+#include <vector>
+#include <limits>
+#include <cstring>
+#include <algorithm>
+#include "headerFields.h"
+
+
+static const char       ACQ_NAME[]    = "acquisitionNumbers";
+static const char       TIME_NAME[]   = "frameTimestamps_sec";
+static const char       EPOCH_NAME[]  = "epoch";
+static const char       DATA_NAME[]   = "I2CData";
+static const int        N_TIMESTAMP   = 6;
+
+
+
+//_________________________________________________________________________
+/// Outcome of FrameSyncParser::parse().
+enum SyncStatus
+{ SYNC_OK
+, SYNC_FIELD          ///< missing or malformed field
+, SYNC_ENTRY          ///< malformed entry in the I2C data packet
+, SYNC_EPOCH          ///< wrong number of elements in the epoch vector
+};
+
+
+/**
+  Parser for the synchronization fields of a single frame. An instance holds scratch space
+  for parsing, and so should only be used by one thread at a time.
+*/
+class FrameSyncParser
+{
+public:
+  double                      acquisition;          ///< NaN if not recorded
+  double                      frameTime;
+  double                      epoch[N_TIMESTAMP];
+  double                      dataTime;             ///< NaN if there is no I2C data packet
+  std::vector<unsigned char>  data;                 ///< bytes of the first I2C data packet
+
+  const char*                 errorField;           ///< name of the field that failed to parse
+  int                         errorValue;           ///< byte index for SYNC_ENTRY, number of elements for SYNC_EPOCH
+
+protected:
+  HeaderFields                fields;
+  std::vector<double>         values;
+
+public:
+  FrameSyncParser()
+    : acquisition(0), frameTime(0), dataTime(0), errorField(0), errorValue(0)
+  {
+    std::fill(epoch, epoch + N_TIMESTAMP, 0.);
+  }
+
+  /**
+    Parses the given description, which need not be null-terminated. The acquisition
+    number is meaningfully recorded only for the first frame of a file, and is therefore
+    only required to be present if so specified.
+  */
+  SyncStatus parse(const char* desc, const size_t length, const bool requireAcquisition = false)
+  {
+    static const double       INVALID         = std::numeric_limits<double>::quiet_NaN();
+    fields.parse(desc, length);
+    data.clear();
+
+    // Locate acquisition number
+    if (!fields.getScalar(ACQ_NAME, sizeof(ACQ_NAME) - 1, acquisition)) {
+      if (requireAcquisition) return fail(SYNC_FIELD, ACQ_NAME);
+      acquisition             = INVALID;
+    }
+
+    // Locate frame timestamp
+    if (!fields.getScalar(TIME_NAME, sizeof(TIME_NAME) - 1, frameTime))
+      return fail(SYNC_FIELD, TIME_NAME);
+
+    // Locate wall clock time
+    values.clear();
+    if (!fields.getVector(EPOCH_NAME, sizeof(EPOCH_NAME) - 1, values))
+      return fail(SYNC_FIELD, EPOCH_NAME);
+    if (values.size() != N_TIMESTAMP)
+      return fail(SYNC_EPOCH, EPOCH_NAME, static_cast<int>(values.size()));
+    std::copy(values.begin(), values.end(), epoch);
+
+
+    // Locate I2C field entry, of the format {{timestamp, [x1 x2 ... xN]}, ...} --OR-- {{timestamp, [x1,x2,...,xN]}, ...}
+    const HeaderFields::Field*  i2c           = fields.find(DATA_NAME, sizeof(DATA_NAME) - 1);
+    const char*               str             = ( i2c ? static_cast<const char*>(std::memchr(i2c->value, '{', i2c->valueEnd - i2c->value)) : 0 );
+    if (i2c && !str)
+      return fail(SYNC_FIELD, DATA_NAME);
+
+    // Retain first entry
+    const char*               end             = ( i2c ? i2c->valueEnd : 0 );
+    if (str)                  str             = static_cast<const char*>(std::memchr(str + 1, '{', end - str - 1));
+    if (!str) {
+      dataTime                = INVALID;
+      return SYNC_OK;
+    }
+
+    // Parse time stamp as double precision
+    ++str;
+    if (!fastParseDouble(str, end, dataTime))
+      return fail(SYNC_FIELD, DATA_NAME);
+
+    // Parse data packet as a sequence of bytes
+    str                       = static_cast<const char*>(std::memchr(str, '[', end - str));
+    if (!str)
+      return fail(SYNC_FIELD, DATA_NAME);
+
+    for (++str; str < end && *str != ']'; ) {
+      int64_t                 byte;
+      if (!fastParseInteger(str, end, byte))
+        return fail(SYNC_ENTRY, DATA_NAME, static_cast<int>(data.size()));
+      data.push_back(static_cast<unsigned char>(byte));
+
+      // The delimiter depends on version of ScanImage, if this changes, should be added here
+      while (str < end && (*str == ' ' || *str == ','))
+        ++str;
+    }
+    if (str >= end)
+      return fail(SYNC_FIELD, DATA_NAME);
+    return SYNC_OK;
+  }
+
+protected:
+  SyncStatus fail(const SyncStatus status, const char* field, const int value = 0)
+  {
+    errorField                = field;
+    errorValue                = value;
+    return status;
+  }
+};
+
+
+
+//_________________________________________________________________________
+/**
+  Synchronization information for all frames of an image stack, indexed by output frame.
+  Frames that have not been recorded have NaN timestamps. Different threads can record
+  different frames concurrently.
+*/
+class FrameSyncTable
+{
+public:
+  std::vector<double>                       acquisition;
+  std::vector<double>                       frameTime;
+  std::vector<double>                       dataTime;
+  std::vector<double>                       epoch;        ///< N_TIMESTAMP consecutive values per frame
+  std::vector<std::vector<unsigned char> >  data;
+
+public:
+  FrameSyncTable(const size_t numFrames)
+    : acquisition (numFrames              , std::numeric_limits<double>::quiet_NaN())
+    , frameTime   (numFrames              , std::numeric_limits<double>::quiet_NaN())
+    , dataTime    (numFrames              , std::numeric_limits<double>::quiet_NaN())
+    , epoch       (numFrames * N_TIMESTAMP, std::numeric_limits<double>::quiet_NaN())
+    , data        (numFrames)
+  { }
+
+  size_t size() const { return frameTime.size(); }
+
+  /// Parses the description of the given frame with parser, returning false on failure.
+  bool record(const size_t iFrame, const char* desc, const size_t length, FrameSyncParser& parser)
+  {
+    if (parser.parse(desc, length) != SYNC_OK)
+      return false;
+    acquisition[iFrame]       = parser.acquisition;
+    frameTime  [iFrame]       = parser.frameTime;
+    dataTime   [iFrame]       = parser.dataTime;
+    data       [iFrame]       = parser.data;
+    std::copy(parser.epoch, parser.epoch + N_TIMESTAMP, epoch.begin() + iFrame * N_TIMESTAMP);
+    return true;
+  }
+
+  /// Copies the information for frame iSource to frame iTarget.
+  void copy(const size_t iTarget, const size_t iSource)
+  {
+    acquisition[iTarget]      = acquisition[iSource];
+    frameTime  [iTarget]      = frameTime  [iSource];
+    dataTime   [iTarget]      = dataTime   [iSource];
+    data       [iTarget]      = data       [iSource];
+    std::copy(epoch.begin() + iSource * N_TIMESTAMP, epoch.begin() + (iSource + 1) * N_TIMESTAMP, epoch.begin() + iTarget * N_TIMESTAMP);
+  }
+
+  /**
+    Returns the size in bytes of the I2C data packets, which must be the same for all
+    frames that have one, or -1 if this is not the case.
+  */
+  int packetBytes() const
+  {
+    size_t                    numBytes        = 0;
+    for (size_t iFrame = 0; iFrame < data.size(); ++iFrame) {
+      if (data[iFrame].empty())               continue;
+      if (numBytes < 1)                       numBytes  = data[iFrame].size();
+      else if (data[iFrame].size() != numBytes)   return -1;
+    }
+    return static_cast<int>(numBytes);
+  }
+};
+
+
+#endif //SCANIMAGESYNC_H
@@ -0,0 +1,228 @@
+/**
+  Incremental output of processed image stacks, one chunk of frames at a time.
+
+  Frames are given in the column-major layout of Matlab arrays (as produced by
+  ImageProcessor), as single precision values. They are written either as a multi-page
+  TIFF with one 32-bit floating point page per frame, as a chunked movie file (see
+  movieFile.h), or as a headerless raw file that is simply the concatenation of all frames
+  in the same layout as in memory, i.e. that can be read back with
+  reshape(fread(fid, inf, '*single'), height, width, []).
+
+  TIFF files are written in the BigTIFF format if the uncompressed size of the stack could
+  exceed the 4GB limit of classic TIFF, or if the file extension is .btf or .tf8. Pages
+  can be compressed with any of the codecs supported by libtiff for floating point data,
+  in which case the floating point predictor is used to improve the compression ratio.
+*/
+
+
+#ifndef STACKWRITER_H
+#define STACKWRITER_H
+
+#include <string>
+#include <vector>
+#include <cctype>
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include <tiffio.h>
+#include "movieFile.h"
+
+
+
+//_________________________________________________________________________
+/**
+  Writes frames of a fixed size to a TIFF, movie or raw file. The movie options have to be
+  set before the file is opened.
+*/
+class StackWriter
+{
+public:
+  enum Format { FORMAT_RAW, FORMAT_TIFF, FORMAT_BIGTIFF, FORMAT_MOVIE };
+
+  /// Uncompressed size above which BigTIFF is used, with some margin for the directories.
+  static const uint64_t       MAX_CLASSIC_BYTES = 0xF0000000ULL;
+
+  MovieLayout                 movieLayout;
+  size_t                      framesPerChunk;
+  std::vector<unsigned char>  movieMetadata;    ///< see appendMetadata()
+
+protected:
+  Format                      format;
+  uint16_t                    compression;
+  MovieWriter                 movie;
+  int                         width;
+  int                         height;
+  size_t                      numWritten;
+  TIFF*                       tif;
+  FILE*                       raw;
+  std::vector<float>          rows;             ///< row-major copy of the current frame
+
+public:
+  StackWriter()
+    : movieLayout(MOVIE_FRAME_MAJOR), framesPerChunk(100)
+    , format(FORMAT_RAW), compression(COMPRESSION_NONE), width(0), height(0), numWritten(0), tif(0), raw(0)
+  { }
+
+  ~StackWriter()
+  {
+    std::string               ignored;
+    close(ignored);
+  }
+
+  /// Format implied by the extension of path: TIFF for .tif/.tiff, BigTIFF for .btf/.tf8, movie for .ecsmov, otherwise raw.
+  static Format formatOf(const char* path)
+  {
+    const char*               extension       = std::strrchr(path, '.');
+    if (!extension || std::strpbrk(extension, "/\\"))
+      return FORMAT_RAW;
+
+    std::string               suffix          (extension + 1);
+    std::transform(suffix.begin(), suffix.end(), suffix.begin(), ::tolower);
+    if (suffix == "tif" || suffix == "tiff")  return FORMAT_TIFF;
+    if (suffix == "btf" || suffix == "tf8")   return FORMAT_BIGTIFF;
+    if (suffix == "ecsmov")                   return FORMAT_MOVIE;
+    return FORMAT_RAW;
+  }
+
+  /**
+    Returns true if the named compression can be used for the given format: "none" for
+    all formats, "shuffle" for movies, and for TIFF any of "lzw", "deflate" or "zstd" that
+    are available in the libtiff library that this program is linked to.
+  */
+  static bool isSupported(const Format format, const std::string& name)
+  {
+    uint16_t                  code;
+    if (name == "none")       return true;
+    if (format == FORMAT_MOVIE) return name == "shuffle";
+    if (format == FORMAT_RAW) return false;
+    return tiffCompression(name, code);
+  }
+
+  /// Translates a compression name to the libtiff code, returning false if the codec is not available.
+  static bool tiffCompression(const std::string& name, uint16_t& code)
+  {
+    if      (name == "none"   )   code            = COMPRESSION_NONE;
+    else if (name == "lzw"    )   code            = COMPRESSION_LZW;
+    else if (name == "deflate")   code            = COMPRESSION_ADOBE_DEFLATE;
+#ifdef COMPRESSION_ZSTD
+    else if (name == "zstd"   )   code            = COMPRESSION_ZSTD;
+#endif
+    else                          return false;
+    return TIFFIsCODECConfigured(code) != 0;
+  }
+
+  /// Creates the output file for numFrames frames of the given size, returning false upon failure.
+  bool open(const char* path, const int width, const int height, const size_t numFrames, const std::string& compression, std::string& error)
+  {
+    this->format              = formatOf(path);
+    this->width               = width;
+    this->height              = height;
+    numWritten                = 0;
+    if (!isSupported(format, compression))
+      return fail(error, "Unsupported compression for this output format.");
+
+    if (format == FORMAT_MOVIE) {
+      const MovieCodec        codec           = ( compression == "shuffle" ? MOVIE_SHUFFLE_RLE : MOVIE_RAW );
+      return movie.open(path, width, height, numFrames, movieLayout, codec, framesPerChunk, movieMetadata, error);
+    }
+    if (format == FORMAT_RAW) {
+      raw                     = std::fopen(path, "wb");
+      if (!raw)               return fail(error, "Failed to create output file.");
+      return true;
+    }
+
+    tiffCompression(compression, this->compression);
+    const uint64_t            stackBytes      = static_cast<uint64_t>(numFrames) * width * height * sizeof(float);
+    const bool                isBig           = ( format == FORMAT_BIGTIFF || stackBytes > MAX_CLASSIC_BYTES );
+    tif                       = TIFFOpen(path, isBig ? "w8" : "w");
+    if (!tif)                 return fail(error, "Failed to create output file.");
+    rows.resize(static_cast<size_t>(width) * height);
+    return true;
+  }
+
+  size_t size() const { return numWritten; }
+
+  /// Appends numFrames consecutive frames stored in imgData, returning false upon failure.
+  bool write(const float* imgData, const size_t numFrames, std::string& error)
+  {
+    const size_t              framePixels     = static_cast<size_t>(width) * height;
+    if (format == FORMAT_MOVIE) {
+      if (!movie.write(imgData, numFrames, error))
+        return false;
+      numWritten             += numFrames;
+      return true;
+    }
+    if (raw) {
+      if (std::fwrite(imgData, sizeof(float), framePixels * numFrames, raw) != framePixels * numFrames)
+        return fail(error, "Failed to write frames to output file.");
+      numWritten             += numFrames;
+      return true;
+    }
+    if (!tif)                 return fail(error, "Output file is not open.");
+
+    for (size_t iFrame = 0; iFrame < numFrames; ++iFrame, ++numWritten) {
+      // Transpose from column-major to the row-major order of TIFF pages
+      const float*            frame           = imgData + iFrame * framePixels;
+      for (int x = 0; x < width; ++x, frame += height)
+        for (int y = 0; y < height; ++y)
+          rows[static_cast<size_t>(y) * width + x]  = frame[y];
+
+      TIFFSetField(tif, TIFFTAG_IMAGEWIDTH      , static_cast<uint32_t>(width));
+      TIFFSetField(tif, TIFFTAG_IMAGELENGTH     , static_cast<uint32_t>(height));
+      TIFFSetField(tif, TIFFTAG_BITSPERSAMPLE   , 32);
+      TIFFSetField(tif, TIFFTAG_SAMPLESPERPIXEL , 1);
+      TIFFSetField(tif, TIFFTAG_SAMPLEFORMAT    , SAMPLEFORMAT_IEEEFP);
+      TIFFSetField(tif, TIFFTAG_PHOTOMETRIC     , PHOTOMETRIC_MINISBLACK);
+      TIFFSetField(tif, TIFFTAG_PLANARCONFIG    , PLANARCONFIG_CONTIG);
+      TIFFSetField(tif, TIFFTAG_COMPRESSION     , compression);
+      if (compression != COMPRESSION_NONE)
+        TIFFSetField(tif, TIFFTAG_PREDICTOR     , PREDICTOR_FLOATINGPOINT);
+
+      // Several strips per page so that readers can decompress them in parallel
+      const uint32_t          rowsPerStrip    = std::max<uint32_t>(1, std::min<uint32_t>(height, TIFFDefaultStripSize(tif, 0)));
+      TIFFSetField(tif, TIFFTAG_ROWSPERSTRIP    , rowsPerStrip);
+      for (uint32_t row = 0, iStrip = 0; row < static_cast<uint32_t>(height); row += rowsPerStrip, ++iStrip) {
+        const uint32_t        numRows         = std::min<uint32_t>(rowsPerStrip, height - row);
+        if (TIFFWriteEncodedStrip(tif, iStrip, &rows[static_cast<size_t>(row) * width], static_cast<tmsize_t>(numRows) * width * sizeof(float)) < 0)
+          return fail(error, "Failed to write frame to output file.");
+      }
+      if (!TIFFWriteDirectory(tif))
+        return fail(error, "Failed to write frame to output file.");
+    }
+    return true;
+  }
+
+  /// Finalizes the output file, returning false if not all data could be written.
+  bool close(std::string& error)
+  {
+    bool                      isOK            = true;
+    if (format == FORMAT_MOVIE)
+      return movie.close(error);
+    if (raw) {
+      isOK                    = ( std::fclose(raw) == 0 );
+      raw                     = 0;
+    }
+    if (tif) {
+      isOK                    = ( TIFFFlush(tif) != 0 );
+      TIFFClose(tif);
+      tif                     = 0;
+    }
+    rows.clear();
+    return isOK || fail(error, "Failed to finalize output file.");
+  }
+
+protected:
+  bool fail(std::string& error, const char* what)
+  {
+    error                     = what;
+    return false;
+  }
+
+private:
+  StackWriter(const StackWriter&);
+  StackWriter& operator=(const StackWriter&);
+};
+
+
+#endif //STACKWRITER_H
@@ -0,0 +1,164 @@
+/**
+  Template matching of many frames against the same template, equivalent to
+  cv::matchTemplate() but without recomputing the template statistics and Fourier
+  transform for every frame.
+
+  The cross-correlation of each frame with the (mean subtracted) template is computed via
+  the DFT, using the cached spectrum of the template. The sums of pixel values and their
+  squares within each template-sized window of the frame, as required for normalization,
+  are obtained from integral images. The metric values are then computed with the same
+  expressions as in the OpenCV implementation, for all cv::TemplateMatchModes.
+*/
+
+
+#ifndef TEMPLATEMATCH_H
+#define TEMPLATEMATCH_H
+
+#include <cmath>
+#include <cfloat>
+#include <algorithm>
+#include <opencv2/core.hpp>
+#include <opencv2/imgproc.hpp>
+
+
+
+//_________________________________________________________________________
+/**
+  Cached statistics and spectrum of a template. Any number of threads can call match()
+  concurrently, each with its own Scratch workspace.
+*/
+class TemplateMatch
+{
+public:
+  /// Per-thread temporary storage.
+  struct Scratch
+  {
+    cv::Mat                   padded;                   ///< mean subtracted and zero padded frame
+    cv::Mat                   spectrum;
+    cv::Mat                   correlation;              ///< with the mean subtracted template
+    cv::Mat                   sum;                      ///< integral image of the frame
+    cv::Mat                   sqsum;                    ///< integral image of the squared frame
+  };
+
+protected:
+  int                         method;
+  int                         frameRows, frameCols;
+  int                         templRows, templCols;
+  double                      templMean;
+  double                      templNorm;                ///< root sum of squares, of the mean subtracted template for TM_CCOEFF*
+  double                      templSum2;                ///< sum of squares of the template
+  cv::Mat                     spectrum;                 ///< DFT (CCS packed) of the padded, mean subtracted template
+
+public:
+  TemplateMatch() : method(-1), frameRows(0), frameCols(0), templRows(0), templCols(0), templMean(0), templNorm(0), templSum2(0) { }
+
+  bool empty() const { return spectrum.empty(); }
+
+  /// Caches the statistics and spectrum of templ (of type CV_32F), for frames of the given size.
+  void setTemplate(const cv::Mat& templ, const int frameRows, const int frameCols, const int method)
+  {
+    this->method              = method;
+    this->frameRows           = frameRows;
+    this->frameCols           = frameCols;
+    templRows                 = templ.rows;
+    templCols                 = templ.cols;
+
+    double                    sum             = 0;
+    templSum2                 = 0;
+    for (int row = 0; row < templRows; ++row) {
+      const float*            pixel           = templ.ptr<float>(row);
+      for (int col = 0; col < templCols; ++col) {
+        sum                  += pixel[col];
+        templSum2            += static_cast<double>(pixel[col]) * pixel[col];
+      }
+    }
+    const double              area            = 1. * templRows * templCols;
+    templMean                 = sum / area;
+    templNorm                 = std::sqrt( isCoefficient() ? std::max(templSum2 - sum * templMean, 0.) : templSum2 );
+
+    cv::Mat                   padded          ( cv::getOptimalDFTSize(frameRows), cv::getOptimalDFTSize(frameCols), CV_32F, cv::Scalar(0) );
+    cv::Mat                   region          = padded(cv::Rect(0, 0, templCols, templRows));
+    cv::subtract(templ, cv::Scalar(templMean), region);
+    cv::dft(padded, spectrum, 0, templRows);
+  }
+
+  /// Computes the metric (of size frameRows - templRows + 1 by frameCols - templCols + 1) for frame, of type CV_32F.
+  void match(const cv::Mat& frame, Scratch& scratch, cv::Mat& result) const
+  {
+    const int                 resultRows      = frameRows - templRows + 1;
+    const int                 resultCols      = frameCols - templCols + 1;
+    result.create(resultRows, resultCols, CV_32F);
+
+    // A uniform template has no defined correlation coefficient
+    if (method == cv::TemplateMatchModes::TM_CCOEFF_NORMED && templNorm < DBL_EPSILON) {
+      result                  = cv::Scalar(1);
+      return;
+    }
+
+    // The frame mean does not change the correlation with a zero-mean template, but is
+    // subtracted to preserve precision in single precision arithmetic
+    scratch.padded.create(spectrum.rows, spectrum.cols, CV_32F);
+    scratch.padded            = cv::Scalar(0);
+    cv::Mat                   region          = scratch.padded(cv::Rect(0, 0, frameCols, frameRows));
+    cv::subtract(frame, cv::mean(frame), region);
+
+    // Circular cross-correlation, which has no wrap-around for the shifts of interest
+    cv::dft(scratch.padded, scratch.spectrum, 0, frameRows);
+    cv::mulSpectrums(scratch.spectrum, spectrum, scratch.spectrum, 0, true);
+    cv::idft(scratch.spectrum, scratch.correlation, cv::DFT_SCALE, resultRows);
+    cv::integral(frame, scratch.sum, scratch.sqsum, CV_64F, CV_64F);
+
+    // Normalization as in cv::matchTemplate()
+    const bool                isNormed        = ( method == cv::TemplateMatchModes::TM_CCORR_NORMED
+                                               || method == cv::TemplateMatchModes::TM_SQDIFF_NORMED
+                                               || method == cv::TemplateMatchModes::TM_CCOEFF_NORMED
+                                                );
+    const bool                isSquaredDiff   = ( method == cv::TemplateMatchModes::TM_SQDIFF || method == cv::TemplateMatchModes::TM_SQDIFF_NORMED );
+    const double              invArea         = 1. / (1. * templRows * templCols);
+    for (int row = 0; row < resultRows; ++row) {
+      const float*            correlation     = scratch.correlation.ptr<float>(row);
+      const double*           sum0            = scratch.sum  .ptr<double>(row);
+      const double*           sum1            = scratch.sum  .ptr<double>(row + templRows);
+      const double*           sqsum0          = scratch.sqsum.ptr<double>(row);
+      const double*           sqsum1          = scratch.sqsum.ptr<double>(row + templRows);
+      float*                  target          = result.ptr<float>(row);
+
+      for (int col = 0; col < resultCols; ++col) {
+        const int             last            = col + templCols;
+        const double          wndSum          = sum1  [last] - sum1  [col] - sum0  [last] + sum0  [col];
+        const double          wndSum2         = sqsum1[last] - sqsum1[col] - sqsum0[last] + sqsum0[col];
+        double                wndMean2        = 0;
+        double                num             = correlation[col];
+        if (isCoefficient())
+          wndMean2            = wndSum * wndSum * invArea;
+        else {
+          num                += wndSum * templMean;
+          if (isSquaredDiff)
+            num               = std::max(wndSum2 - 2*num + templSum2, 0.);
+        }
+
+        if (isNormed) {
+          const double        diff2           = std::max(wndSum2 - wndMean2, 0.);
+          const double        denom           = ( diff2 <= std::min(0.5, 10 * FLT_EPSILON * wndSum2) ? 0 : std::sqrt(diff2) * templNorm );
+          if      (std::fabs(num) < denom)          num  /= denom;
+          else if (std::fabs(num) < denom * 1.125)  num   = ( num > 0 ? 1 : -1 );
+          else                                      num   = ( isSquaredDiff ? 1 : 0 );
+        }
+        target[col]           = static_cast<float>(num);
+      }
+    }
+  }
+
+protected:
+  bool isCoefficient() const
+  {
+    return method == cv::TemplateMatchModes::TM_CCOEFF || method == cv::TemplateMatchModes::TM_CCOEFF_NORMED;
+  }
+
+private:
+  TemplateMatch(const TemplateMatch&);
+  TemplateMatch& operator=(const TemplateMatch&);
+};
+
+
+#endif //TEMPLATEMATCH_H
@@ -0,0 +1,227 @@
+/**
+  Coarse-to-fine search for the shift that best aligns a frame to a template, for large
+  ranges of shifts. The frame and template are downsampled by successive factors of 2
+  (by area averaging via ImageCondenser2D), the full range of shifts is searched with
+  cv::matchTemplate() at the coarsest level only, and the optimum is then refined within
+  a small window of shifts at each finer level. The cost is therefore dominated by the
+  full resolution refinement, which is independent of the maximum shift.
+
+  At the finest (full) resolution, the metric values are exactly those that a search over
+  all shifts would have produced, but only for the window of shifts around the optimum.
+*/
+
+
+#ifndef TEMPLATEPYRAMID_H
+#define TEMPLATEPYRAMID_H
+
+#include <limits>
+#include <vector>
+#include <algorithm>
+#include <opencv2/core.hpp>
+#include <opencv2/imgproc.hpp>
+#include "imageCondenser.h"
+
+
+
+//_________________________________________________________________________
+/**
+  Downsampled versions of a template, and the corresponding search ranges. Any number of
+  threads can call coarseSearch() and refine() concurrently, each with its own Scratch
+  workspace.
+
+  Images are assumed to be continuous CV_32F matrices. Shifts are expressed in the
+  coordinates of the cv::matchTemplate() output, i.e. (x, y) corresponds to a shift of
+  (x - maxColShift, y - maxRowShift) pixels at that level.
+*/
+class TemplatePyramid
+{
+public:
+  static const int            REFINE_RADIUS   = 2;      ///< half-size of the window of shifts evaluated at finer levels
+  static const int            MAX_STEPS       = 8;      ///< number of times a window can be moved to follow the optimum
+
+  /// Per-thread temporary storage.
+  struct Scratch
+  {
+    std::vector<cv::Mat>      frames;                   ///< frame at each level
+    cv::Mat                   coarse;                   ///< metric for all shifts at the coarsest level
+    cv::Mat                   window;                   ///< metric for the current window of shifts
+  };
+
+protected:
+  struct Level
+  {
+    int                       rows, cols;
+    int                       maxRowShift, maxColShift;
+    cv::Mat                   reference;
+    cv::Mat                   region;                   ///< reference cropped by the maximum shifts
+  };
+
+  const int                   method;
+  const bool                  useMinimum;
+  std::vector<Level>          levels;
+  std::vector<CondenserInfo2D*> condensers;             ///< from each level to the next coarser one
+
+public:
+  /**
+    Constructs up to numLevels downsampled levels in addition to the full resolution one,
+    stopping early when the range of shifts at a level is already within the refinement
+    window. method is the cv::TemplateMatchModes to use, and useMinimum should be true for
+    methods where the best match has the smallest metric value.
+  */
+  TemplatePyramid(const int rows, const int cols, const int maxRowShift, const int maxColShift, const int numLevels, const int method, const bool useMinimum)
+    : method(method), useMinimum(useMinimum)
+  {
+    Level                     full;
+    full.rows                 = rows;
+    full.cols                 = cols;
+    full.maxRowShift          = maxRowShift;
+    full.maxColShift          = maxColShift;
+    levels.push_back(full);
+
+    for (int iLevel = 0; iLevel < numLevels; ++iLevel) {
+      const Level&            finer           = levels.back();
+      if (finer.maxRowShift <= REFINE_RADIUS && finer.maxColShift <= REFINE_RADIUS)
+        break;
+      if (finer.rows < 4 || finer.cols < 4)
+        break;
+
+      Level                   level;
+      level.rows              = (finer.rows + 1) / 2;
+      level.cols              = (finer.cols + 1) / 2;
+      level.maxRowShift       = std::min((finer.maxRowShift + 1) / 2, (level.rows - 1) / 2);
+      level.maxColShift       = std::min((finer.maxColShift + 1) / 2, (level.cols - 1) / 2);
+
+      // The condenser operates on column-major images, so row-major ones are described as transposed
+      condensers.push_back(new CondenserInfo2D(finer.rows, finer.cols, level.rows, level.cols));
+      levels.push_back(level);
+    }
+  }
+
+  ~TemplatePyramid()
+  {
+    for (size_t iLevel = 0; iLevel < condensers.size(); ++iLevel)
+      delete condensers[iLevel];
+  }
+
+  /// Number of downsampled levels, excluding the full resolution one.
+  int numLevels() const { return static_cast<int>(levels.size()) - 1; }
+
+  /// Size of the metric returned by coarseSearch().
+  cv::Size coarseSize() const { return cv::Size(2*levels.back().maxColShift + 1, 2*levels.back().maxRowShift + 1); }
+
+  /// Downsamples the template to all levels. The full resolution image is referenced, not copied.
+  void setReference(const cv::Mat& image)
+  {
+    levels[0].reference       = image;
+    for (size_t iLevel = 1; iLevel < levels.size(); ++iLevel)
+      condense(levels[iLevel - 1].reference, levels[iLevel].reference, iLevel);
+
+    for (size_t iLevel = 0; iLevel < levels.size(); ++iLevel) {
+      Level&                  level           = levels[iLevel];
+      level.region            = level.reference(cv::Rect( level.maxColShift, level.maxRowShift
+                                                        , level.cols - 2*level.maxColShift
+                                                        , level.rows - 2*level.maxRowShift
+                                                        ));
+    }
+  }
+
+  /**
+    Downsamples frame to all levels, and returns the metric for all shifts at the coarsest
+    level. The caller should locate the optimum of this and pass it to refine().
+  */
+  const cv::Mat& coarseSearch(const cv::Mat& frame, Scratch& scratch) const
+  {
+    scratch.frames.resize(levels.size());
+    scratch.frames[0]         = frame;
+    for (size_t iLevel = 1; iLevel < levels.size(); ++iLevel)
+      condense(scratch.frames[iLevel - 1], scratch.frames[iLevel], iLevel);
+
+    cv::matchTemplate(scratch.frames.back(), levels.back().region, scratch.coarse, method);
+    return scratch.coarse;
+  }
+
+  /**
+    Refines the optimum of the coarsest level down to full resolution, which requires that
+    there is at least one downsampled level. The full resolution metric (of size
+    2*maxRowShift+1 by 2*maxColShift+1) is filled with NaN except for the evaluated window
+    around the returned optimum, and the optimal value is stored in value.
+  */
+  cv::Point refine(Scratch& scratch, const cv::Point& coarseOptimum, cv::Mat& metric, double& value) const
+  {
+    cv::Point                 optimum         = coarseOptimum;
+    cv::Rect                  window;
+    for (int iLevel = static_cast<int>(levels.size()) - 2; iLevel >= 0; --iLevel) {
+      const Level&            finer           = levels[iLevel];
+      const Level&            coarser         = levels[iLevel + 1];
+
+      // Predicted shift at this level, accounting for the non-integer scale of odd-sized levels
+      const cv::Point         center          ( cvRound(1. * (optimum.x - coarser.maxColShift) * finer.cols / coarser.cols) + finer.maxColShift
+                                              , cvRound(1. * (optimum.y - coarser.maxRowShift) * finer.rows / coarser.rows) + finer.maxRowShift
+                                              );
+      optimum                 = climb(scratch.frames[iLevel], finer, center, scratch.window, window, value);
+    }
+
+    const Level&              full            = levels[0];
+    metric.create(2*full.maxRowShift + 1, 2*full.maxColShift + 1, CV_32F);
+    metric                    = cv::Scalar(std::numeric_limits<float>::quiet_NaN());
+    cv::Mat                   target          = metric(window);
+    scratch.window.copyTo(target);
+    return optimum;
+  }
+
+protected:
+  /// Area-averages source (of the level finer than iLevel) into target.
+  void condense(const cv::Mat& source, cv::Mat& target, const size_t iLevel) const
+  {
+    const Level&              level           = levels[iLevel];
+    target.create(level.rows, level.cols, CV_32F);
+    ImageCondenser2D<float,float>()(source.ptr<float>(), target.ptr<float>(), condensers[iLevel - 1]);
+  }
+
+  /**
+    Evaluates the metric for a window of shifts around center, and moves the window to
+    follow the optimum until it is not on an edge of the window (unless that is also the
+    edge of the search range). This ensures that the neighbors of the optimum are available
+    for sub-pixel interpolation.
+  */
+  cv::Point climb(const cv::Mat& frame, const Level& level, cv::Point center, cv::Mat& result, cv::Rect& window, double& value) const
+  {
+    const int                 lastCol         = 2*level.maxColShift;
+    const int                 lastRow         = 2*level.maxRowShift;
+    cv::Point                 optimum;
+    for (int iStep = 0; ; ++iStep) {
+      const int               firstX          = std::max(0      , std::min(lastCol, center.x) - REFINE_RADIUS);
+      const int               firstY          = std::max(0      , std::min(lastRow, center.y) - REFINE_RADIUS);
+      const int               endX            = std::min(lastCol, std::max(0      , center.x) + REFINE_RADIUS) + 1;
+      const int               endY            = std::min(lastRow, std::max(0      , center.y) + REFINE_RADIUS) + 1;
+      window                  = cv::Rect(firstX, firstY, endX - firstX, endY - firstY);
+
+      // Shifts in the window only involve the frame pixels that can overlap the template
+      const cv::Mat           patch           = frame(cv::Rect( firstX, firstY
+                                                              , window.width  + level.region.cols - 1
+                                                              , window.height + level.region.rows - 1
+                                                              ));
+      cv::Point               local;
+      cv::matchTemplate(patch, level.region, result, method);
+      if (useMinimum)         cv::minMaxLoc(result, &value, NULL, &local, NULL  );
+      else                    cv::minMaxLoc(result, NULL, &value, NULL  , &local);
+      optimum                 = cv::Point(firstX + local.x, firstY + local.y);
+
+      const bool              atEdge          = ( local.x == 0                  && firstX > 0       )
+                                             || ( local.x == window.width  - 1  && endX   <= lastCol )
+                                             || ( local.y == 0                  && firstY > 0       )
+                                             || ( local.y == window.height - 1  && endY   <= lastRow )
+                                              ;
+      if (!atEdge || iStep >= MAX_STEPS)
+        return optimum;
+      center                  = optimum;
+    }
+  }
+
+private:
+  TemplatePyramid(const TemplatePyramid&);
+  TemplatePyramid& operator=(const TemplatePyramid&);
+};
+
+
+#endif //TEMPLATEPYRAMID_H
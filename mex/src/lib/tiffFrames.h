@@ -0,0 +1,440 @@
+/**
+  Decoding of TIFF stacks directly via libtiff.
+
+  This provides the functionality that previously required a modified build of OpenCV
+  (cv::imreadmulti() with a per-frame callback and frame skipping, and cv::imfinfo()),
+  so that the fast path works with a stock OpenCV installation. Pages are decoded one
+  at a time into a caller-supplied buffer, with no need to load the entire stack, and
+  the OpenCV type of frames follows the sample format recorded in the file header (see
+  tiffSampleFormat()), so that signed integer data is decoded as such. The loop over
+  requested pages, with frame skipping and handling of unreadable pages, is readFrames()
+  in imageProcessor.h.
+
+  The strips or tiles of a page are independent, so a compressed page can be decompressed
+  in parts by several handles to the same file at once (see ParallelTiffSource).
+*/
+
+
+#ifndef TIFFFRAMES_H
+#define TIFFFRAMES_H
+
+#include <mutex>
+#include <vector>
+#include <cstring>
+#include <cstdint>
+#include <algorithm>
+#include <condition_variable>
+#include <tiffio.h>
+#include <opencv2/core.hpp>
+#include "tiffIndex.h"
+#include "workerThreads.h"
+
+
+
+/**
+  Returns the OpenCV type corresponding to the given TIFF sample layout, or -1 if there
+  is no equivalent (e.g. 32-bit unsigned integers).
+*/
+inline int cvTiffSampleType(const int bitsPerSample, const int sampleFormat, const int samplesPerPixel = 1)
+{
+  if (samplesPerPixel < 1 || samplesPerPixel > CV_CN_MAX)
+    return -1;
+
+  int                         depth           = -1;
+  switch (sampleFormat) {
+  case SAMPLEFORMAT_UINT:
+    if      (bitsPerSample ==  8)   depth     = CV_8U ;
+    else if (bitsPerSample == 16)   depth     = CV_16U;
+    break;
+  case SAMPLEFORMAT_INT:
+    if      (bitsPerSample ==  8)   depth     = CV_8S ;
+    else if (bitsPerSample == 16)   depth     = CV_16S;
+    else if (bitsPerSample == 32)   depth     = CV_32S;
+    break;
+  case SAMPLEFORMAT_IEEEFP:
+    if      (bitsPerSample == 32)   depth     = CV_32F;
+    else if (bitsPerSample == 64)   depth     = CV_64F;
+    break;
+  }
+  return ( depth < 0 ? -1 : CV_MAKETYPE(depth, samplesPerPixel) );
+}
+
+
+
+//_________________________________________________________________________
+/**
+  Sequential or random access to the pages of a single TIFF file, all of which must have
+  the same dimensions and sample layout as the first. Pages can be stored as strips or
+  tiles with any compression supported by libtiff, but multiple samples per pixel must be
+  interleaved (PLANARCONFIG_CONTIG). If a TiffIndex is provided, pages are located via
+  the index instead of by walking through the chain of directories.
+
+  Each instance owns one libtiff handle, and so should only be used by one thread at a
+  time.
+*/
+class TiffFrameSource
+{
+public:
+  int                         width;
+  int                         height;
+  int                         bitsPerSample;
+  int                         sampleFormat;
+  int                         samplesPerPixel;
+  int                         compression;
+  int                         type;           ///< OpenCV type of decoded frames
+
+protected:
+  TIFF*                       tif;
+  TiffIndex                   ownIndex;
+  const TiffIndex*            index;
+  size_t                      numDirs;
+  size_t                      currentPage;
+  std::vector<unsigned char>  tileBuffer;
+
+public:
+  TiffFrameSource()
+    : width(0), height(0), bitsPerSample(0), sampleFormat(0), samplesPerPixel(0), compression(0), type(-1)
+    , tif(0), index(0), numDirs(0), currentPage(0)
+  { }
+
+  ~TiffFrameSource() { close(); }
+
+  /**
+    Returns false if the file cannot be opened by libtiff or has a sample layout that is
+    not supported. If index is not provided, one is built (or loaded from its sidecar).
+  */
+  bool open(const char* path, const TiffIndex* pageIndex = 0)
+  {
+    close();
+    tif                       = TIFFOpen(path, "r");
+    if (!tif)                 return false;
+
+    if (pageIndex && !pageIndex->empty())
+      index                   = pageIndex;
+    else if (ownIndex.build(path, tif))
+      index                   = &ownIndex;
+    numDirs                   = ( index ? index->numPages() : TIFFNumberOfDirectories(tif) );
+    currentPage               = 0;
+
+    // The layout of the first page is used for all pages
+    uint32                    tagWidth, tagHeight;
+    uint16                    tagBits, tagSamples, tagPlanar, tagCompression;
+    if ( !TIFFGetField         (tif, TIFFTAG_IMAGEWIDTH     , &tagWidth  )
+      || !TIFFGetField         (tif, TIFFTAG_IMAGELENGTH    , &tagHeight )
+      || !TIFFGetFieldDefaulted(tif, TIFFTAG_BITSPERSAMPLE  , &tagBits   )
+      || !TIFFGetFieldDefaulted(tif, TIFFTAG_SAMPLESPERPIXEL, &tagSamples)
+      || !TIFFGetFieldDefaulted(tif, TIFFTAG_PLANARCONFIG   , &tagPlanar )
+      || !TIFFGetFieldDefaulted(tif, TIFFTAG_COMPRESSION    , &tagCompression)
+       )
+      return fail();
+    if (tagSamples > 1 && tagPlanar != PLANARCONFIG_CONTIG)
+      return fail();
+
+    width                     = static_cast<int>(tagWidth  );
+    height                    = static_cast<int>(tagHeight );
+    bitsPerSample             = static_cast<int>(tagBits   );
+    sampleFormat              = static_cast<int>(tiffSampleFormat(tif));
+    samplesPerPixel           = static_cast<int>(tagSamples);
+    compression               = static_cast<int>(tagCompression);
+    type                      = cvTiffSampleType(bitsPerSample, sampleFormat, samplesPerPixel);
+    if (type < 0)             return fail();
+    return true;
+  }
+
+  void close()
+  {
+    if (tif)                  TIFFClose(tif);
+    tif                       = 0;
+    index                     = 0;
+    ownIndex.pages.clear();
+    numDirs                   = 0;
+    type                      = -1;
+  }
+
+  bool        isOpen    () const  { return tif != 0; }
+  size_t      numPages  () const  { return numDirs; }
+  size_t      rowBytes  () const  { return size_t(width) * samplesPerPixel * (bitsPerSample / 8); }
+  size_t      frameBytes() const  { return rowBytes() * height; }
+
+  /// Positions the libtiff handle at the given page, reading forward where possible.
+  bool seek(const size_t iPage)
+  {
+    if (!tif || iPage >= numDirs)   return false;
+    if (iPage == currentPage)       return true;
+
+    if (index) {
+      currentPage             = ( index->seek(tif, iPage) ? iPage : numDirs );
+      return currentPage == iPage;
+    }
+
+    // Without an index, seeking backwards restarts from the first page, since directory
+    // numbers of TIFFSetDirectory() are only 16-bit in older versions of libtiff
+    if (iPage < currentPage) {
+      if (!TIFFSetDirectory(tif, 0)) {
+        currentPage           = numDirs;
+        return false;
+      }
+      currentPage             = 0;
+    }
+    while (currentPage < iPage && TIFFReadDirectory(tif))
+      ++currentPage;
+    if (currentPage != iPage)
+      currentPage             = numDirs;
+    return currentPage == iPage;
+  }
+
+  /// Number of strips or tiles in the given page, or 0 if it cannot be located.
+  size_t numChunks(const size_t iPage)
+  {
+    if (!seek(iPage))         return 0;
+    return TIFFIsTiled(tif) ? TIFFNumberOfTiles(tif) : TIFFNumberOfStrips(tif);
+  }
+
+  /**
+    Decodes the given page into buffer, which must have room for frameBytes(). Returns
+    false if the page could not be located or decoded, or has a different layout. If 
+    numParts > 1, only the strips or tiles in the given part of the page are decoded
+    (into their locations in buffer), which allows a page to be split among handles.
+  */
+  bool read(const size_t iPage, void* buffer, const size_t part = 0, const size_t numParts = 1)
+  {
+    if (!seek(iPage))         return false;
+
+    uint32                    tagWidth, tagHeight;
+    uint16                    tagBits, tagSamples;
+    if ( !TIFFGetField         (tif, TIFFTAG_IMAGEWIDTH     , &tagWidth  ) || tagWidth   != uint32(width)
+      || !TIFFGetField         (tif, TIFFTAG_IMAGELENGTH    , &tagHeight ) || tagHeight  != uint32(height)
+      || !TIFFGetFieldDefaulted(tif, TIFFTAG_BITSPERSAMPLE  , &tagBits   ) || tagBits    != bitsPerSample
+      || !TIFFGetFieldDefaulted(tif, TIFFTAG_SAMPLESPERPIXEL, &tagSamples) || tagSamples != samplesPerPixel
+       )
+      return false;
+
+    return TIFFIsTiled(tif) ? readTiles(static_cast<unsigned char*>(buffer), part, numParts) : readStrips(static_cast<unsigned char*>(buffer), part, numParts);
+  }
+
+  /// As above, (re)allocating image as necessary.
+  bool read(const size_t iPage, cv::Mat& image)
+  {
+    image.create(height, width, type);
+    return read(iPage, image.data);
+  }
+
+  /// Image description of the current page (i.e. the last one read), or null if there is none.
+  const char* description() const
+  {
+    char*                     desc            = 0;
+    return ( tif && TIFFGetField(tif, TIFFTAG_IMAGEDESCRIPTION, &desc) ? desc : 0 );
+  }
+
+protected:
+  /// Strips are stored top to bottom, each with rowsPerStrip rows except possibly the last.
+  bool readStrips(unsigned char* buffer, const size_t part, const size_t numParts)
+  {
+    uint32                    rowsPerStrip;
+    if (!TIFFGetFieldDefaulted(tif, TIFFTAG_ROWSPERSTRIP, &rowsPerStrip))  return false;
+
+    const size_t              totalBytes      = frameBytes();
+    const size_t              stripBytes      = std::min<size_t>(rowsPerStrip, height) * rowBytes();
+    const size_t              numStrips       = TIFFNumberOfStrips(tif);
+    if (stripBytes < 1 || numStrips < (totalBytes + stripBytes - 1) / stripBytes)
+      return false;
+
+    const size_t              firstStrip      = numStrips *  part      / numParts;
+    const size_t              endStrip        = numStrips * (part + 1) / numParts;
+    for (size_t iStrip = firstStrip; iStrip < endStrip; ++iStrip) {
+      const size_t            offset          = iStrip * stripBytes;
+      if (offset >= totalBytes)               break;
+      const size_t            expected        = std::min(stripBytes, totalBytes - offset);
+      const tmsize_t          numBytes        = TIFFReadEncodedStrip(tif, static_cast<tstrip_t>(iStrip), buffer + offset, static_cast<tmsize_t>(expected));
+      if (numBytes != static_cast<tmsize_t>(expected))
+        return false;
+    }
+    return true;
+  }
+
+  /// Tiles are stored in row-major order of the grid of tiles.
+  bool readTiles(unsigned char* buffer, const size_t part, const size_t numParts)
+  {
+    uint32                    tileWidth, tileHeight;
+    if (!TIFFGetField(tif, TIFFTAG_TILEWIDTH , &tileWidth ))  return false;
+    if (!TIFFGetField(tif, TIFFTAG_TILELENGTH, &tileHeight))  return false;
+    if (tileWidth < 1 || tileHeight < 1)                      return false;
+
+    const size_t              pixelBytes      = size_t(samplesPerPixel) * (bitsPerSample / 8);
+    const size_t              tileRowBytes    = tileWidth * pixelBytes;
+    const size_t              outRowBytes     = rowBytes();
+    const size_t              tilesAcross     = (width  + tileWidth  - 1) / tileWidth ;
+    const size_t              tilesDown       = (height + tileHeight - 1) / tileHeight;
+    const size_t              numTiles        = tilesAcross * tilesDown;
+    tileBuffer.resize(static_cast<size_t>(TIFFTileSize(tif)));
+
+    const size_t              firstTile       = numTiles *  part      / numParts;
+    const size_t              endTile         = numTiles * (part + 1) / numParts;
+    for (size_t iTile = firstTile; iTile < endTile; ++iTile) {
+      const uint32            x0              = static_cast<uint32>( (iTile % tilesAcross) * tileWidth  );
+      const uint32            y0              = static_cast<uint32>( (iTile / tilesAcross) * tileHeight );
+      if (TIFFReadTile(tif, tileBuffer.data(), x0, y0, 0, 0) < 0)
+        return false;
+
+      // Tiles at the right and bottom edges can extend past the image
+      const size_t            numRows         = std::min<size_t>(tileHeight, height - y0);
+      const size_t            numBytes        = std::min<size_t>(tileWidth , width  - x0) * pixelBytes;
+      for (size_t iRow = 0; iRow < numRows; ++iRow)
+        std::memcpy( buffer + (y0 + iRow) * outRowBytes + x0 * pixelBytes
+                   , tileBuffer.data() + iRow * tileRowBytes
+                   , numBytes
+                   );
+    }
+    return true;
+  }
+
+  bool fail()
+  {
+    close();
+    return false;
+  }
+
+private:
+  TiffFrameSource(const TiffFrameSource&);
+  TiffFrameSource& operator=(const TiffFrameSource&);
+};
+
+
+
+//_________________________________________________________________________
+/**
+  Decoding of pages by several TiffFrameSource handles to the same file at once, each of
+  which decompresses a contiguous share of the strips or tiles of every page. This only
+  applies to compressed files with a page index, and otherwise a single handle is used.
+  The calling thread decodes the first part of every page, and each additional handle is
+  served by a helper thread that persists until close(). This is intended for when there
+  are too few pages being read concurrently to otherwise keep all cores busy.
+*/
+class ParallelTiffSource
+{
+protected:
+  std::vector<TiffFrameSource*> sources;
+  WorkerThreads                 helpers;                ///< for parts 1, ..., sources.size()-1
+  std::mutex                    lock;
+  std::condition_variable       hasWork;
+  std::condition_variable       hasDone;
+  size_t                        generation;             ///< incremented for every page to be decoded
+  size_t                        numPending;             ///< helpers that have yet to finish the current page
+  bool                          stopping;
+  bool                          partsOK;
+  size_t                        jobPage;
+  size_t                        jobParts;
+  unsigned char*                jobData;
+
+public:
+  ParallelTiffSource() : generation(0), numPending(0), stopping(false), partsOK(true), jobPage(0), jobParts(0), jobData(0) { }
+  ~ParallelTiffSource() { close(); }
+
+  /// Opens up to numThreads handles (and numThreads-1 helper threads), returning false if not even one can be opened.
+  bool open(const char* path, const TiffIndex* pageIndex = 0, const int numThreads = 1)
+  {
+    close();
+    sources.push_back(new TiffFrameSource);
+    if (!sources[0]->open(path, pageIndex))
+      return false;
+
+    if (sources[0]->compression == COMPRESSION_NONE || !pageIndex || pageIndex->empty())
+      return true;
+    const size_t              maxSources      = std::min<size_t>(std::max(numThreads, 1), sources[0]->numChunks(0));
+    for (size_t iSource = 1; iSource < maxSources; ++iSource) {
+      sources.push_back(new TiffFrameSource);
+      if (!sources.back()->open(path, pageIndex)) {
+        delete sources.back();
+        sources.pop_back();
+        break;
+      }
+    }
+
+    stopping                  = false;
+    generation                = 0;
+    if (sources.size() > 1)
+      helpers.start(static_cast<int>(sources.size()) - 1, [this](int iHelper) { help(static_cast<size_t>(iHelper) + 1); });
+    return true;
+  }
+
+  void close()
+  {
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      stopping                = true;
+      hasWork.notify_all();
+    }
+    helpers.join();
+    for (size_t iSource = 0; iSource < sources.size(); ++iSource)
+      delete sources[iSource];
+    sources.clear();
+  }
+
+  bool        isOpen    () const  { return !sources.empty() && sources[0]->isOpen(); }
+  size_t      numPages  () const  { return sources[0]->numPages(); }
+  size_t      numHandles() const  { return sources.size(); }
+
+  /// Decodes the given page, (re)allocating image as necessary.
+  bool read(const size_t iPage, cv::Mat& image)
+  {
+    TiffFrameSource&          first           = *sources[0];
+    const size_t              numParts        = ( sources.size() > 1 ? std::min(sources.size(), first.numChunks(iPage)) : 1 );
+    if (numParts < 2)
+      return first.read(iPage, image);
+
+    image.create(first.height, first.width, first.type);
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      jobPage                 = iPage;
+      jobParts                = numParts;
+      jobData                 = image.data;
+      numPending              = numParts - 1;
+      partsOK                 = true;
+      ++generation;
+      hasWork.notify_all();
+    }
+
+    const bool                isOK            = first.read(iPage, image.data, 0, numParts);
+    std::unique_lock<std::mutex>  guard(lock);
+    while (numPending > 0)
+      hasDone.wait(guard);
+    return isOK && partsOK;
+  }
+
+  /// Image description of the current page (i.e. the last one read), or null if there is none.
+  const char* description() const { return sources[0]->description(); }
+
+protected:
+  /// Decodes part iPart of every page for which that part is needed, until close().
+  void help(const size_t iPart)
+  {
+    size_t                    lastGeneration  = 0;
+    std::unique_lock<std::mutex>  guard(lock);
+    while (true) {
+      while (!stopping && generation == lastGeneration)
+        hasWork.wait(guard);
+      if (stopping)           return;
+      lastGeneration          = generation;
+      if (iPart >= jobParts)  continue;
+
+      const size_t            iPage           = jobPage;
+      const size_t            numParts        = jobParts;
+      unsigned char*          data            = jobData;
+      guard.unlock();
+      bool                    isOK            = false;
+      try                     { isOK = sources[iPart]->read(iPage, data, iPart, numParts); }
+      catch (...)             { }
+      guard.lock();
+
+      if (!isOK)              partsOK         = false;
+      if (--numPending == 0)  hasDone.notify_all();
+    }
+  }
+
+private:
+  ParallelTiffSource(const ParallelTiffSource&);
+  ParallelTiffSource& operator=(const ParallelTiffSource&);
+};
+
+
+#endif //TIFFFRAMES_H
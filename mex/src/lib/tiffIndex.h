@@ -0,0 +1,419 @@
+/**
+  Index of the directory structure of TIFF files, for random access to frames.
+
+  Locating a given page of a TIFF file normally requires following the chain of image
+  file directories (IFDs) from the start of the file, i.e. one seek per page. TiffIndex
+  records the IFD offset and pixel data layout of every page the first time a file is
+  scanned, and saves this to a sidecar file (<file>.idx) so that subsequent accesses can
+  seek directly to any page. The sidecar is ignored if the size or modification time of
+  the TIFF file has changed since. If the sidecar cannot be written (e.g. read-only
+  storage), the index is simply rebuilt as needed. Sidecars are written to a temporary
+  file that is then renamed, so that concurrent writers (e.g. parallel workers indexing
+  the same file) never produce a corrupted sidecar.
+
+  The location of sidecars can be changed via the TIFF_INDEX_DIR environment variable
+  (e.g. setenv() in Matlab). If this is a directory, sidecars are stored there instead of
+  next to the data, with names derived from the full path of each TIFF file. If it is set
+  to an empty string, sidecars are neither read nor written.
+
+  The index also records whether the pixel data of each page lies entirely within the
+  file, and whether the chain of directories ends properly, so that files that have been
+  truncated (e.g. by a crash during acquisition) can be read up to the last intact page.
+*/
+
+
+#ifndef TIFFINDEX_H
+#define TIFFINDEX_H
+
+#include <vector>
+#include <string>
+#include <thread>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+#include <functional>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <tiffio.h>
+
+#ifdef _WIN32
+#  include <process.h>
+#  define TIFFINDEX_GETPID    _getpid
+#else
+#  include <unistd.h>
+#  define TIFFINDEX_GETPID    getpid
+#endif
+
+
+
+/**
+  Returns the byte offset in the file of the pixel data for the current directory, or
+  0 if the layout is not one that can be read directly, i.e. it must be uncompressed,
+  untiled, single-channel, in native byte order, with all strips stored contiguously.
+*/
+inline uint64_t contiguousPixelOffset(TIFF* tif)
+{
+  if (TIFFIsTiled(tif) || TIFFIsByteSwapped(tif))
+    return 0;
+
+  uint16                      compression, samplesPerPixel, bitsPerSample;
+  uint32                      width, height;
+  if (!TIFFGetFieldDefaulted(tif, TIFFTAG_COMPRESSION    , &compression    ) || compression != COMPRESSION_NONE)
+    return 0;
+  if (!TIFFGetFieldDefaulted(tif, TIFFTAG_SAMPLESPERPIXEL, &samplesPerPixel) || samplesPerPixel != 1)
+    return 0;
+  if (!TIFFGetFieldDefaulted(tif, TIFFTAG_BITSPERSAMPLE  , &bitsPerSample  ) || bitsPerSample % 8 != 0)
+    return 0;
+  if (!TIFFGetField(tif, TIFFTAG_IMAGEWIDTH , &width ))   return 0;
+  if (!TIFFGetField(tif, TIFFTAG_IMAGELENGTH, &height))   return 0;
+
+  // All strips must directly follow one another and have the expected total size
+  toff_t*                     offsets         = 0;
+  toff_t*                     byteCounts      = 0;
+  if (!TIFFGetField(tif, TIFFTAG_STRIPOFFSETS   , &offsets   ) || !offsets   )  return 0;
+  if (!TIFFGetField(tif, TIFFTAG_STRIPBYTECOUNTS, &byteCounts) || !byteCounts)  return 0;
+
+  const tstrip_t              numStrips       = TIFFNumberOfStrips(tif);
+  uint64_t                    numBytes        = 0;
+  for (tstrip_t iStrip = 0; iStrip < numStrips; ++iStrip) {
+    if (offsets[iStrip] != offsets[0] + numBytes)
+      return 0;
+    numBytes                 += byteCounts[iStrip];
+  }
+  if (numBytes != uint64_t(width) * height * (bitsPerSample / 8))
+    return 0;
+
+  // Require alignment so that pixels can be accessed in place
+  if (offsets[0] < 1 || offsets[0] % (bitsPerSample / 8) != 0)
+    return 0;
+  return offsets[0];
+}
+
+
+/// How the sample format returned by tiffSampleFormat() was determined.
+enum SampleFormatSource
+{
+  SAMPLEFORMAT_FROM_TAG,
+  SAMPLEFORMAT_FROM_MINVALUE,
+  SAMPLEFORMAT_FROM_BITS,
+};
+
+/**
+  Returns the sample format (SAMPLEFORMAT_UINT, _INT or _IEEEFP) of the current directory.
+  If the SampleFormat tag is absent, data with 32 or more bits per sample is taken to be
+  floating point, and otherwise integers that are signed if the SMinSampleValue tag is
+  negative.
+*/
+inline uint16 tiffSampleFormat(TIFF* tif, SampleFormatSource* source = 0)
+{
+  uint16                      sampleFormat, bitsPerSample;
+  if (TIFFGetField(tif, TIFFTAG_SAMPLEFORMAT, &sampleFormat)) {
+    if (source)               *source         = SAMPLEFORMAT_FROM_TAG;
+    return sampleFormat;
+  }
+
+  double                      minValue        = 0;
+  const bool                  hasMinValue     = ( TIFFGetField(tif, TIFFTAG_SMINSAMPLEVALUE, &minValue) != 0 );
+  if (source)                 *source         = ( hasMinValue ? SAMPLEFORMAT_FROM_MINVALUE : SAMPLEFORMAT_FROM_BITS );
+
+  TIFFGetFieldDefaulted(tif, TIFFTAG_BITSPERSAMPLE, &bitsPerSample);
+  if (bitsPerSample >= 32)    return SAMPLEFORMAT_IEEEFP;
+  return ( minValue < 0 ? SAMPLEFORMAT_INT : SAMPLEFORMAT_UINT );
+}
+
+
+/**
+  Size and modification time of a file, used to detect stale indices.
+*/
+inline bool getFileStamp(const char* path, uint64_t& fileSize, int64_t& modTime)
+{
+#ifdef _WIN32
+  struct __stat64             info;
+  if (_stat64(path, &info) != 0)            return false;
+#else
+  struct stat                 info;
+  if (stat(path, &info) != 0)               return false;
+#endif
+  fileSize                    = static_cast<uint64_t>(info.st_size);
+  modTime                     = static_cast<int64_t >(info.st_mtime);
+  return true;
+}
+
+
+
+//_________________________________________________________________________
+/**
+  Location and layout of a single TIFF page. sampleFormat is as given by tiffSampleFormat().
+*/
+struct TiffPage
+{
+  uint64_t                    ifdOffset;      ///< offset of the image file directory
+  uint64_t                    dataOffset;     ///< offset of the first strip of pixel data
+  uint64_t                    dataBytes;      ///< total size of all strips
+  uint32_t                    width;
+  uint32_t                    height;
+  uint16_t                    bitsPerSample;
+  uint16_t                    sampleFormat;
+  uint16_t                    compression;
+  uint16_t                    contiguous;     ///< nonzero if contiguousPixelOffset() applies
+  uint16_t                    intact;         ///< nonzero if all strips lie within the file and have the expected size
+};
+
+
+//_________________________________________________________________________
+/**
+  Per-page index of a TIFF file. Use build() to load it from the sidecar if available, or
+  otherwise scan the file; seek() then positions a TIFF handle at any page in O(1).
+*/
+class TiffIndex
+{
+protected:
+  struct Header
+  {
+    char                      magic[8];
+    uint32_t                  version;
+    uint32_t                  pageSize;
+    uint64_t                  fileSize;
+    int64_t                   modTime;
+    uint64_t                  numPages;
+    uint64_t                  complete;
+  };
+
+  static const char*          MAGIC()         { return "ECSTIDX";  }
+  static const uint32_t       VERSION         = 3;
+
+public:
+  std::vector<TiffPage>       pages;
+  bool                        complete;       ///< false if the chain of directories is broken, i.e. pages may be missing
+
+public:
+  TiffIndex() : complete(false) { }
+
+public:
+  size_t          numPages() const                { return pages.size(); }
+  bool            empty   () const                { return pages.empty(); }
+  const TiffPage& operator[](const size_t iPage) const  { return pages[iPage]; }
+
+  /**
+    Path of the sidecar for the given TIFF file, which is empty if sidecars are disabled.
+    See TIFF_INDEX_DIR in the description above.
+  */
+  static std::string sidecarPath(const char* path)
+  {
+    const char*               directory       = std::getenv("TIFF_INDEX_DIR");
+    if (!directory)           return std::string(path) + ".idx";
+    if (!*directory)          return std::string();
+
+    // Sidecars for files with the same name in different directories are distinguished by a hash of the path
+    uint64_t                  hash            = 14695981039346656037ULL;      // FNV-1a
+    for (const char* next = path; *next; ++next)
+      hash                    = (hash ^ static_cast<unsigned char>(*next)) * 1099511628211ULL;
+
+    const char*               name            = path;
+    for (const char* next = path; *next; ++next)
+      if (*next == '/' || *next == '\\')
+        name                  = next + 1;
+
+    char                      prefix[20];
+    std::snprintf(prefix, sizeof(prefix), "%016llx_", static_cast<unsigned long long>(hash));
+    std::string               sidecar         ( directory );
+    if (sidecar[sidecar.size() - 1] != '/' && sidecar[sidecar.size() - 1] != '\\')
+      sidecar                += '/';
+    return sidecar + prefix + name + ".idx";
+  }
+
+  /**
+    Loads the index for the given file from its sidecar, or if this is missing or stale,
+    scans the file and attempts to save the sidecar. If provided, tif must be positioned
+    at the first directory, and is returned in the same state.
+  */
+  bool build(const char* path, TIFF* tif = 0)
+  {
+    uint64_t                  fileSize;
+    int64_t                   modTime;
+    if (!getFileStamp(path, fileSize, modTime))
+      return false;
+    const std::string         sidecar         = sidecarPath(path);
+    if (!sidecar.empty() && load(sidecar.c_str(), fileSize, modTime))
+      return true;
+
+    // Scan either the provided handle or a temporary one
+    if (tif) {
+      scan(tif);
+      TIFFSetDirectory(tif, 0);
+    }
+    else {
+      TIFF*                   temp            = TIFFOpen(path, "r");
+      if (temp == NULL)       return false;
+      scan(temp);
+      TIFFClose(temp);
+    }
+    if (pages.empty())        return false;
+
+    if (!sidecar.empty())
+      save(sidecar, fileSize, modTime);
+    return true;
+  }
+
+  /// Positions the given TIFF handle at the specified page.
+  bool seek(TIFF* tif, const size_t iPage) const
+  {
+    return iPage < pages.size() && TIFFSetSubDirectory(tif, pages[iPage].ifdOffset);
+  }
+
+  /// True if all pages have the same dimensions and sample format.
+  bool isUniform() const
+  {
+    for (size_t iPage = 1; iPage < pages.size(); ++iPage) {
+      const TiffPage&         page            = pages[iPage];
+      if ( page.width         != pages[0].width
+        || page.height        != pages[0].height
+        || page.bitsPerSample != pages[0].bitsPerSample
+        || page.sampleFormat  != pages[0].sampleFormat
+         )
+        return false;
+    }
+    return true;
+  }
+
+  /// Number of pages up to (but excluding) the first one that is not intact.
+  size_t numIntact() const
+  {
+    size_t                    iPage           = 0;
+    while (iPage < pages.size() && pages[iPage].intact)
+      ++iPage;
+    return iPage;
+  }
+
+  /// True if the pixel data of all pages can be accessed without decoding.
+  bool isContiguous() const
+  {
+    for (size_t iPage = 0; iPage < pages.size(); ++iPage)
+      if (!pages[iPage].contiguous)
+        return false;
+    return !pages.empty();
+  }
+
+
+  /// Walks the chain of directories starting from the current one.
+  void scan(TIFF* tif)
+  {
+    const uint64_t            fileSize        = static_cast<uint64_t>( TIFFGetSizeProc(tif)(TIFFClientdata(tif)) );
+    pages.clear();
+    complete                  = false;
+    do {
+      TiffPage                page;
+      std::memset(&page, 0, sizeof(page));
+      page.ifdOffset          = TIFFCurrentDirOffset(tif);
+      TIFFGetField         (tif, TIFFTAG_IMAGEWIDTH   , &page.width        );
+      TIFFGetField         (tif, TIFFTAG_IMAGELENGTH  , &page.height       );
+      TIFFGetFieldDefaulted(tif, TIFFTAG_BITSPERSAMPLE, &page.bitsPerSample);
+      TIFFGetFieldDefaulted(tif, TIFFTAG_COMPRESSION  , &page.compression  );
+      page.sampleFormat       = tiffSampleFormat(tif);
+
+      toff_t*                 offsets         = 0;
+      toff_t*                 byteCounts      = 0;
+      if ( TIFFGetField(tif, TIFFTAG_STRIPOFFSETS   , &offsets   ) && offsets
+        && TIFFGetField(tif, TIFFTAG_STRIPBYTECOUNTS, &byteCounts) && byteCounts
+         ) {
+        page.dataOffset       = offsets[0];
+        page.intact           = 1;
+        const tstrip_t        numStrips       = ( TIFFIsTiled(tif) ? TIFFNumberOfTiles(tif) : TIFFNumberOfStrips(tif) );
+        for (tstrip_t iStrip = 0; iStrip < numStrips; ++iStrip) {
+          page.dataBytes     += byteCounts[iStrip];
+          if (byteCounts[iStrip] < 1 || offsets[iStrip] + byteCounts[iStrip] > fileSize)
+            page.intact       = 0;
+        }
+
+        // Uncompressed data must have exactly the size implied by the image dimensions
+        uint16                samplesPerPixel = 1;
+        TIFFGetFieldDefaulted(tif, TIFFTAG_SAMPLESPERPIXEL, &samplesPerPixel);
+        if ( page.compression == COMPRESSION_NONE && !TIFFIsTiled(tif)
+          && page.dataBytes < uint64_t(page.width) * page.height * samplesPerPixel * (page.bitsPerSample / 8)
+           )
+          page.intact         = 0;
+      }
+      page.contiguous         = ( contiguousPixelOffset(tif) > 0 );
+
+      pages.push_back(page);
+
+      // Otherwise the next directory is referenced but could not be read
+      if (TIFFLastDirectory(tif)) {
+        complete              = true;
+        break;
+      }
+    } while (TIFFReadDirectory(tif));
+  }
+
+protected:
+  bool load(const char* sidecar, const uint64_t fileSize, const int64_t modTime)
+  {
+    FILE*                     file            = std::fopen(sidecar, "rb");
+    if (!file)                return false;
+
+    Header                    header;
+    bool                      isValid         = ( std::fread(&header, sizeof(header), 1, file) == 1
+                                                && std::strncmp(header.magic, MAGIC(), sizeof(header.magic)) == 0
+                                                && header.version  == VERSION
+                                                && header.pageSize == sizeof(TiffPage)
+                                                && header.fileSize == fileSize
+                                                && header.modTime  == modTime
+                                                && header.numPages >  0
+                                                );
+    complete                  = ( isValid && header.complete != 0 );
+    if (isValid) {
+      pages.resize(static_cast<size_t>(header.numPages));
+      isValid                 = ( std::fread(pages.data(), sizeof(TiffPage), pages.size(), file) == pages.size() );
+    }
+    std::fclose(file);
+
+    if (!isValid)             pages.clear();
+    return isValid;
+  }
+
+  bool save(const std::string& sidecar, const uint64_t fileSize, const int64_t modTime) const
+  {
+    // The temporary file is unique to this process and thread
+    char                      suffix[64];
+    std::snprintf(suffix, sizeof(suffix), ".%d.%llx.tmp", static_cast<int>(TIFFINDEX_GETPID())
+                 , static_cast<unsigned long long>(std::hash<std::thread::id>()(std::this_thread::get_id()))
+                 );
+    const std::string         temp            = sidecar + suffix;
+    FILE*                     file            = std::fopen(temp.c_str(), "wb");
+    if (!file)                return false;
+
+    Header                    header;
+    std::memset(&header, 0, sizeof(header));
+    std::strncpy(header.magic, MAGIC(), sizeof(header.magic));
+    header.version            = VERSION;
+    header.pageSize           = sizeof(TiffPage);
+    header.fileSize           = fileSize;
+    header.modTime            = modTime;
+    header.numPages           = pages.size();
+    header.complete           = ( complete ? 1 : 0 );
+
+    const bool                isWritten       = ( std::fwrite(&header, sizeof(header), 1, file) == 1
+                                                && std::fwrite(pages.data(), sizeof(TiffPage), pages.size(), file) == pages.size()
+                                                );
+    const bool                isClosed        = ( std::fclose(file) == 0 );
+    if (!isWritten || !isClosed) {
+      std::remove(temp.c_str());
+      return false;
+    }
+
+    // Readers see either the old or the new sidecar in its entirety; on Windows rename() 
+    // does not replace existing files, in which case readers briefly see none at all
+#ifdef _WIN32
+    std::remove(sidecar.c_str());
+#endif
+    if (std::rename(temp.c_str(), sidecar.c_str()) != 0) {
+      std::remove(temp.c_str());
+      return false;
+    }
+    return true;
+  }
+};
+
+
+#endif //TIFFINDEX_H
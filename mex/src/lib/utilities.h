@@ -563,6 +563,46 @@ public:
       if (img[iPix] > maximum[iPix])  maximum[iPix] = img[iPix];
     }
   }
+
+  /**
+    Same as add() but restricted to pixels [firstPix, endPix), so that disjoint ranges can be accumulated in parallel.
+    Pixel iPix of img is accumulated into entry offset + iPix, e.g. to keep statistics for several channels.
+  */
+  template<typename Pixel>
+  void addRange(const Pixel* img, const int firstPix, const int endPix, const int offset = 0)
+  {
+    for (int iPix = firstPix; iPix < endPix; ++iPix)
+    {
+      if (img[iPix] != img[iPix])   continue;
+
+      const int         iStat   = offset + iPix;
+      ++(numEntries[iStat]);
+      const double      delta   = img[iPix] - mean[iStat];
+      mean[iStat]      += delta / numEntries[iStat];
+      M2[iStat]        += delta * (img[iPix] - mean[iStat]);
+
+      if (img[iPix] < minimum[iStat])  minimum[iStat] = img[iPix];
+      if (img[iPix] > maximum[iStat])  maximum[iStat] = img[iPix];
+    }
+  }
+
+  /// Accumulates all numSamples values of the contiguous time trace of pixel iPix, e.g. of a pixel-major stack.
+  template<typename Pixel>
+  void addTrace(const Pixel* trace, const int iPix, const size_t numSamples)
+  {
+    for (size_t iSample = 0; iSample < numSamples; ++iSample)
+    {
+      if (trace[iSample] != trace[iSample])   continue;
+
+      ++(numEntries[iPix]);
+      const double      delta   = trace[iSample] - mean[iPix];
+      mean[iPix]       += delta / numEntries[iPix];
+      M2[iPix]         += delta * (trace[iSample] - mean[iPix]);
+
+      if (trace[iSample] < minimum[iPix])  minimum[iPix] = trace[iSample];
+      if (trace[iSample] > maximum[iPix])  maximum[iPix] = trace[iSample];
+    }
+  }
   ///@}
 };
 
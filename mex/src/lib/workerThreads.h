@@ -0,0 +1,180 @@
+/**
+  Minimal threading utilities for producer/consumer pipelines in MEX programs.
+
+  N.B. The Matlab API is not thread-safe, so none of the mx*() or mex*() functions
+  should be called from within worker threads. Errors should instead be recorded
+  via WorkerThreads::fail() and reported by the main thread after join().
+*/
+
+
+#ifndef WORKERTHREADS_H
+#define WORKERTHREADS_H
+
+#include <deque>
+#include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <exception>
+#include <condition_variable>
+
+
+
+/**
+  Number of threads to use by default, i.e. the number of hardware cores.
+*/
+inline int defaultNumThreads()
+{
+  const unsigned int          numCores        = std::thread::hardware_concurrency();
+  return ( numCores > 0 ? static_cast<int>(numCores) : 1 );
+}
+
+
+/**
+  Thread-safe first-in-first-out queue with a maximum capacity. push() blocks while
+  the queue is full, and pop() blocks while the queue is empty. After close() has
+  been called, push() always fails and pop() fails once the queue has been drained.
+*/
+template<typename Item>
+class BoundedQueue
+{
+protected:
+  std::deque<Item>            items;
+  const size_t                capacity;
+  bool                        closed;
+  std::mutex                  lock;
+  std::condition_variable     notFull;
+  std::condition_variable     notEmpty;
+
+public:
+  BoundedQueue(const size_t capacity)
+    : capacity(capacity > 0 ? capacity : 1)
+    , closed  (false)
+  { }
+
+  bool push(const Item& item)
+  {
+    std::unique_lock<std::mutex>  guard(lock);
+    while (!closed && items.size() >= capacity)
+      notFull.wait(guard);
+    if (closed)               return false;
+
+    items.push_back(item);
+    notEmpty.notify_one();
+    return true;
+  }
+
+  /// As push(), but fails instead of blocking if the queue is full.
+  bool tryPush(const Item& item)
+  {
+    std::lock_guard<std::mutex>   guard(lock);
+    if (closed || items.size() >= capacity)
+      return false;
+
+    items.push_back(item);
+    notEmpty.notify_one();
+    return true;
+  }
+
+  bool pop(Item& item)
+  {
+    std::unique_lock<std::mutex>  guard(lock);
+    while (!closed && items.empty())
+      notEmpty.wait(guard);
+    if (items.empty())        return false;
+
+    item                      = items.front();
+    items.pop_front();
+    notFull.notify_one();
+    return true;
+  }
+
+  void close()
+  {
+    std::lock_guard<std::mutex>   guard(lock);
+    closed                    = true;
+    notFull.notify_all();
+    notEmpty.notify_all();
+  }
+
+  bool isClosed()
+  {
+    std::lock_guard<std::mutex>   guard(lock);
+    return closed;
+  }
+};
+
+
+/**
+  Group of threads that each execute work(iThread), for iThread = 0, ..., numThreads-1.
+  Exceptions thrown by the work function are caught and recorded, with only the first
+  error message retained for reporting.
+*/
+class WorkerThreads
+{
+protected:
+  std::vector<std::thread>    threads;
+  std::mutex                  lock;
+  std::string                 message;
+  std::atomic<bool>           hasFailed;
+
+public:
+  WorkerThreads() : hasFailed(false) { }
+  ~WorkerThreads() { join(); }
+
+  template<typename Function>
+  void start(const int numThreads, Function work)
+  {
+    threads.reserve(threads.size() + numThreads);
+    for (int iThread = 0; iThread < numThreads; ++iThread)
+      threads.push_back(std::thread(&WorkerThreads::run<Function>, this, work, iThread));
+  }
+
+  void join()
+  {
+    for (size_t iThread = 0; iThread < threads.size(); ++iThread)
+      if (threads[iThread].joinable())
+        threads[iThread].join();
+    threads.clear();
+  }
+
+  size_t size() const { return threads.size(); }
+
+  void fail(const std::string& what)
+  {
+    std::lock_guard<std::mutex>   guard(lock);
+    if (!hasFailed)           message = what;
+    hasFailed                 = true;
+  }
+  bool failed() const { return hasFailed; }
+  const std::string& error() const { return message; }
+
+protected:
+  template<typename Function>
+  void run(Function work, const int iThread)
+  {
+    try                             { work(iThread); }
+    catch (const std::exception& e) { fail(e.what()); }
+    catch (...)                     { fail("Unknown exception in worker thread."); }
+  }
+};
+
+
+/**
+  Convenience function to execute work(iThread) in numThreads threads and wait for all
+  of them to complete. Returns false and sets error if any of the threads failed.
+*/
+template<typename Function>
+bool runThreads(const int numThreads, Function work, std::string* error = 0)
+{
+  WorkerThreads               workers;
+  workers.start(numThreads > 0 ? numThreads : 1, work);
+  workers.join();
+  if (workers.failed() && error)
+    *error                    = workers.error();
+  return !workers.failed();
+}
+
+
+#endif //WORKERTHREADS_H
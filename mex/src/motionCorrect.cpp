@@ -9,32 +9,81 @@
                           , [preferSmallestShifts = false]                                ...
                           , [methodInterp = cve.InterpolationFlags.INTER_LINEAR]          ...
                           , [methodCorr = cve.TemplateMatchModes.TM_CCOEFF_NORMED]        ...
-                          , [emptyValue = mean]                                           ...
+                          , [emptyValue = mean], [numThreads = number of cores]           ...
+                          , [pyramidLevels = 0], [streamFrames = false]                   ...
+                          , [metricStorage = []]                                          ...
                           );
     mc  = cv.motionCorrect( {input, template}, ... );
 
-  The median image is used as the template to which frames are aligned, except for 
-  a border of maxShift pixels in size which is omitted since it is possible for 
+  The median image is used as the template to which frames are aligned, except for
+  a border of maxShift pixels in size which is omitted since it is possible for
   motion correction to crop up to that much of the frame.
 
-  The medianRebin parameter can be used to specify that the median should be computed 
+  The medianRebin parameter can be used to specify that the median should be computed
   using this number of frames per data point, instead of all frames. This can help
-  reduce the amount of time required to motion correct, and also to obtain a sensible 
+  reduce the amount of time required to motion correct, and also to obtain a sensible
   template for data that is very noisy or close to zero per frame.
 
   The frameSkip parameter allows one to subsample the input movie in terms of frames.
   It should be provided as a pair [offset, skip] where offset is the first frames to
-  skip, and skip is the number of frames to skip between reads. For example, 
-  frameSkip = [1 1] will start reading from the *second* frame and skip every other 
+  skip, and skip is the number of frames to skip between reads. For example,
+  frameSkip = [1 1] will start reading from the *second* frame and skip every other
   frame, i.e. read all even frames for motion correction. The produced shifts will
   thus be fewer than the full movie and equal to the number of subsampled frames.
 
+  Within each iteration, frames are registered to the template in parallel by numThreads
+  threads. Each median bin (of medianRebin consecutive frames) is processed in its entirety
+  by a single thread, so that the results do not depend on the number of threads. Frames
+  are registered serially if displayProgress is true.
+
+  In addition to the cv::matchTemplate() modes, methodCorr can be
+  cve.TemplateMatchModes.TM_PHASE_CORR to register frames by phase correlation. This
+  costs O(N log N) per frame of N pixels regardless of maxShift, and is therefore much
+  faster for large shifts. The Fourier transform of the template is computed once per
+  iteration, and sub-pixel shifts are resolved to 1/16 of a pixel by upsampling the
+  correlation around its peak (instead of a Gaussian fit). The metric values are then
+  the phase correlation (at most 1) for each shift.
+
+  For large maxShift, pyramidLevels > 0 enables a coarse-to-fine search: frames and the
+  template are downsampled by up to pyramidLevels successive factors of 2, the full range
+  of shifts is searched only at the coarsest level, and the optimum is refined within a
+  window of +/- 2 pixels at each finer level. Only the metric values in the final window
+  around the optimum are then computed, and the rest of metric.values is set to NaN.
+  If preferSmallestShifts is true, the local optimum is selected at the coarsest level.
+  This option has no effect for phase correlation, the cost of which does not depend on
+  maxShift.
+
+  For the cv::matchTemplate() modes, the statistics and Fourier transform of the template
+  are computed once per iteration instead of for every frame, and the normalization of
+  each frame uses integral images (see lib/templateMatch.h). The metric values are the
+  same as those of cv::matchTemplate() up to rounding.
+
+  For long movies, memory usage can be made independent of the number of frames (apart
+  from the shifts and medianRebin-binned template accumulators) as follows:
+  - streamFrames = true decodes compressed TIFF input from disk in every iteration,
+    instead of holding the decoded stack in memory. Uncompressed TIFF files are always
+    accessed via memory mapping and so are never loaded in their entirety.
+  - metricStorage = N (a number) only keeps metric.values for every N-th frame, starting
+    from the first (N = inf to keep none). The stored frames are indicated by the
+    metric.stride field.
+  - metricStorage = path (a string) writes metric.values to a raw file of single precision
+    values with the same layout as the in-memory array, i.e. that can be read back with
+    reshape(fread(fid, inf, '*single'), 2*maxShift+1, 2*maxShift+1, []). metric.values
+    is then set to the path.
+
+  If the input file has been truncated, e.g. because the acquisition crashed, only the
+  frames up to the last intact page are motion corrected, with a warning.
+
   Author:   Sue Ann Koay (koay@princeton.edu)
 */
 
 
 #include <cmath>
+#include <mutex>
+#include <atomic>
+#include <cstdio>
 #include <vector>
+#include <algorithm>
 #include <opencv2/imgcodecs.hpp>
 #include <opencv2/imgproc.hpp>
 #include <opencv2/highgui.hpp>
@@ -44,6 +93,13 @@
 #include "lib/manipulateImage.h"
 #include "lib/conversionUtils.h"
 #include "lib/cvToMatlab.h"
+#include "lib/mappedTiff.h"
+#include "lib/readAhead.h"
+#include "lib/tiffFrames.h"
+#include "lib/workerThreads.h"
+#include "lib/phaseCorrelation.h"
+#include "lib/templatePyramid.h"
+#include "lib/templateMatch.h"
 
 
 
@@ -69,50 +125,24 @@ static const char*    METHOD_CORR[]   = { "squaredDifference"
                                         , "crossCorrNormed"
                                         , "correlationCoeff"
                                         , "corrCoeffNormed"
+                                        , "phaseCorrelation"
                                         };
 
+/// Registration by phase correlation, in addition to the cv::TemplateMatchModes
+static const int      METHOD_PHASE_CORR = 6;
 
 
-#ifndef __OPENCV_HACK_SAK__
-template<typename Pixel, typename SignedPix>
-struct GetSignedUnsignedRange {
-  void operator()(const cv::Mat& image, double& signedRange, double& unsignedRange) 
-  {
-    // Loop over each pixel in the image 
-    double            minUnsigned = std::numeric_limits<double>::max();
-    double            maxUnsigned = std::numeric_limits<double>::lowest();
-    double            minSigned   = std::numeric_limits<double>::max();
-    double            maxSigned   = std::numeric_limits<double>::lowest();
-    for (int iRow = 0; iRow < image.rows; ++iRow) {
-      const Pixel*    pixRow      = image.ptr<Pixel>(iRow);
-      for (int iCol = 0; iCol < image.cols; ++iCol) {
-        double        unsignedPix = pixRow[iCol];
-        minUnsigned   = std::min(minUnsigned, unsignedPix);
-        maxUnsigned   = std::max(maxUnsigned, unsignedPix);
-
-        double        signedPix   = static_cast<SignedPix>(pixRow[iCol]);
-        minSigned     = std::min(minSigned, signedPix);
-        maxSigned     = std::max(maxSigned, signedPix);
-      } // end loop over columns
-    } // end loop over rows
-
-    unsignedRange     = maxUnsigned - minUnsigned;
-    signedRange       = maxSigned   - minSigned  ;
-  }
-};
 
-
-void typecastCVData(std::vector<cv::Mat>& imgStack, std::vector<cv::Mat>& origStack, int targetType)
+/// Squared radius of each metric pixel from the center, for finding local optima.
+void computeRadius2(std::vector<double>& radius2, const int metricRows, const int metricCols)
 {
-  origStack.swap(imgStack);
-  imgStack.reserve(origStack.size());
-
-  for (size_t iFrame = 0; iFrame < origStack.size(); ++iFrame) {
-    imgStack.push_back(cv::Mat(origStack[iFrame].size(), targetType, (void*) origStack[iFrame].data));
+  radius2.resize(metricRows * metricCols);
+  for (int row = 0, index = 0; row < metricRows; ++row) {
+    const double        dRow2           = sqr( row - 0.5*metricRows );
+    for (int col = 0; col < metricCols; ++col, ++index)
+      radius2[index]    = dRow2 + sqr( col - 0.5*metricCols );
   }
 }
-#endif //__OPENCV_HACK_SAK__
-
 
 
 typedef   bool (*Comparator)(float, float);
@@ -155,15 +185,142 @@ void findLocalOptimum(const cv::Mat& metric, const std::vector<double>& radius2,
 
 
 
+//_________________________________________________________________________
+/**
+  Destination of the metric values of all frames: either an array in memory with one
+  slice per stride-th frame, or a raw file with one slice per frame. Slices are in the
+  column-major layout of Matlab arrays. store() can be called concurrently by any number
+  of threads.
+*/
+class MetricStore
+{
+protected:
+  float*                      values;
+  size_t                      frameValues;
+  size_t                      stride;
+  FILE*                       file;
+  bool                        isGood;
+  std::mutex                  lock;
+  MatToMatlab<float,float>    copier;
+
+public:
+  MetricStore() : values(0), frameValues(0), stride(1), file(0), isGood(true) { }
+  ~MetricStore() { close(); }
+
+  /// Stores the slices of every stride-th frame in values, or none if values is null.
+  void setMemory(float* values, const size_t frameValues, const size_t stride)
+  {
+    this->values              = values;
+    this->frameValues         = frameValues;
+    this->stride              = stride;
+  }
+
+  /// Stores the slices of all frames in a file at path, returning false if it cannot be created.
+  bool openFile(const char* path, const size_t frameValues)
+  {
+    this->frameValues         = frameValues;
+    file                      = std::fopen(path, "wb");
+    return file != 0;
+  }
+
+  /// Returns false if any write to file has failed.
+  bool close()
+  {
+    if (file && std::fclose(file) != 0)
+      isGood                  = false;
+    file                      = 0;
+    return isGood;
+  }
+
+  bool good() const { return isGood; }
+
+  /// Stores the metric values for frame iFrame, where buffer is temporary storage for the calling thread.
+  void store(const size_t iFrame, const cv::Mat& metric, std::vector<float>& buffer)
+  {
+    if (file) {
+      buffer.resize(frameValues);
+      copier(metric, CV_32F, buffer.data());
+
+      const uint64_t          offset          = static_cast<uint64_t>(iFrame) * frameValues * sizeof(float);
+      std::lock_guard<std::mutex> guard(lock);
+#ifdef _WIN32
+      if ( _fseeki64(file, static_cast<__int64>(offset), SEEK_SET) != 0
+#else
+      if ( fseeko(file, static_cast<off_t>(offset), SEEK_SET) != 0
+#endif
+        || std::fwrite(buffer.data(), sizeof(float), frameValues, file) != frameValues
+         )
+        isGood                = false;
+    }
+    else if (values && iFrame % stride == 0)
+      copier(metric, CV_32F, values + (iFrame / stride) * frameValues);
+  }
+
+private:
+  MetricStore(const MetricStore&);
+  MetricStore& operator=(const MetricStore&);
+};
+
+
+//_________________________________________________________________________
+/// Per-thread temporary storage for registering frames, and the range of shifts found by that thread.
+struct RegisterScratch
+{
+  TiffFrameSource             source;                   ///< for streamed input
+  cv::Mat                     frmRaw;                   ///< decoded frame, for streamed input
+  std::vector<float>          metricBuffer;
+  int                         failedFrame;              ///< frame that could not be decoded, or -1
+  cv::Mat                     frmInput;
+  cv::Mat                     frmTemp;
+  cv::Mat                     metric;
+  cv::Mat                     translator;
+  PhaseCorrelation::Scratch   phase;
+  TemplatePyramid::Scratch    pyramid;
+  TemplateMatch::Scratch      match;
+  float*                      xTrans;
+  float*                      yTrans;
+
+  double                      minXShift, maxXShift;
+  double                      minYShift, maxYShift;
+  double                      maxRelShift;
+
+  /// Allocates buffers; this is not done in a constructor because copies of cv::Mat share data.
+  void create(const int rows, const int cols, const int metricRows, const int metricCols)
+  {
+    frmInput  .create(rows, cols, CV_32F);
+    frmTemp   .create(rows, cols, CV_32F);
+    metric    .create(metricRows, metricCols, CV_32F);
+    translator.create(2, 3, CV_32F);
+
+    // Translation matrix, for use with sub-pixel registration
+    xTrans                    = translator.ptr<float>(0);
+    yTrans                    = translator.ptr<float>(1);
+    translator                = cv::Scalar(0);
+    xTrans[0]                 = 1;
+    yTrans[1]                 = 1;
+    reset();
+  }
+
+  void reset()
+  {
+    minXShift                 = minYShift     =  1e308;
+    maxXShift                 = maxYShift     = -1e308;
+    maxRelShift               = -1e308;
+    failedFrame               = -1;
+  }
+};
+
+
+
 ///////////////////////////////////////////////////////////////////////////
 // Main entry point to a MEX function
 ///////////////////////////////////////////////////////////////////////////
 
 
 void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
-{  
+{ 
   // Check inputs to mex function
-  if (nrhs < 3 || nrhs > 13 || nlhs < 1 || nlhs > 2) {
+  if (nrhs < 3 || nrhs > 17 || nlhs < 1 || nlhs > 2) {
     mexEvalString("help cv.motionCorrect");
     mexErrMsgIdAndTxt( "motionCorrect:usage", "Incorrect number of inputs/outputs provided." );
   }
@@ -183,11 +340,18 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
   const bool                  preferSmallest  = ( nrhs >  9 ? mxGetScalar(prhs[9]) > 0     : false  );
   const int                   methodInterp    = ( nrhs > 10 ? int( mxGetScalar(prhs[10]))  : cv::InterpolationFlags::INTER_LINEAR     );
   const int                   methodCorr      = ( nrhs > 11 ? int( mxGetScalar(prhs[11]))  : cv::TemplateMatchModes::TM_CCOEFF_NORMED );
-  const double                usrEmptyValue   = ( nrhs > 12 ?      mxGetScalar(prhs[12])   : 0.     );
-  const bool                  emptyIsMean     = ( nrhs <=13 );
+  const bool                  emptyIsMean     = ( nrhs <= 12 || mxIsEmpty(prhs[12]) );
+  const double                usrEmptyValue   = ( emptyIsMean ? 0. : mxGetScalar(prhs[12]) );
+  const int                   numThreads      = ( nrhs > 13 && !mxIsEmpty(prhs[13]) ? int( mxGetScalar(prhs[13]) ) : defaultNumThreads() );
+  const int                   pyramidLevels   = ( nrhs > 14 ? int( mxGetScalar(prhs[14]) )  : 0      );
+  bool                        streamFrames    = ( nrhs > 15 ? mxGetScalar(prhs[15]) > 0    : false  );
+  const mxArray*              metricStorage   = ( nrhs > 16 && !mxIsEmpty(prhs[16]) ? prhs[16] : 0 );
   const bool                  subPixelReg     = ( methodInterp >= 0 );
+  const bool                  usePhaseCorr    = ( methodCorr == METHOD_PHASE_CORR );
+  if (methodCorr < 0 || methodCorr > METHOD_PHASE_CORR)
+    mexErrMsgIdAndTxt( "motionCorrect:arguments", "Unsupported methodCorr = %d.", methodCorr );
 
-  
+ 
   //---------------------------------------------------------------------------
 
   std::vector<cv::Mat>        imgStack, refStack;
@@ -196,7 +360,7 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
   if (mxIsCell(input)) {
     if (mxGetNumberOfElements(input) != 2)
       mexErrMsgIdAndTxt( "motionCorrect:input", "If input is a cell array, it must be of the form {input,template}." );
-    
+   
     const mxArray*            matTemplate     = mxGetCell(input, 1);
     if (!mxIsNumeric(matTemplate) || mxIsComplex(matTemplate))
       mexErrMsgIdAndTxt( "motionCorrect:template", "template must be a numeric matrix (image)." );
@@ -219,16 +383,62 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
 
 
   // If a matrix is directly provided, need to copy it into OpenCV format
-  char*                       inputPath       = ( mxIsChar(input) 
-                                               && mxGetNumberOfDimensions(input) < 3 
+  char*                       inputPath       = ( mxIsChar(input)
+                                               && mxGetNumberOfDimensions(input) < 3
                                                && ( mxGetN(input) == 1 || mxGetM(prhs[1]) == 1 )
-                                                ? mxArrayToString(input) 
-                                                : 0 
+                                                ? mxArrayToString(input)
+                                                : 0
+                                                );
+  // Uncompressed files with contiguous pages are accessed directly via memory mapping
+  TiffIndex                   index;
+  MappedTiff                  mapped;
+  const int                   mappedType      = ( inputPath && index.build(inputPath) && mapped.open(inputPath, index)
+                                                ? cvTiffSampleType(mapped.bitsPerSample, mapped.sampleFormat)
+                                                : -1
                                                 );
+
+  // Decoded frames are prefetched a bounded number of pages ahead of where they are read
+  TiffReadAhead               readAhead;
+  if (!index.empty())
+    readAhead.open(inputPath, index);
+  TiffFrameSource             source;
+  std::vector<size_t>         framePages;     // for streamed input
+
+  // Truncated files (e.g. from a crashed acquisition) are processed up to the last intact page
+  const size_t                numIntact       = index.numIntact();
+  if (!index.empty() && (numIntact < index.numPages() || !index.complete))
+    mexWarnMsgIdAndTxt( "motionCorrect:truncated", "Input file is truncated, only the first %d intact frames will be motion corrected."
+                      , static_cast<int>(numIntact) );
+
   if (!inputPath)
     cvMatlabCall<MatlabToCVMat>(imgStack, mxGetClassID(input), input, firstFrame, skipFrames);
 
-  // Otherwise load image with stored bit depth
+  // Frames are read-only headers referencing the mapped file. Only the first pages are
+  // prefetched, to overlap with the processing of the first frames, and the rest are paged
+  // in on demand so as not to flood the page cache for large files
+  else if (mappedType >= 0) {
+    readAhead.advance(firstFrame, 1 + skipFrames);
+    for (size_t iPage = firstFrame; iPage < numIntact; iPage += 1 + skipFrames) {
+      imgStack.push_back(cv::Mat(mapped.height, mapped.width, mappedType, const_cast<void*>(mapped.pageData(iPage))));
+    }
+  }
+
+  // Otherwise decode TIFF files via libtiff, directly into the frames of the stack, or
+  // only record which pages are to be decoded on demand if streaming
+  else if (source.open(inputPath, &index)) {
+    for (size_t iPage = firstFrame; iPage < std::min(numIntact, source.numPages()); iPage += 1 + skipFrames) {
+      if (streamFrames) {
+        framePages.push_back(iPage);
+        continue;
+      }
+      readAhead.advance(iPage, 1 + skipFrames);
+      imgStack.push_back(cv::Mat(source.height, source.width, source.type));
+      if (!source.read(iPage, imgStack.back().data))
+        mexErrMsgIdAndTxt( "motionCorrect:load", "Failed to decode frame %d of input image.", static_cast<int>(iPage + 1) );
+    }
+  }
+
+  // Other formats are loaded by OpenCV with stored bit depth
 #ifdef __OPENCV_HACK_SAK__
   else if (!cv::imreadmulti(inputPath, imgStack, cv::ImreadModes::IMREAD_UNCHANGED, firstFrame, skipFrames))
       mexErrMsgIdAndTxt( "motionCorrect:load", "Failed to load input image." );
@@ -248,94 +458,76 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
 
 
 
+  // Streaming only applies to files decoded via libtiff
+  streamFrames                = !framePages.empty();
+
   // Sanity checks on image stack
-  if (imgStack.empty())
+  const size_t                numFrames       = ( streamFrames ? framePages.size() : imgStack.size() );
+  if (numFrames < 1)
     mexErrMsgIdAndTxt( "motionCorrect:load", "Input image has no frames." );
-  if (imgStack[0].cols * imgStack[0].rows < 3)
+  const int                   frameRows       = ( streamFrames ? source.height : imgStack[0].rows );
+  const int                   frameCols       = ( streamFrames ? source.width  : imgStack[0].cols );
+  if (frameCols * frameRows < 3)
     mexErrMsgIdAndTxt( "motionCorrect:load", "Input image too small, must have at least 3 pixels." );
 
   // The frame rebinning factor (for computation of median only) must be a divisor of
   // the number of frames to avoid edge artifacts
-  const size_t                numFrames       = imgStack.size();
-  size_t                      numMedian       = static_cast<size_t>(std::ceil( 1.0 * imgStack.size() / medianRebin ));
+  size_t                      numMedian       = static_cast<size_t>(std::ceil( 1.0 * numFrames / medianRebin ));
 
 
 
   // The template size restricts the maximum allowable shift
-  const int                   firstRefRow     = std::min(maxShift, (imgStack[0].rows - 1)/2);
-  const int                   firstRefCol     = std::min(maxShift, (imgStack[0].cols - 1)/2);
+  const int                   firstRefRow     = std::min(maxShift, (frameRows - 1)/2);
+  const int                   firstRefCol     = std::min(maxShift, (frameCols - 1)/2);
   const size_t                metricSize[]    = {size_t(2*firstRefRow + 1), size_t(2*firstRefCol + 1), numFrames};
   const int                   metricOffset    = static_cast<int>( metricSize[0] * metricSize[1] );
 
-  // If so desired, omit black (empty) frames
+  // If so desired, omit black (empty) frames; streamed frames are checked as they are first read
   std::vector<bool>           isEmpty;
   double                      blackValue      = mxGetNaN();
-  if (emptyProb > 0) {
-    if (usrBlackValue)        blackValue      = usrBlackValue[1];
-    double*                   ptrZeroValue    = &blackValue;
+  double*                     ptrZeroValue    = &blackValue;
+  if (emptyProb > 0 && usrBlackValue)
+    blackValue                = usrBlackValue[1];
+  if (emptyProb > 0 && !streamFrames)
     cvCall<DetectEmptyFrames>(imgStack, isEmpty, emptyProb, ptrZeroValue);
-  }
-  else isEmpty.assign(imgStack.size(), false);
-
-
-#ifndef __OPENCV_HACK_SAK__
-  //...........................................................................
-  // HACK to fix intrinsic OpenCV problem where signed integer data is loaded as unsigned 
-  // -- detect this condition by seeing if the data range is much more compact when 
-  // converted to signed integers
-  std::vector<cv::Mat>        origStack;
-  if (inputPath) {
-    for (int iFrame = 0; iFrame < imgStack.size(); ++iFrame) {
-      if (isEmpty[iFrame])    continue;
-
-      // Only consider unsigned integer types
-      double                  signedRange, unsignedRange;
-      switch (imgStack[iFrame].depth()) {
-      case CV_8U :
-        GetSignedUnsignedRange<uchar, schar>()(imgStack[iFrame], signedRange, unsignedRange);
-        if (signedRange < 0.5 * unsignedRange) {
-          mexWarnMsgIdAndTxt("motionCorrect:signedData", "Guessed that data is signed 8-bit based on signed range = %.5g vs. unsigned range = %.5g: %s", signedRange, unsignedRange, inputPath);
-          typecastCVData(imgStack, origStack, CV_8S);
-        }
-        break;
-      case CV_16U:
-        GetSignedUnsignedRange<ushort, short>()(imgStack[iFrame], signedRange, unsignedRange);
-        if (signedRange < 0.5 * unsignedRange) {
-          mexWarnMsgIdAndTxt("motionCorrect:signedData", "Guessed that data is signed 16-bit based on signed range = %.5g vs. unsigned range = %.5g: %s", signedRange, unsignedRange, inputPath);
-          typecastCVData(imgStack, origStack, CV_16S);
-        }
-        break;
-      }
-
-      break;
-    }
-  }
-  //...........................................................................
-#endif //__OPENCV_HACK_SAK__
-
+  else isEmpty.assign(numFrames, false);
 
 
 
   // Create output structure
   mxArray*                    outXShifts      = mxCreateDoubleMatrix(numFrames, maxIter, mxREAL);
   mxArray*                    outYShifts      = mxCreateDoubleMatrix(numFrames, maxIter, mxREAL);
-  mxArray*                    outStackMetric  = mxCreateNumericArray(3, metricSize, mxSINGLE_CLASS, mxREAL);
+  // Metric values are stored for all frames, a subset of frames, or in a file
+  char*                       metricPath      = ( metricStorage && mxIsChar(metricStorage) ? mxArrayToString(metricStorage) : 0 );
+  const double                metricStride    = ( metricStorage && !metricPath ? mxGetScalar(metricStorage) : 1 );
+  if (!(metricStride >= 1))
+    mexErrMsgIdAndTxt( "motionCorrect:arguments", "metricStorage must be a path or a stride >= 1." );
+  const size_t                storeStride     = ( mxIsInf(metricStride) ? numFrames : static_cast<size_t>(metricStride) );
+  const size_t                storedSize[]    = { metricSize[0], metricSize[1]
+                                                , metricPath || mxIsInf(metricStride) ? 0 : (numFrames + storeStride - 1) / storeStride
+                                                };
+  mxArray*                    outStackMetric  = ( metricPath ? mxCreateString(metricPath) : mxCreateNumericArray(3, storedSize, mxSINGLE_CLASS, mxREAL) );
   mxArray*                    outOptimMetric  = mxCreateDoubleMatrix(numFrames, 1, mxREAL);
   double*                     xShifts         = mxGetPr(outXShifts);
   double*                     yShifts         = mxGetPr(outYShifts);
-  float*                      stackMetric     = (float*) mxGetData(outStackMetric);
+  MetricStore                 metricStore;
+  if (!metricPath)            metricStore.setMemory(storedSize[2] ? (float*) mxGetData(outStackMetric) : 0, metricOffset, storeStride);
+  else if (!metricStore.openFile(metricPath, metricOffset))
+    mexErrMsgIdAndTxt( "motionCorrect:metric", "Failed to create metric file %s.", metricPath );
   double*                     optimMetric     = mxGetPr(outOptimMetric);
 
-  MatToMatlab<float,float>    dataCopier;
-
-  
+ 
   //---------------------------------------------------------------------------
-  // Preallocate temporary storage for computations
-  cv::Mat                     frmInput  (imgStack[0].rows, imgStack[0].cols, CV_32F);
-  cv::Mat                     frmTemp   (imgStack[0].rows, imgStack[0].cols, CV_32F);
-  cv::Mat                     imgRef    (imgStack[0].rows, imgStack[0].cols, CV_32F);
-  cv::Mat                     metric    (metricSize[0]   , metricSize[1]   , CV_32F);
-  cv::Mat                     refRegion       = imgRef(cv::Rect(firstRefCol, firstRefRow, imgStack[0].cols - 2*firstRefCol, imgStack[0].rows - 2*firstRefRow));
+  // Preallocate temporary storage for computations, including one workspace per thread
+  const int                   numWorkers      = ( displayProgress ? 1 : static_cast<int>(std::max<size_t>(1, std::min<size_t>(std::max(numThreads, 1), numMedian))) );
+  std::vector<RegisterScratch> workspace      ( numWorkers );
+  for (int iThread = 0; iThread < numWorkers; ++iThread)
+    workspace[iThread].create(frameRows, frameCols, static_cast<int>(metricSize[0]), static_cast<int>(metricSize[1]));
+  cv::Mat                     frmTemp   (frameRows, frameCols, CV_32F);
+  cv::Mat                     imgRef    (frameRows, frameCols, CV_32F);
+  cv::Mat                     refRegion       = imgRef(cv::Rect(firstRefCol, firstRefRow, frameCols - 2*firstRefCol, frameRows - 2*firstRefRow));
+  PhaseCorrelation            phaseCorr;
+  TemplateMatch               templateMatch;
 
   std::vector<float>          traceTemp (std::max(numMedian, refStack.size()));
   std::vector<cv::Mat>        imgShifted(numMedian);
@@ -343,14 +535,8 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
   std::vector<double>         radius2;
 
   // Precompute squared radius of each metric pixel from the center, for finding local optima
-  if (preferSmallest) {
-    radius2.resize(metric.rows * metric.cols);
-    for (int row = 0, index = 0; row < metric.rows; ++row) {
-      const double            dRow2           = sqr( row - 0.5*metric.rows );
-      for (int col = 0; col < metric.cols; ++col, ++index)
-        radius2[index]        = dRow2 + sqr( col - 0.5*metric.cols );
-    }
-  }
+  if (preferSmallest)
+    computeRadius2(radius2, static_cast<int>(metricSize[0]), static_cast<int>(metricSize[1]));
 
 
   // Translation matrix, for use with sub-pixel registration
@@ -362,30 +548,68 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
   yTrans[1]                   = 1;
 
 
-  // Copy frames to temporary storage with the appropriate resolution
+  // Streamed frames are decoded on demand by each thread, into its own workspace
+  if (streamFrames)
+    for (int iThread = 0; iThread < numWorkers; ++iThread)
+      if (!workspace[iThread].source.open(inputPath, &index))
+        mexErrMsgIdAndTxt( "motionCorrect:load", "Failed to open input file for streaming." );
+  auto                        loadFrame       = [&](const size_t iFrame, RegisterScratch& scratch) -> const cv::Mat* {
+    if (!streamFrames)        return &imgStack[iFrame];
+    if (!scratch.source.read(framePages[iFrame], scratch.frmRaw))
+      return 0;
+    return &scratch.frmRaw;
+  };
+
+
+  // Copy frames to temporary storage with the appropriate resolution. For streamed input
+  // this is the first pass through the file, in which empty frames are also detected and
+  // statistics accumulated
+  const bool                  needStatistics  = ( displayProgress || emptyIsMean );
+  SampleStatistics            inputStats;
   medWeight.assign(numMedian, 1.);
   for (size_t iMedian = 0, iFrame = 0; iMedian < numMedian; ++iMedian) {
     int                       count           = 0;
-    imgShifted[iMedian].create(imgStack[0].rows, imgStack[0].cols, CV_32F);
+    imgShifted[iMedian].create(frameRows, frameCols, CV_32F);
     imgShifted[iMedian]       = cv::Scalar(0);
     for (int iBin = 0; iBin < medianRebin && iFrame < numFrames; ++iBin, ++iFrame) {
+      const cv::Mat*          frame           = loadFrame(iFrame, workspace[0]);
+      if (!frame)
+        mexErrMsgIdAndTxt( "motionCorrect:load", "Failed to decode frame %d of input image.", static_cast<int>(framePages[iFrame] + 1) );
+
+      if (streamFrames) {
+        if (emptyProb > 0 && iFrame < 1) {
+          // The first frame determines the zero level, if not provided
+          std::vector<cv::Mat> first          ( 1, *frame );
+          std::vector<bool>   firstIsEmpty;
+          cvCall<DetectEmptyFrames>(first, firstIsEmpty, emptyProb, ptrZeroValue);
+          isEmpty[iFrame]     = firstIsEmpty[0];
+        }
+        else if (emptyProb > 0) {
+          bool                frameIsEmpty    = false;
+          cvCall<DetectEmptyFrames>(*frame, frameIsEmpty, emptyProb, blackValue);
+          isEmpty[iFrame]     = frameIsEmpty;
+        }
+        if (needStatistics)
+          cvCall<AccumulateMatStatistics>(*frame, inputStats);
+      }
+
       if (isEmpty[iFrame])    continue;
-      cvCall<AddImage32>(imgStack[iFrame], imgShifted[iMedian]);
+      cvCall<AddImage32>(*frame, imgShifted[iMedian]);
       ++count;
     }
     if (count)
       medWeight[iMedian]      = 1. / count;
-    else 
+    else
       imgShifted[iMedian]     = cv::Scalar(mxGetNaN());
   }
 
-                                                                            
+                                                                           
   // Obtain some global statistics to be used for data scaling and display
   double                      showMin, showMax, templateMin, templateMax;
-  SampleStatistics            inputStats;
-  if (displayProgress || emptyIsMean)
+  if (needStatistics)
   {
-    cvCall<AccumulateMatStatistics>(imgStack, inputStats);
+    if (!streamFrames)
+      cvCall<AccumulateMatStatistics>(imgStack, inputStats);
     if (inputStats.getMaximum() <= inputStats.getMinimum())
       mexErrMsgIdAndTxt( "motionCorrect:image", "Invalid range [%.3g, %.3g] of pixel values in image stack; the image cannot be completely uniform for motion correction.", inputStats.getMaximum(), inputStats.getMinimum());
     double                    stdDev          = inputStats.getRMS();
@@ -399,20 +623,29 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
     templateMin               = std::max(medianStats.getMinimum(), harmonicMean(medianStats.getMinimum(), medianStats.getMean(), -2*stdDev));
     templateMax               = std::min(medianStats.getMaximum(), harmonicMean(medianStats.getMaximum(), medianStats.getMean(), +5*stdDev));
   }
-  
+ 
   const cv::Scalar            emptyValue( emptyIsMean ? inputStats.getMean() : usrEmptyValue );
   char                        strTemplate[1000];
-  
+ 
   if (displayProgress) {
     cv::namedWindow("Corrected", CV_WINDOW_NORMAL | CV_WINDOW_KEEPRATIO | CV_GUI_EXPANDED);
-    cv::resizeWindow("Corrected", imgStack[0].cols, imgStack[0].rows);
+    cv::resizeWindow("Corrected", frameCols, frameRows);
   }
 
-  
+ 
   //---------------------------------------------------------------------------
 
   const bool                  useMinimum      = (methodCorr == cv::TemplateMatchModes::TM_SQDIFF || methodCorr == cv::TemplateMatchModes::TM_SQDIFF_NORMED);
   Comparator                  optimReject     = useMinimum ? greaterThan : lessThan;
+
+  // Downsampled templates for a coarse-to-fine search, where the local optimum is selected at the coarsest level
+  TemplatePyramid             pyramid         ( frameRows, frameCols, firstRefRow, firstRefCol
+                                              , usePhaseCorr ? 0 : pyramidLevels, methodCorr, useMinimum
+                                              );
+  const bool                  usePyramid      = ( pyramid.numLevels() > 0 );
+  std::vector<double>         coarseRadius2;
+  if (usePyramid && preferSmallest)
+    computeRadius2(coarseRadius2, pyramid.coarseSize().height, pyramid.coarseSize().width);
   int                         iteration       = 0;
   double                      midXShift       = 0;
   double                      midYShift       = 0;
@@ -423,7 +656,8 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
     const int                 iPrevX          = ( iteration < 1 ? 0 : static_cast<int>(numFrames) );
     const int                 iPrevY          = ( iteration < 1 ? 0 : static_cast<int>(numFrames) );
 
-    // Compute median image 
+    // Compute median image
+    bool                      refChanged      = true;
     if (iteration > 1 || refStack.empty()) {
       // Scale to compensate for black (omitted) frames
       for (size_t iMedian = 0; iMedian < numMedian; ++iMedian)
@@ -443,7 +677,10 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
       }
       else    cvCall<MedianVecMat32>(imgShifted, imgRef, traceTemp);
     }
-    else      cvCall<MedianVecMat32>(refStack, imgRef, traceTemp  /*, firstRefRow, firstRefCol ????*/);
+    else {
+      cvCall<MedianVecMat32>(refStack, imgRef, traceTemp  /*, firstRefRow, firstRefCol ????*/);
+      refChanged              = ( iteration < 1 );
+    }
 
 
     // Stop if the maximum shift relative to the previous iteration is small enough
@@ -456,7 +693,7 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
       if (refStack.empty())   std::sprintf(strTemplate, "Template (iteration %d) : %d-frame median", iteration, medianRebin);
       else                    std::sprintf(strTemplate, "Template (user provided)");
       cv::namedWindow(strTemplate, CV_WINDOW_NORMAL | CV_WINDOW_KEEPRATIO | CV_GUI_EXPANDED);
-      cv::resizeWindow(strTemplate, imgStack[0].cols, imgStack[0].rows);
+      cv::resizeWindow(strTemplate, frameCols, frameRows);
       imshowrange(strTemplate, imgRef, templateMin, templateMax);
       mexEvalString("drawnow");
     }
@@ -464,111 +701,160 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
 
     //.........................................................................
 
-    // Loop through frames and correct each one
-    float*                    ptrMetric       = stackMetric;
+    // The spectrum, statistics or downsampled versions of the template are computed only when it changes
+    if (refChanged) {
+      if (usePhaseCorr)       phaseCorr.setReference(imgRef);
+      else if (usePyramid)    pyramid.setReference(imgRef);
+      else                    templateMatch.setTemplate(refRegion, imgRef.rows, imgRef.cols, methodCorr);
+    }
+
+    // Loop through frames and correct each one. Each thread takes one median bin at a time, and
+    // writes the shifts and metric values of its frames directly into their slots in the output
+    std::atomic<size_t>       nextMedian      (0);
+    auto                      registerFrames  = [&](const int iThread) {
+      RegisterScratch&        scratch         = workspace[iThread];
+      cv::Mat&                frmInput        = scratch.frmInput;
+      cv::Mat&                metric          = scratch.metric;
+      float*                  xTrans          = scratch.xTrans;
+      float*                  yTrans          = scratch.yTrans;
+      for (size_t iMedian; (iMedian = nextMedian++) < numMedian; ) {
+        const size_t          endFrame        = std::min(numFrames, (iMedian + 1) * medianRebin);
+        bool                  isFirst         = true;
+        for (size_t iFrame = iMedian * medianRebin; iFrame < endFrame; ++iFrame)
+        {
+          // Enforce zero shift for black frames
+          if (isEmpty[iFrame]) continue;
+
+
+          const cv::Mat*      frame           = loadFrame(iFrame, scratch);
+          if (!frame) {
+            scratch.failedFrame = static_cast<int>(iFrame);
+            nextMedian        = numMedian;
+            return;
+          }
+          frame->convertTo(frmInput, CV_32F);
+          //if (displayProgress)    imshowrange("Image", frmInput, showMin, showMax);
+
+
+          // Obtain metric values for all possible shifts and find the optimum
+          cv::Point           optimum;
+          if (usePyramid) {
+            const cv::Mat&    coarse          = pyramid.coarseSearch(frmInput, scratch.pyramid);
+            if (useMinimum)   cv::minMaxLoc(coarse, NULL, NULL, &optimum, NULL    );
+            else              cv::minMaxLoc(coarse, NULL, NULL, NULL    , &optimum);
+            if (preferSmallest)
+              findLocalOptimum(coarse, coarseRadius2, optimum, optimReject);
+            optimum           = pyramid.refine(scratch.pyramid, optimum, metric, optimMetric[iFrame]);
+          }
+          else {
+            if (usePhaseCorr) phaseCorr.correlate(frmInput, scratch.phase, metric, firstRefRow, firstRefCol);
+            else              templateMatch.match(frmInput, scratch.match, metric);
+            if (useMinimum)   cv::minMaxLoc(metric, optimMetric + iFrame, NULL, &optimum, NULL    );
+            else              cv::minMaxLoc(metric, NULL, optimMetric + iFrame, NULL    , &optimum);
+            if (preferSmallest) // This is an additional call so that we default to the global optimum
+              findLocalOptimum(metric, radius2, optimum, optimReject);
+          }
+          metricStore.store(iFrame, metric, scratch.metricBuffer);
+
+
+          // If interpolation is desired, use a gaussian peak fit to resolve it
+          cv::Mat&            frmShifted      = ( medianRebin > 1 ? scratch.frmTemp : imgShifted[iMedian] );
+          double              colShift, rowShift;
+          if (subPixelReg) {
+            double            xPeak, yPeak;
+
+            // Phase correlation peaks are too narrow for a Gaussian fit, but can be upsampled exactly
+            if (usePhaseCorr)
+              phaseCorr.refinePeak(scratch.phase, optimum.y - firstRefRow, optimum.x - firstRefCol, yPeak, xPeak);
+
+            else {
+              // The following are the three rows centered at the optimum
+              const float*    row0            = optimum.y > 0             ? metric.ptr<float>(optimum.y - 1) : 0;
+              const float*    row1            =                             metric.ptr<float>(optimum.y    )    ;
+              const float*    row2            = optimum.y < metric.rows-1 ? metric.ptr<float>(optimum.y + 1) : 0;
+       
+              // Precompute the log value once and for all
+              const double    ln10            = optimum.x > 0             ? log(row1[optimum.x - 1]) : mxGetNaN();
+              const double    ln11            =                             log(row1[optimum.x    ])             ;
+              const double    ln12            = optimum.x < metric.cols-1 ? log(row1[optimum.x + 1]) : mxGetNaN();
+              const double    ln01            = row0                      ? log(row0[optimum.x    ]) : mxGetNaN();
+              const double    ln21            = row2                      ? log(row2[optimum.x    ]) : mxGetNaN();
+       
+              // 1D Gaussian interpolation in each direction
+              xPeak           = ( ln10 - ln12 ) / ( 2 * ln10 - 4 * ln11 + 2 * ln12 );
+              yPeak           = ( ln01 - ln21 ) / ( 2 * ln01 - 4 * ln11 + 2 * ln21 );
+              if (xPeak != xPeak) xPeak           = 0;
+              if (yPeak != yPeak) yPeak           = 0;
+            }
+            xTrans[2]         = colShift      = -( optimum.x - firstRefCol + xPeak );
+            yTrans[2]         = rowShift      = -( optimum.y - firstRefRow + yPeak );
+
+            // Perform an affine transformation i.e. sub-pixel shift via interpolation
+            cv::warpAffine( frmInput, frmShifted, scratch.translator, frmShifted.size()
+                          , methodInterp, cv::BorderTypes::BORDER_CONSTANT, emptyValue
+                          );
+          }
+
+          // In case of no sub-pixel interpolation, perform a simple (and fast) pixel shift
+          else {
+            // Remember that the template is offset so shifts are relative to that
+            colShift          = -( optimum.x - firstRefCol );
+            rowShift          = -( optimum.y - firstRefRow );
+            cvCall<CopyShiftedImage32>(frmShifted, frmInput, rowShift, colShift, emptyValue[0]);
+          }
+
+          // Record history of shifts
+          scratch.maxRelShift = std::max(scratch.maxRelShift, std::fabs(colShift - xShifts[iFrame - iPrevX]));
+          scratch.maxRelShift = std::max(scratch.maxRelShift, std::fabs(rowShift - yShifts[iFrame - iPrevY]));
+          xShifts[iFrame]     = colShift;
+          yShifts[iFrame]     = rowShift;
+          scratch.minXShift   = std::min(scratch.minXShift, colShift);
+          scratch.minYShift   = std::min(scratch.minYShift, rowShift);
+          scratch.maxXShift   = std::max(scratch.maxXShift, colShift);
+          scratch.maxYShift   = std::max(scratch.maxYShift, rowShift);
+
+
+          if (displayProgress) {
+            //imshoweq("Corrected", frmShifted, -minValue);
+            imshowrange("Corrected", frmShifted, showMin, showMax);
+            mexEvalString("drawnow");
+          }
+
+
+          // Aggregate frames for median computation if so requested; the bin is owned by this thread
+          if (isFirst) {
+            isFirst           = false;
+            frmShifted.copyTo(imgShifted[iMedian]);
+          }
+          else
+            imgShifted[iMedian] += frmShifted;
+        } // end loop over frames
+      } // end loop over median bins
+    };
+
+    // Display requires all frames to be processed in the main thread
+    for (int iThread = 0; iThread < numWorkers; ++iThread)
+      workspace[iThread].reset();
+    std::string               error;
+    if (numWorkers < 2)       registerFrames(0);
+    else if (!runThreads(numWorkers, registerFrames, &error))
+      mexErrMsgIdAndTxt( "motionCorrect:register", "Failed to register frames: %s", error.c_str() );
+    for (int iThread = 0; iThread < numWorkers; ++iThread)
+      if (workspace[iThread].failedFrame >= 0)
+        mexErrMsgIdAndTxt( "motionCorrect:load", "Failed to decode frame %d of input image.", static_cast<int>(framePages[workspace[iThread].failedFrame] + 1) );
+    if (!metricStore.good())
+      mexErrMsgIdAndTxt( "motionCorrect:metric", "Failed to write metric values to %s.", metricPath );
+
     double                    minXShift       = 1e308, maxXShift = -1e308;
     double                    minYShift       = 1e308, maxYShift = -1e308;
     maxRelShift               = -1e308;
-    for (size_t iFrame = 0, iMedian = 0, iBin = 0, isFirst = true; iFrame < numFrames; ++iFrame) 
-    {
-      // Enforce zero shift for black frames
-      if (isEmpty[iFrame]) {
-        if (++iBin >= medianRebin) {
-          iBin                = 0;
-          isFirst             = true;
-          ++iMedian;
-        }
-        continue;
-      }
-
-
-      imgStack[iFrame].convertTo(frmInput, CV_32F);
-      //if (displayProgress)    imshowrange("Image", frmInput, showMin, showMax);
-
-
-      // Obtain metric values for all possible shifts and find the optimum
-      cv::Point               optimum;
-      cv::matchTemplate(frmInput, refRegion, metric, methodCorr);
-      if (useMinimum)         cv::minMaxLoc(metric, optimMetric + iFrame, NULL, &optimum, NULL    );
-      else                    cv::minMaxLoc(metric, NULL, optimMetric + iFrame, NULL    , &optimum);
-      if (preferSmallest)     // This is an additional call so that we default to the global optimum
-        findLocalOptimum(metric, radius2, optimum, optimReject);
-      dataCopier(metric, CV_32F, ptrMetric);
-      ptrMetric              += metricOffset;
-
-
-      // If interpolation is desired, use a gaussian peak fit to resolve it
-      cv::Mat&                frmShifted      = ( medianRebin > 1 ? frmTemp : imgShifted[iMedian] );
-      double                  colShift, rowShift;
-      if (subPixelReg) {
-
-        // The following are the three rows centered at the optimum
-        const float*          row0            = optimum.y > 0             ? metric.ptr<float>(optimum.y - 1) : 0;
-        const float*          row1            =                             metric.ptr<float>(optimum.y    )    ;
-        const float*          row2            = optimum.y < metric.rows-1 ? metric.ptr<float>(optimum.y + 1) : 0;
-        
-        // Precompute the log value once and for all
-        const double          ln10            = optimum.x > 0             ? log(row1[optimum.x - 1]) : mxGetNaN();
-        const double          ln11            =                             log(row1[optimum.x    ])             ;
-        const double          ln12            = optimum.x < metric.cols-1 ? log(row1[optimum.x + 1]) : mxGetNaN();
-        const double          ln01            = row0                      ? log(row0[optimum.x    ]) : mxGetNaN();
-        const double          ln21            = row2                      ? log(row2[optimum.x    ]) : mxGetNaN();
-        
-        // 1D Gaussian interpolation in each direction
-        double                xPeak           = ( ln10 - ln12 ) / ( 2 * ln10 - 4 * ln11 + 2 * ln12 );
-        double                yPeak           = ( ln01 - ln21 ) / ( 2 * ln01 - 4 * ln11 + 2 * ln21 );
-        if (xPeak != xPeak)   xPeak           = 0;
-        if (yPeak != yPeak)   yPeak           = 0;
-        xTrans[2]             = colShift      = -( optimum.x - firstRefCol + xPeak );
-        yTrans[2]             = rowShift      = -( optimum.y - firstRefRow + yPeak );
-
-        // Perform an affine transformation i.e. sub-pixel shift via interpolation
-        cv::warpAffine( frmInput, frmShifted, translator, frmShifted.size()
-                      , methodInterp, cv::BorderTypes::BORDER_CONSTANT, emptyValue
-                      );
-      }
-
-      // In case of no sub-pixel interpolation, perform a simple (and fast) pixel shift
-      else {
-        // Remember that the template is offset so shifts are relative to that
-        colShift              = -( optimum.x - firstRefCol );
-        rowShift              = -( optimum.y - firstRefRow );
-        cvCall<CopyShiftedImage32>(frmShifted, frmInput, rowShift, colShift, emptyValue[0]);
-      }
-
-      // Record history of shifts
-      maxRelShift             = std::max(maxRelShift, std::fabs(colShift - xShifts[iFrame - iPrevX]));
-      maxRelShift             = std::max(maxRelShift, std::fabs(rowShift - yShifts[iFrame - iPrevY]));
-      xShifts[iFrame]         = colShift;
-      yShifts[iFrame]         = rowShift;
-      minXShift               = std::min(minXShift, colShift);
-      minYShift               = std::min(minYShift, rowShift);
-      maxXShift               = std::max(maxXShift, colShift);
-      maxYShift               = std::max(maxYShift, rowShift);
-
-
-      if (displayProgress) {
-        //imshoweq("Corrected", frmShifted, -minValue);
-        imshowrange("Corrected", frmShifted, showMin, showMax);
-        mexEvalString("drawnow");
-      }
-
-
-      // Aggregate frames for median computation if so requested
-      if (iMedian >= numMedian)
-        mexErrMsgIdAndTxt( "motionCorrect:sanity", "Invalid median bin %d >= %d, should not be possible.", iMedian, numMedian);
-      if (isFirst) {
-        isFirst               = false;
-        frmShifted.copyTo(imgShifted[iMedian]);
-      }
-      else 
-        imgShifted[iMedian] += frmShifted;
-      if (++iBin >= medianRebin) {
-        iBin                  = 0;
-        isFirst               = true;
-        ++iMedian;
-      }
-    } // end loop over frames
+    for (int iThread = 0; iThread < numWorkers; ++iThread) {
+      minXShift               = std::min(minXShift  , workspace[iThread].minXShift  );
+      minYShift               = std::min(minYShift  , workspace[iThread].minYShift  );
+      maxXShift               = std::max(maxXShift  , workspace[iThread].maxXShift  );
+      maxYShift               = std::max(maxYShift  , workspace[iThread].maxYShift  );
+      maxRelShift             = std::max(maxRelShift, workspace[iThread].maxRelShift);
+    }
 
 
     // Adjust shifts so that they span the range symmetrically
@@ -634,11 +920,13 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
   static const char*          METRIC_FIELDS[] = { "name"
                                                 , "values"
                                                 , "optimum"
+                                                , "stride"
                                                 };
-  mxArray*                    outMetric       = mxCreateStructMatrix(1, 1, 3, METRIC_FIELDS);
+  mxArray*                    outMetric       = mxCreateStructMatrix(1, 1, 4, METRIC_FIELDS);
   mxSetField(outMetric, 0, "name"       , mxCreateString(METHOD_CORR[methodCorr]));
   mxSetField(outMetric, 0, "values"     , outStackMetric);
   mxSetField(outMetric, 0, "optimum"    , outOptimMetric);
+  mxSetField(outMetric, 0, "stride"     , mxCreateDoubleScalar(metricStride));
 
   // Motion correction data structure
   static const char*          OUT_FIELDS[]    = { "xShifts"
@@ -654,9 +942,9 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
 
   mxArray*                    outSize         = mxCreateDoubleMatrix(1, 3, mxREAL);
   double*                     sizePtr         = mxGetPr(outSize);
-  sizePtr[0]                  = imgStack[0].rows;
-  sizePtr[1]                  = imgStack[0].cols;
-  sizePtr[2]                  = imgStack.size();
+  sizePtr[0]                  = frameRows;
+  sizePtr[1]                  = frameCols;
+  sizePtr[2]                  = numFrames;
   mxSetField(plhs[0], 0, "xShifts"  , outXShifts);
   mxSetField(plhs[0], 0, "yShifts"  , outYShifts);
   mxSetField(plhs[0], 0, "inputSize", outSize);
@@ -679,5 +967,10 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
   // Memory cleanup
   if (inputPath)
     mxFree(inputPath);
+  if (metricPath) {
+    if (!metricStore.close())
+      mexWarnMsgIdAndTxt( "motionCorrect:metric", "Failed to finish writing metric values to %s.", metricPath );
+    mxFree(metricPath);
+  }
 }
 
@@ -0,0 +1,125 @@
+/**
+  Loads frames from a movie file written by cv.imwritex(), which stores processed (e.g. motion corrected
+  and downsampled) frames so that they can be reloaded without decoding and registering the original
+  image stacks.
+
+  Usage syntax:
+    [movie, info] = readMovie( inputPath, [frameRange = []], [numThreads = number of cores] );
+
+  frameRange can be either empty to load all frames, a scalar N to load the first N frames (N = 0 to
+  only obtain info), or [first, last] to load frames first through last (1-based and inclusive, with
+  last = inf for the end of the movie).
+
+  The output layout follows that in which the movie was written: frame-major movies are returned as
+  a height x width x numFrames array, as for cv.imreadx(), whereas pixel-major movies are returned as
+  a numFrames x (height * width) matrix, i.e. with the time trace of each pixel contiguous in memory.
+
+  The info structure contains the dimensions, layout and compression of the movie, as well as a
+  metadata structure with the information stored when writing the movie (the original input size,
+  the applied shifts, and any additional metadata provided to cv.imwritex()).
+
+  The file is memory-mapped, and only the chunks that contain the requested frames are accessed.
+  Chunks are decompressed and copied into the output by numThreads threads in parallel.
+*/
+
+
+#include <cmath>
+#include <string>
+#include <algorithm>
+#include <mex.h>
+#include "lib/workerThreads.h"
+#include "lib/movieFile.h"
+
+
+
+///////////////////////////////////////////////////////////////////////////
+// Main entry point to a MEX function
+///////////////////////////////////////////////////////////////////////////
+
+
+void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
+{
+  // Check inputs to mex function
+  if (nrhs < 1 || nrhs > 3 || nlhs > 2 || !mxIsChar(prhs[0])) {
+    mexEvalString("help cv.readMovie");
+    mexErrMsgIdAndTxt ( "readMovie:usage", "Incorrect number of inputs/outputs provided." );
+  }
+
+  const int                   numThreads      = ( nrhs > 2 && !mxIsEmpty(prhs[2]) ? int( mxGetScalar(prhs[2]) ) : defaultNumThreads() );
+
+  char*                       inputPath       = mxArrayToString(prhs[0]);
+  MovieFile                   movie;
+  std::string                 error;
+  const bool                  isOpen          = movie.open(inputPath, error);
+  mxFree(inputPath);
+  if (!isOpen)
+    mexErrMsgIdAndTxt("readMovie:load", "%s", error.c_str());
+
+  const MovieHeader&          header          = movie.header;
+  const double                totalFrames     = static_cast<double>(header.numFrames);
+
+  // Parse frame range
+  double                      firstFrame      = 1;
+  double                      lastFrame       = totalFrames;
+  if (nrhs > 1 && !mxIsEmpty(prhs[1])) {
+    const size_t              nFrameCount     = mxGetNumberOfElements(prhs[1]);
+    const double*             frameRange      = mxGetPr(prhs[1]);
+    if (!mxIsDouble(prhs[1]) || nFrameCount > 2)
+      mexErrMsgIdAndTxt( "readMovie:arguments", "frameRange must be a scalar or [first, last].");
+    if (nFrameCount == 1)
+      lastFrame               = std::min(frameRange[0], totalFrames);
+    else {
+      firstFrame              = frameRange[0];
+      lastFrame               = std::min(frameRange[1], totalFrames);
+    }
+    if (!(firstFrame >= 1) || firstFrame != std::floor(firstFrame) || !(lastFrame >= firstFrame - 1) || lastFrame != std::floor(lastFrame))
+      mexErrMsgIdAndTxt( "readMovie:arguments", "Invalid frameRange [%g, %g] for a movie with %d frames.", firstFrame, lastFrame, static_cast<int>(totalFrames));
+  }
+  const size_t                numFrames       = static_cast<size_t>(lastFrame - firstFrame + 1);
+
+
+  //---------------------------------------------------------------------------
+  const size_t                framePixels     = static_cast<size_t>(header.framePixels());
+  if (header.layout == MOVIE_PIXEL_MAJOR)
+    plhs[0]                   = mxCreateNumericMatrix(numFrames, framePixels, mxSINGLE_CLASS, mxREAL);
+  else {
+    const size_t              dimension[]     = { static_cast<size_t>(header.height), static_cast<size_t>(header.width), numFrames };
+    plhs[0]                   = mxCreateNumericArray(3, dimension, mxSINGLE_CLASS, mxREAL);
+  }
+
+  if (!movie.read((float*) mxGetData(plhs[0]), static_cast<size_t>(firstFrame - 1), numFrames, numThreads, error))
+    mexErrMsgIdAndTxt("readMovie:load", "%s", error.c_str());
+
+
+  //---------------------------------------------------------------------------
+  if (nlhs > 1) {
+    mxArray*                  metadata        = parseMetadata(movie.metadata(), static_cast<size_t>(header.metadataBytes));
+    if (!metadata)
+      mexErrMsgIdAndTxt("readMovie:load", "Malformed metadata in movie file.");
+
+    static const char*        INFO_FIELDS[]   = { "height"
+                                                , "width"
+                                                , "numFrames"
+                                                , "frames"
+                                                , "layout"
+                                                , "compression"
+                                                , "framesPerChunk"
+                                                , "pixelsPerChunk"
+                                                , "metadata"
+                                                };
+    mxArray*                  frames          = mxCreateDoubleMatrix(1, 2, mxREAL);
+    mxGetPr(frames)[0]        = firstFrame;
+    mxGetPr(frames)[1]        = lastFrame;
+
+    plhs[1]                   = mxCreateStructMatrix(1, 1, 9, INFO_FIELDS);
+    mxSetField(plhs[1], 0, "height"         , mxCreateDoubleScalar(static_cast<double>(header.height)));
+    mxSetField(plhs[1], 0, "width"          , mxCreateDoubleScalar(static_cast<double>(header.width)));
+    mxSetField(plhs[1], 0, "numFrames"      , mxCreateDoubleScalar(totalFrames));
+    mxSetField(plhs[1], 0, "frames"         , frames);
+    mxSetField(plhs[1], 0, "layout"         , mxCreateString(header.layout == MOVIE_PIXEL_MAJOR ? "pixels" : "frames"));
+    mxSetField(plhs[1], 0, "compression"    , mxCreateString(header.codec  == MOVIE_SHUFFLE_RLE ? "shuffle" : "none"));
+    mxSetField(plhs[1], 0, "framesPerChunk" , mxCreateDoubleScalar(static_cast<double>(header.framesPerChunk)));
+    mxSetField(plhs[1], 0, "pixelsPerChunk" , mxCreateDoubleScalar(static_cast<double>(header.pixelsPerChunk)));
+    mxSetField(plhs[1], 0, "metadata"       , metadata);
+  }
+}